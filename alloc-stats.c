@@ -0,0 +1,205 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2002-2004  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#if defined (USE_ALLOC_STATS) && defined (HAVE_MALLOC_USABLE_SIZE)
+#include <malloc.h>
+#endif
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+#include "attribute.h"
+
+/**
+ * DOC: Allocation Statistics
+ *
+ * Allocation Statistics
+ * ---------------------
+ *
+ * When libESMTP is configured with the ``alloc_stats`` option, heap
+ * allocations made by the library are counted.  This is intended for
+ * measuring the cost of sessions, messages and recipients and for
+ * detecting regressions, it is not recommended for production builds.
+ * Allocations made by OpenSSL, the resolver and SASL plugins are not
+ * counted.
+ */
+
+#ifdef USE_ALLOC_STATS
+
+#include <stdatomic.h>
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+#undef strdup
+
+/* Block sizes are taken from the allocator rather than a header prepended
+   to each block.  The library sometimes frees memory allocated by the
+   application, a header would make that impossible.  Without
+   malloc_usable_size() only the number of calls is counted.  */
+#ifdef HAVE_MALLOC_USABLE_SIZE
+# define usable_size(ptr)	malloc_usable_size (ptr)
+#else
+# define usable_size(ptr)	((void) (ptr), (size_t) 0)
+#endif
+
+static atomic_ulong n_allocs, n_reallocs, n_frees, total_bytes;
+static atomic_long current_bytes, peak_bytes;
+
+static void
+account (long delta)
+{
+  long current, peak;
+
+  current = atomic_fetch_add_explicit (&current_bytes, delta,
+				       memory_order_relaxed) + delta;
+  peak = atomic_load_explicit (&peak_bytes, memory_order_relaxed);
+  while (current > peak
+	 && !atomic_compare_exchange_weak_explicit (&peak_bytes, &peak, current,
+						    memory_order_relaxed,
+						    memory_order_relaxed))
+    ;
+}
+
+static void *
+counted (void *ptr)
+{
+  size_t size;
+
+  if (ptr != NULL)
+    {
+      size = usable_size (ptr);
+      atomic_fetch_add_explicit (&n_allocs, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit (&total_bytes, size, memory_order_relaxed);
+      account ((long) size);
+    }
+  return ptr;
+}
+
+void *
+alloc_stats_malloc (size_t size)
+{
+  return counted (malloc (size));
+}
+
+void *
+alloc_stats_calloc (size_t nmemb, size_t size)
+{
+  return counted (calloc (nmemb, size));
+}
+
+#ifdef HAVE_STRDUP
+char *
+alloc_stats_strdup (const char *s)
+{
+  return counted (strdup (s));
+}
+#endif
+
+void *
+alloc_stats_realloc (void *ptr, size_t size)
+{
+  size_t old_size, new_size;
+  void *nptr;
+
+  if (ptr == NULL)
+    return counted (realloc (ptr, size));
+
+  old_size = usable_size (ptr);
+  if ((nptr = realloc (ptr, size)) == NULL)
+    return NULL;
+  new_size = usable_size (nptr);
+  atomic_fetch_add_explicit (&n_reallocs, 1, memory_order_relaxed);
+  if (new_size > old_size)
+    atomic_fetch_add_explicit (&total_bytes, new_size - old_size,
+			       memory_order_relaxed);
+  account ((long) new_size - (long) old_size);
+  return nptr;
+}
+
+void
+alloc_stats_free (void *ptr)
+{
+  if (ptr == NULL)
+    return;
+  atomic_fetch_add_explicit (&n_frees, 1, memory_order_relaxed);
+  account (-(long) usable_size (ptr));
+  free (ptr);
+}
+
+/**
+ * smtp_alloc_stats() - Get allocation statistics.
+ * @stats: Structure to receive the statistics.
+ * @reset: Non-zero to reset the statistics after reading them.
+ *
+ * Get the number of allocations and bytes allocated by libESMTP since the
+ * program started or the statistics were last reset.  Figures are for the
+ * whole process.  On reset, the peak is set to the number of bytes
+ * currently allocated.  A reallocation which grows a block adds the
+ * increase to the total bytes allocated.
+ *
+ * Return: Non-zero on success, zero if the library was built without
+ * allocation statistics.
+ */
+int
+smtp_alloc_stats (struct smtp_alloc_stats *stats, int reset)
+{
+  long current;
+
+  SMTPAPI_CHECK_ARGS (stats != NULL, 0);
+
+  stats->allocs = atomic_load (&n_allocs);
+  stats->reallocs = atomic_load (&n_reallocs);
+  stats->frees = atomic_load (&n_frees);
+  stats->bytes = atomic_load (&total_bytes);
+  current = atomic_load (&current_bytes);
+  stats->current = current > 0 ? current : 0;
+  stats->peak = atomic_load (&peak_bytes);
+  if (reset)
+    {
+      atomic_store (&n_allocs, 0);
+      atomic_store (&n_reallocs, 0);
+      atomic_store (&n_frees, 0);
+      atomic_store (&total_bytes, 0);
+      atomic_store (&peak_bytes, current);
+    }
+  return 1;
+}
+
+#else
+
+int
+smtp_alloc_stats (struct smtp_alloc_stats *stats,
+		  int reset __attribute__ ((unused)))
+{
+  SMTPAPI_CHECK_ARGS (stats != NULL, 0);
+
+  memset (stats, 0, sizeof *stats);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef _alloc_stats_h
+#define _alloc_stats_h
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2002-2004  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* When libESMTP is built with allocation statistics, the library's calls
+   to the standard allocation functions are redirected to wrappers which
+   count them.  This header is included by missing.h so that it applies
+   to every module in the library.  Applications are not affected.  */
+
+#ifdef USE_ALLOC_STATS
+
+#include <stdlib.h>
+#include <string.h>
+
+void *alloc_stats_malloc (size_t size);
+void *alloc_stats_calloc (size_t nmemb, size_t size);
+void *alloc_stats_realloc (void *ptr, size_t size);
+void alloc_stats_free (void *ptr);
+#ifdef HAVE_STRDUP
+char *alloc_stats_strdup (const char *s);
+#endif
+
+#define malloc(size)		alloc_stats_malloc (size)
+#define calloc(nmemb,size)	alloc_stats_calloc (nmemb, size)
+#define realloc(ptr,size)	alloc_stats_realloc (ptr, size)
+#define free(ptr)		alloc_stats_free (ptr)
+/* The replacement strdup() in missing.c uses malloc() and is counted
+   anyway.  */
+#ifdef HAVE_STRDUP
+#define strdup(s)		alloc_stats_strdup (s)
+#endif
+
+#endif
+
+#endif
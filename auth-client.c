@@ -50,6 +50,7 @@
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
+#include <time.h>
 
 #include <missing.h>
 
@@ -69,6 +70,32 @@ struct auth_plugin
   };
 static struct auth_plugin *client_plugins, *end_client_plugins;
 
+/* Bearer tokens are cached for each combination of user and token
+   callback and shared by all contexts using that combination.  When
+   threads are available, tokens are refreshed in the background once
+   three quarters of their lifetime has passed.  */
+struct auth_token
+  {
+    struct auth_token *next;
+    char *user;
+    auth_tokencb_t cb;
+    void *arg;
+    char *token;			/* NULL if not cached */
+    time_t expires;
+    time_t refresh;			/* Time to fetch a new token */
+    int refs;				/* Contexts and refresher using it */
+    int fetching;			/* Callback in progress */
+  };
+static struct auth_token *tokens;
+
+#ifdef USE_PTHREADS
+static pthread_mutex_t token_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t token_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t token_refresher;
+static int token_refresher_running;
+static int token_refresher_stop;
+#endif
+
 struct auth_context
   {
     int min_ssf;
@@ -78,6 +105,8 @@ struct auth_context
     auth_interact_t interact;
     void *interact_arg;
     char *external_id;
+    struct auth_token *token;		/* Token cache entry or NULL */
+    char *token_copy;			/* Token passed to the plugin */
   };
 
 #define mechanism_disabled(p,a,f)		\
@@ -168,6 +197,212 @@ load_client_plugin (const char *name)
   return info;
 }
 
+static void
+token_lock (void)
+{
+#ifdef USE_PTHREADS
+  pthread_mutex_lock (&token_mutex);
+#endif
+}
+
+static void
+token_unlock (void)
+{
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock (&token_mutex);
+#endif
+}
+
+static void
+clear_token (struct auth_token *token)
+{
+  if (token->token != NULL)
+    {
+      memset (token->token, 0, strlen (token->token));
+      free (token->token);
+      token->token = NULL;
+    }
+}
+
+/* Release a reference to a token cache entry.  Call with the token mutex
+   held.  */
+static void
+token_unref (struct auth_token *token)
+{
+  struct auth_token **prev;
+
+  if (--token->refs > 0)
+    return;
+  for (prev = &tokens; *prev != token; prev = &(*prev)->next)
+    ;
+  *prev = token->next;
+  clear_token (token);
+  free (token->user);
+  free (token);
+}
+
+#ifdef USE_PTHREADS
+static void *refresh_tokens (void *arg);
+#endif
+
+/* Call the application to get a new token.  The token mutex is held on
+   entry and exit but not while the callback runs.  If the callback fails,
+   a token which has not expired is kept and a refresh is tried again
+   later.  */
+static void
+fetch_token (struct auth_token *token)
+{
+  char *value;
+  long lifetime;
+  time_t now;
+
+  token->fetching = 1;
+  token_unlock ();
+  lifetime = 0;
+  value = (*token->cb) (token->user, &lifetime, token->arg);
+  token_lock ();
+  token->fetching = 0;
+
+  now = time (NULL);
+  if (value != NULL)
+    {
+      clear_token (token);
+      token->token = value;
+      token->expires = (lifetime > 0) ? now + lifetime : 0;
+      token->refresh = (lifetime > 0) ? now + lifetime - lifetime / 4 : 0;
+#ifdef USE_PTHREADS
+      if (token->refresh != 0 && !token_refresher_running
+	  && pthread_create (&token_refresher, NULL, refresh_tokens, NULL) == 0)
+	token_refresher_running = 1;
+#endif
+    }
+  else if (token->token != NULL && now < token->expires)
+    token->refresh = now + 30;
+  else
+    clear_token (token);
+#ifdef USE_PTHREADS
+  pthread_cond_broadcast (&token_cond);
+#endif
+}
+
+#ifdef USE_PTHREADS
+/* Refresh tokens before they expire so that authentication need never
+   wait for the application to fetch one.  */
+static void *
+refresh_tokens (void *arg __attribute__ ((unused)))
+{
+  struct auth_token *token;
+  struct timespec ts;
+  time_t now, next;
+
+  pthread_mutex_lock (&token_mutex);
+  while (!token_refresher_stop)
+    {
+      now = time (NULL);
+      next = 0;
+      for (token = tokens; token != NULL; token = token->next)
+	{
+	  if (token->token == NULL || token->refresh == 0 || token->fetching)
+	    continue;
+	  if (token->refresh <= now)
+	    break;
+	  if (next == 0 || token->refresh < next)
+	    next = token->refresh;
+	}
+      if (token != NULL)
+	{
+	  /* Hold a reference since the contexts using the token may be
+	     destroyed while the callback runs.  */
+	  token->refs++;
+	  fetch_token (token);
+	  token_unref (token);
+	}
+      else if (next == 0)
+	pthread_cond_wait (&token_cond, &token_mutex);
+      else
+	{
+	  ts.tv_sec = next;
+	  ts.tv_nsec = 0;
+	  pthread_cond_timedwait (&token_cond, &token_mutex, &ts);
+	}
+    }
+  pthread_mutex_unlock (&token_mutex);
+  return NULL;
+}
+#endif
+
+/* Return a copy of the current token, fetching one if none is cached or
+   if the cached token has expired.  */
+static char *
+get_token (struct auth_token *token)
+{
+  char *copy;
+  time_t now;
+
+  token_lock ();
+#ifdef USE_PTHREADS
+  while (token->fetching)
+    pthread_cond_wait (&token_cond, &token_mutex);
+#endif
+  now = time (NULL);
+  if (token->token == NULL || (token->expires != 0 && now >= token->expires))
+    fetch_token (token);
+#ifndef USE_PTHREADS
+  else if (token->refresh != 0 && now >= token->refresh)
+    fetch_token (token);
+#endif
+  copy = (token->token != NULL) ? strdup (token->token) : NULL;
+
+  /* Tokens without a lifetime are used once. */
+  if (token->expires == 0)
+    clear_token (token);
+  token_unlock ();
+  return copy;
+}
+
+static void
+clear_token_copy (auth_context_t context)
+{
+  if (context->token_copy != NULL)
+    {
+      memset (context->token_copy, 0, strlen (context->token_copy));
+      free (context->token_copy);
+      context->token_copy = NULL;
+    }
+}
+
+/* Interaction callback passed to mechanisms when a token callback is set.
+   The user and token are supplied from the cache, anything else is
+   requested from the application's interaction callback, if any.  */
+static int
+token_interact (auth_client_request_t request, char **result, int fields,
+		void *arg)
+{
+  auth_context_t context = arg;
+  int i;
+
+  for (i = 0; i < fields; i++)
+    if (!(request[i].flags & (AUTH_USER | AUTH_TOKEN)))
+      {
+	if (context->interact == NULL
+	    || !(*context->interact) (request, result, fields,
+				      context->interact_arg))
+	  return 0;
+	break;
+      }
+  for (i = 0; i < fields; i++)
+    if (request[i].flags & AUTH_TOKEN)
+      {
+	if (context->token_copy == NULL
+	    && (context->token_copy = get_token (context->token)) == NULL)
+	  return 0;
+	result[i] = context->token_copy;
+      }
+    else if (request[i].flags & AUTH_USER)
+      result[i] = context->token->user;
+  return 1;
+}
+
 /**
  * auth_client_init() - Initialise the auth client.
  *
@@ -205,6 +440,19 @@ auth_client_exit (void)
   client_plugins = end_client_plugins = NULL;
 #ifdef USE_PTHREADS
   pthread_mutex_unlock (&plugin_mutex);
+
+  /* Stop refreshing tokens. */
+  pthread_mutex_lock (&token_mutex);
+  if (token_refresher_running)
+    {
+      token_refresher_stop = 1;
+      pthread_cond_broadcast (&token_cond);
+      pthread_mutex_unlock (&token_mutex);
+      pthread_join (token_refresher, NULL);
+      pthread_mutex_lock (&token_mutex);
+      token_refresher_running = token_refresher_stop = 0;
+    }
+  pthread_mutex_unlock (&token_mutex);
 #endif
 }
 
@@ -228,6 +476,44 @@ auth_create_context (void)
   return context;
 }
 
+/**
+ * auth_copy_context() - Copy an authentication context.
+ * @context: The authentication context to copy.
+ *
+ * Create a new authentication context with the same mechanism flags,
+ * minimum SSF, interaction callback and external identity as @context.
+ * The state of any mechanism selected in @context is not copied.
+ *
+ * Return: The &typedef auth_context_t or %NULL on failure.
+ */
+auth_context_t
+auth_copy_context (auth_context_t context)
+{
+  auth_context_t copy;
+
+  API_CHECK_ARGS (context != NULL, NULL);
+
+  if ((copy = auth_create_context ()) == NULL)
+    return NULL;
+  copy->min_ssf = context->min_ssf;
+  copy->flags = context->flags;
+  copy->interact = context->interact;
+  copy->interact_arg = context->interact_arg;
+  if (context->external_id != NULL
+      && (copy->external_id = strdup (context->external_id)) == NULL)
+    {
+      free (copy);
+      return NULL;
+    }
+  if ((copy->token = context->token) != NULL)
+    {
+      token_lock ();
+      copy->token->refs++;
+      token_unlock ();
+    }
+  return copy;
+}
+
 /**
  * auth_destroy_context() - Destroy an authentication context.
  * @context: The authentication context.
@@ -246,6 +532,15 @@ auth_destroy_context (auth_context_t context)
       if (context->client != NULL && context->client->destroy != NULL)
 	(*context->client->destroy) (context->plugin_ctx);
     }
+  if (context->external_id != NULL)
+    free (context->external_id);
+  if (context->token != NULL)
+    {
+      token_lock ();
+      token_unref (context->token);
+      token_unlock ();
+    }
+  clear_token_copy (context);
   free (context);
   return 1;
 }
@@ -368,6 +663,100 @@ auth_set_interact_cb (auth_context_t context,
   return 1;
 }
 
+/**
+ * auth_set_token_cb() - Set the bearer token callback.
+ * @context: The authentication context.
+ * @user: The user to authenticate.
+ * @cb: Callback to obtain a token, or %NULL.
+ * @arg: User data passed to @cb.
+ *
+ * Supply bearer tokens for token based mechanisms such as ``OAUTHBEARER``
+ * and ``XOAUTH2``.  @cb is called with @user to obtain a new token, which
+ * it must return in memory allocated by malloc().  It should also set the
+ * token's lifetime in seconds.  The library takes ownership of the token
+ * and frees it when it is no longer needed.  If @cb fails it returns
+ * %NULL.
+ *
+ * Tokens are cached and shared by all contexts with the same @user, @cb
+ * and @arg, including those created by auth_copy_context().  When the
+ * library is built with threads, a token is fetched again in a background
+ * thread once three quarters of its lifetime has passed, so authentication
+ * only waits for @cb when no token is cached.  @cb must therefore be thread
+ * safe.  A token without a lifetime is used only once.
+ *
+ * Mechanisms receive the user and token through the interaction callback
+ * which is still used for any other information they request.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+auth_set_token_cb (auth_context_t context, const char *user,
+		   auth_tokencb_t cb, void *arg)
+{
+  struct auth_token *token;
+
+  API_CHECK_ARGS (context != NULL && (cb == NULL || user != NULL), 0);
+
+  token_lock ();
+  if (context->token != NULL)
+    {
+      token_unref (context->token);
+      context->token = NULL;
+    }
+  if (cb == NULL)
+    {
+      token_unlock ();
+      return 1;
+    }
+
+  for (token = tokens; token != NULL; token = token->next)
+    if (token->cb == cb && token->arg == arg && strcmp (token->user, user) == 0)
+      break;
+  if (token == NULL)
+    {
+      if ((token = calloc (1, sizeof (struct auth_token))) == NULL
+	  || (token->user = strdup (user)) == NULL)
+	{
+	  free (token);
+	  token_unlock ();
+	  return 0;
+	}
+      token->cb = cb;
+      token->arg = arg;
+      token->next = tokens;
+      tokens = token;
+    }
+  token->refs++;
+  context->token = token;
+  token_unlock ();
+  return 1;
+}
+
+/**
+ * auth_invalidate_token() - Discard the cached bearer token.
+ * @context: The authentication context.
+ *
+ * Discard the token cached for the context's token callback so that the
+ * next authentication fetches a new one.  libESMTP calls this when the
+ * server rejects the credentials.  An application may call it when it
+ * learns that a token has been revoked.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+auth_invalidate_token (auth_context_t context)
+{
+  API_CHECK_ARGS (context != NULL, 0);
+
+  if (context->token != NULL)
+    {
+      token_lock ();
+      clear_token (context->token);
+      token_unlock ();
+    }
+  return 1;
+}
+
 /**
  * auth_client_enabled() - Check if mechanism is enabled.
  * @context: The authentication context.
@@ -384,7 +773,7 @@ auth_client_enabled (auth_context_t context)
 {
   if (context == NULL)
     return 0;
-  if (context->interact == NULL)
+  if (context->interact == NULL && context->token == NULL)
     return 0;
   return 1;
 }
@@ -475,9 +864,11 @@ auth_response (auth_context_t context, const char *challenge, int *len)
                   && context->client != NULL
                   && len != NULL
 		  && ((context->client->flags & AUTH_PLUGIN_EXTERNAL)
-		       || context->interact != NULL),
+		       || context->interact != NULL
+		       || context->token != NULL),
 		  NULL);
 
+  clear_token_copy (context);
   if (challenge == NULL)
     {
       if (context->plugin_ctx != NULL && context->client->destroy != NULL)
@@ -493,6 +884,10 @@ auth_response (auth_context_t context, const char *challenge, int *len)
       return context->external_id;
     }
   assert (context->client->response != NULL);
+  if (context->token != NULL)
+    return (*context->client->response) (context->plugin_ctx,
+					 challenge, len,
+					 token_interact, context);
   return (*context->client->response) (context->plugin_ctx,
   				       challenge, len,
 				       context->interact,
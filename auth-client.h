@@ -40,6 +40,9 @@ typedef struct auth_context *auth_context_t;
 /* This flag is set for information passed in clear text on the wire */
 #define AUTH_CLEARTEXT			0x0008
 
+/* This flag is set for a bearer token, e.g. OAuth 2.0 */
+#define AUTH_TOKEN			0x0010
+
 struct auth_client_request
   {
     const char *name;	/* Name of field requested from the application,
@@ -58,6 +61,7 @@ typedef const char *(*auth_response_t) (void *ctx,
 
 typedef int (*auth_recode_t) (void *ctx, char **dstbuf, int *dstlen,
 	     		      const char *srcbuf, int srclen);
+typedef char *(*auth_tokencb_t) (const char *user, long *lifetime, void *arg);
 
 /* For enabling mechanisms */
 #define AUTH_PLUGIN_ANONYMOUS	0x01	/* mechanism is anonymous */
@@ -68,6 +72,7 @@ typedef int (*auth_recode_t) (void *ctx, char **dstbuf, int *dstlen,
 void auth_client_init(void);
 void auth_client_exit(void);
 auth_context_t auth_create_context(void);
+auth_context_t auth_copy_context (auth_context_t context);
 int auth_destroy_context(auth_context_t context);
 int auth_set_mechanism_flags (auth_context_t context,
 	                      unsigned set, unsigned clear);
@@ -82,6 +87,9 @@ int auth_get_ssf(auth_context_t context);
 void auth_encode(char **dstbuf, int *dstlen, const char *srcbuf, int srclen, void *arg);
 void auth_decode(char **dstbuf, int *dstlen, const char *srcbuf, int srclen, void *arg);
 int auth_set_external_id (auth_context_t context, const char *identity);
+int auth_set_token_cb (auth_context_t context, const char *user,
+		       auth_tokencb_t cb, void *arg);
+int auth_invalidate_token (auth_context_t context);
 
 #ifdef __cplusplus
 };
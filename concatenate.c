@@ -136,12 +136,11 @@ concatenate (struct catbuf *catbuf, const char *string, int len)
   if (len > 0)
     {
       /* Ensure that the buffer is big enough to accept the string */
-      if (catbuf->buffer == NULL)
-	shortfall = 512;
-      else
-	shortfall = len - (catbuf->allocated - catbuf->string_length);
-      if (shortfall > 0)
+      if (catbuf->string_length + len > catbuf->allocated)
 	{
+	  shortfall = catbuf->string_length + len - catbuf->allocated;
+	  if (catbuf->buffer == NULL && shortfall < 512)
+	    shortfall = 512;
 	  if (shortfall % 128 != 0)
 	    shortfall += 128 - shortfall % 128;
 	  if (!cat_alloc (catbuf, catbuf->allocated + shortfall))
@@ -25,6 +25,21 @@
 #include <sys/types.h>
 #include "hmacmd5.h"
 
+#if HAVE_LIBCRYPTO
+
+/* Use OpenSSL's HMAC which selects the fastest MD5 implementation for
+   the platform.  */
+void
+hmac_md5 (const void *challenge, size_t challenge_len,
+	  const void *secret, size_t secret_len,
+	  unsigned char digest[16])
+{
+  HMAC (EVP_md5 (), secret, secret_len, challenge, challenge_len,
+	digest, NULL);
+}
+
+#else
+
 #define PAD_SIZE	64
 
 /*
@@ -116,3 +131,4 @@ hmac_md5 (const void *challenge, size_t challenge_len,
   hmac_md5_post (challenge, challenge_len, &inner, &outer, digest);
 }
 
+#endif
@@ -24,7 +24,8 @@
 
 #if HAVE_LIBCRYPTO
 
-#include <openssl/md5.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 #else
 
@@ -35,14 +36,15 @@
 #define MD5_Update(c,d,l)	md5_update((c),(d),(l))
 #define MD5_Final(md,c)		md5_final((c),(md))
 
-#endif
-
 /* Precompute HMAC-MD5 contexts from a secret. */
 void hmac_md5_pre (const void *secret, size_t secret_len,
                    MD5_CTX *inner, MD5_CTX *outer);
 /* Finalise HMAC-MD5 contexts from a challenge.  */
 void hmac_md5_post (const void *challenge, size_t challenge_len,
                     MD5_CTX *inner, MD5_CTX *outer, unsigned char digest[16]);
+
+#endif
+
 /* Digest a challenge and a secret.  */
 void hmac_md5 (const void *challenge, size_t challenge_len,
 	       const void *secret, size_t secret_len,
@@ -4,8 +4,10 @@ SRC=..
 DST=_kdoc
 
 SOURCES="libesmtp.h message-callbacks.c
-smtp-api.c  smtp-auth.c  smtp-etrn.c  smtp-tls.c errors.c
-auth-client.c headers.c
+smtp-api.c  smtp-auth.c  smtp-burl.c  smtp-etrn.c  smtp-tls.c errors.c
+auth-client.c headers.c metrics.c alloc-stats.c
+transcript.c smtp-config.c shmcache.c message-digest.c
+status-batch.c runtime.c
 "
 
 mkdir -p $DST
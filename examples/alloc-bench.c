@@ -0,0 +1,335 @@
+/*
+ *  A libESMTP Example Application.
+ *  Copyright (C) 2001,2002,2021  Brian Stafford <https://libesmtp.github.io/>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 2 of the License,
+ *  or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Measure the heap allocations made by libESMTP.  This requires the
+   library to be configured with -Dalloc_stats=true.
+
+   The program forks a trivial SMTP responder listening on the loopback
+   interface and runs three workloads against it: a session with one
+   message and one recipient, a session with extra messages and a session
+   with extra recipients.  From the differences it reports allocations
+   and bytes per session, per message and per recipient, together with
+   the peak heap usage of each workload.
+
+   Budgets for the allocation counts may be given on the command line.
+   The program exits with status 1 if any budget is exceeded, so it may
+   be used to catch regressions.  It exits with status 77 if the library
+   does not count allocations.
+ */
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libesmtp.h>
+
+struct option longopts[] =
+  {
+    { "help", no_argument, NULL, '?', },
+    { "count", required_argument, NULL, 'n', },
+    { "session-budget", required_argument, NULL, 's', },
+    { "message-budget", required_argument, NULL, 'm', },
+    { "recipient-budget", required_argument, NULL, 'r', },
+
+    { NULL, 0, NULL, 0, },
+  };
+
+static char message_text[] =
+  "From: Sender <sender@example.org>\r\n"
+  "To: Recipient <rcpt@example.org>\r\n"
+  "Subject: Allocation benchmark\r\n"
+  "\r\n"
+  "This is the message body.\r\n"
+  ".This line needs dot stuffing.\r\n";
+
+void responder (int sd);
+void serve (int fd);
+int run_session (int port, int messages, int recipients,
+		 struct smtp_alloc_stats *stats);
+int check_budget (const char *what, double value, long budget);
+void usage (void);
+
+int
+main (int argc, char **argv)
+{
+  struct smtp_alloc_stats base, msgs, rcpts, stats;
+  struct sockaddr_in sin;
+  socklen_t len;
+  struct sigaction sa;
+  pid_t pid;
+  int sd, c, port, n = 10, failed = 0;
+  long session_budget = -1, message_budget = -1, recipient_budget = -1;
+  double per_session, per_message, per_recipient;
+
+  while ((c = getopt_long (argc, argv, "n:s:m:r:", longopts, NULL)) != EOF)
+    switch (c)
+      {
+      case 'n':
+        n = atoi (optarg);
+        break;
+
+      case 's':
+        session_budget = atol (optarg);
+        break;
+
+      case 'm':
+        message_budget = atol (optarg);
+        break;
+
+      case 'r':
+        recipient_budget = atol (optarg);
+        break;
+
+      default:
+        usage ();
+        exit (2);
+      }
+  if (n < 1)
+    {
+      usage ();
+      exit (2);
+    }
+
+  if (!smtp_alloc_stats (&stats, 1))
+    {
+      fprintf (stderr, "libESMTP was built without allocation statistics\n");
+      exit (77);
+    }
+
+  sa.sa_handler = SIG_IGN;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction (SIGPIPE, &sa, NULL);
+
+  /* Listen on an ephemeral loopback port and fork the responder. */
+  if ((sd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+      perror ("socket");
+      exit (2);
+    }
+  memset (&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  len = sizeof sin;
+  if (bind (sd, (struct sockaddr *) &sin, sizeof sin) < 0
+      || listen (sd, 5) < 0
+      || getsockname (sd, (struct sockaddr *) &sin, &len) < 0)
+    {
+      perror ("bind");
+      exit (2);
+    }
+  port = ntohs (sin.sin_port);
+  if ((pid = fork ()) < 0)
+    {
+      perror ("fork");
+      exit (2);
+    }
+  if (pid == 0)
+    responder (sd);
+  close (sd);
+
+  /* The first session pays for one-time initialisation in the library
+     and the C library.  Don't count it.  */
+  if (!run_session (port, 1, 1, &stats)
+      || !run_session (port, 1, 1, &base)
+      || !run_session (port, 1 + n, 1, &msgs)
+      || !run_session (port, 1, 1 + n, &rcpts))
+    {
+      kill (pid, SIGTERM);
+      exit (2);
+    }
+  kill (pid, SIGTERM);
+  waitpid (pid, NULL, 0);
+
+  per_message = (double) (msgs.allocs - base.allocs) / n;
+  per_recipient = (double) (rcpts.allocs - base.allocs) / n;
+  per_session = base.allocs - per_message - per_recipient;
+
+  printf ("%-16s %10s %10s %10s\n", "workload", "allocs", "bytes", "peak");
+  printf ("%-16s %10lu %10lu %10lu\n", "1 msg, 1 rcpt",
+	  base.allocs, base.bytes, base.peak);
+  printf ("%-16s %10lu %10lu %10lu\n", "more messages",
+	  msgs.allocs, msgs.bytes, msgs.peak);
+  printf ("%-16s %10lu %10lu %10lu\n", "more recipients",
+	  rcpts.allocs, rcpts.bytes, rcpts.peak);
+  printf ("\n");
+  printf ("allocations per session:   %8.1f\n", per_session);
+  printf ("allocations per message:   %8.1f\n", per_message);
+  printf ("allocations per recipient: %8.1f\n", per_recipient);
+  printf ("bytes per message:         %8.1f\n",
+	  (double) (msgs.bytes - base.bytes) / n);
+  printf ("bytes per recipient:       %8.1f\n",
+	  (double) (rcpts.bytes - base.bytes) / n);
+
+  failed |= check_budget ("session", per_session, session_budget);
+  failed |= check_budget ("message", per_message, message_budget);
+  failed |= check_budget ("recipient", per_recipient, recipient_budget);
+  exit (failed ? 1 : 0);
+}
+
+/* Run one session and collect the allocation statistics for it.  */
+int
+run_session (int port, int messages, int recipients,
+	     struct smtp_alloc_stats *stats)
+{
+  struct smtp_alloc_stats start;
+  smtp_session_t session;
+  smtp_message_t message;
+  char server[32], mailbox[64], buf[128];
+  int i, j, ok;
+
+  smtp_alloc_stats (&start, 1);
+
+  session = smtp_create_session ();
+  snprintf (server, sizeof server, "127.0.0.1:%d", port);
+  smtp_set_server (session, server);
+  smtp_set_hostname (session, "client.example.org");
+  for (i = 0; i < messages; i++)
+    {
+      message = smtp_add_message (session);
+      smtp_set_reverse_path (message, "sender@example.org");
+      smtp_set_message_str (message, message_text);
+      for (j = 0; j < recipients; j++)
+	{
+	  snprintf (mailbox, sizeof mailbox, "rcpt%d@example.org", j);
+	  smtp_add_recipient (message, mailbox);
+	}
+    }
+  ok = smtp_start_session (session);
+  if (!ok)
+    fprintf (stderr, "SMTP server problem %s\n",
+	     smtp_strerror (smtp_errno (), buf, sizeof buf));
+  smtp_destroy_session (session);
+
+  /* Report the peak relative to the heap in use at the start.  */
+  smtp_alloc_stats (stats, 0);
+  stats->peak -= start.current;
+  return ok;
+}
+
+int
+check_budget (const char *what, double value, long budget)
+{
+  if (budget < 0 || value <= budget)
+    return 0;
+  fprintf (stderr, "allocations per %s %.1f exceed budget of %ld\n",
+	   what, value, budget);
+  return 1;
+}
+
+/* Accept connections until killed.  */
+void
+responder (int sd)
+{
+  int fd;
+
+  for (;;)
+    {
+      if ((fd = accept (sd, NULL, NULL)) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  _exit (1);
+	}
+      serve (fd);
+    }
+}
+
+/* A minimal SMTP server which accepts everything.  Replies to all the
+   commands in each read are sent in a single write, so pipelined commands
+   are answered in one packet.  */
+void
+serve (int fd)
+{
+  char in[4096], out[4096], *line, *eol;
+  const char *reply;
+  size_t nin = 0, nout;
+  ssize_t n;
+  int data = 0, quit = 0;
+
+  reply = "220 localhost ESMTP alloc-bench\r\n";
+  write (fd, reply, strlen (reply));
+  while (!quit && (n = read (fd, in + nin, sizeof in - nin)) > 0)
+    {
+      nin += n;
+      nout = 0;
+      line = in;
+      while ((eol = memchr (line, '\n', in + nin - line)) != NULL)
+	{
+	  reply = NULL;
+	  if (data)
+	    {
+	      if (eol - line == 2 && line[0] == '.')
+		{
+		  data = 0;
+		  reply = "250 2.0.0 Message accepted\r\n";
+		}
+	    }
+	  else if (strncasecmp (line, "EHLO", 4) == 0)
+	    reply = "250-localhost\r\n"
+		    "250-PIPELINING\r\n"
+		    "250-8BITMIME\r\n"
+		    "250 ENHANCEDSTATUSCODES\r\n";
+	  else if (strncasecmp (line, "DATA", 4) == 0)
+	    {
+	      data = 1;
+	      reply = "354 Send message\r\n";
+	    }
+	  else if (strncasecmp (line, "QUIT", 4) == 0)
+	    {
+	      quit = 1;
+	      reply = "221 2.0.0 Bye\r\n";
+	    }
+	  else
+	    reply = "250 2.0.0 Ok\r\n";
+	  if (reply != NULL && nout + strlen (reply) <= sizeof out)
+	    {
+	      memcpy (out + nout, reply, strlen (reply));
+	      nout += strlen (reply);
+	    }
+	  line = eol + 1;
+	}
+      nin = in + nin - line;
+      memmove (in, line, nin);
+      if (nout > 0)
+	write (fd, out, nout);
+    }
+  close (fd);
+}
+
+void
+usage (void)
+{
+  fputs ("usage: alloc-bench [options]\n"
+	 "\t-n,--count=N\t\t\tadd N messages or recipients (default 10)\n"
+	 "\t-s,--session-budget=N\t\tfail if allocations per session exceed N\n"
+	 "\t-m,--message-budget=N\t\tfail if allocations per message exceed N\n"
+	 "\t-r,--recipient-budget=N\t\tfail if allocations per recipient exceed N\n",
+	 stderr);
+}
@@ -0,0 +1,748 @@
+/*
+ *  A libESMTP Example Application.
+ *  Copyright (C) 2001,2002,2021  Brian Stafford <https://libesmtp.github.io/>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 2 of the License,
+ *  or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* A bulk sender built along the lines of mail-file.  Messages are read
+   from a manifest, one message per line:
+
+	path recipient [recipient ...]
+
+   Blank lines and lines starting with '#' are ignored.  Alternatively
+   every file in a spool directory is sent to the recipients named on the
+   command line.
+
+   The messages are shared out between a number of threads, each of which
+   sends batches of messages over its own connection to the server.
+   libESMTP uses PIPELINING and CHUNKING whenever the server offers them
+   and, if requested, STARTTLS with session resumption so that only the
+   first connection pays for a full TLS handshake.  With --shared-cache,
+   TLS sessions and resolver results are also shared with other instances
+   of the program using the same cache name.  Messages are loaded
+   into memory and converted to CRLF line endings before sending, so the
+   time taken to read them is not counted.
+
+   At the end the program reports the message throughput and the latency
+   of each message, measured from the end of the previous message (or the
+   connection) until the server accepted or rejected it.  The CPU time
+   used is also reported, so that, for example, the cost of full TLS
+   handshakes may be compared with resumed ones using --no-resume.
+ */
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+
+#include <libesmtp.h>
+
+struct option longopts[] =
+  {
+    { "help", no_argument, NULL, '?', },
+    { "host", required_argument, NULL, 'h', },
+    { "reverse-path", required_argument, NULL, 'f', },
+    { "connections", required_argument, NULL, 'c', },
+    { "batch", required_argument, NULL, 'b', },
+    { "spool", required_argument, NULL, 'd', },
+    { "tls", no_argument, NULL, 't', },
+    { "require-tls", no_argument, NULL, 'T', },
+    { "implicit-tls", no_argument, NULL, 'I', },
+    { "early-data", no_argument, NULL, 'E', },
+    { "async-tls", no_argument, NULL, 'A', },
+    { "no-resume", no_argument, NULL, 'R', },
+    { "insecure", no_argument, NULL, 'k', },
+    { "metrics", no_argument, NULL, 'M', },
+    { "shared-cache", required_argument, NULL, 'S', },
+    { "status-batch", required_argument, NULL, 'B', },
+    { "window", required_argument, NULL, 'w', },
+    { "quit-linger", required_argument, NULL, 'q', },
+
+    { NULL, 0, NULL, 0, },
+  };
+
+struct job
+  {
+    char *path;
+    char **recipients;
+    int nrecipients;
+    char *text;				/* Message with CRLF line endings */
+  };
+
+struct worker
+  {
+    pthread_t thread;
+    struct timespec mark;		/* Connection or previous message */
+    double *latency;			/* Seconds for each message */
+    int nlatency, alatency;
+    unsigned long sessions, failed_sessions, handshakes, resumed;
+    unsigned long accepted, rejected;
+    unsigned long rcpt_accepted, rcpt_rejected;
+    struct smtp_status_record *records;	/* Buffer for status batches */
+    unsigned long batches;
+  };
+
+/* Options */
+const char *host = "localhost:25";
+const char *from;
+int batch = 100;
+enum starttls_option starttls = Starttls_DISABLED;
+int resume = 1;
+int early_data = 0;
+int async_tls = 0;
+int insecure;
+int status_batch;
+
+/* Settings shared by every session */
+smtp_config_t config;
+
+/* The work queue */
+struct job *jobs;
+int njobs, next_job;
+pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int read_manifest (const char *path);
+int read_spool (const char *dir, char **recipients, int nrecipients);
+int add_job (char *path, char **recipients, int nrecipients);
+char *load_message (const char *path);
+void *worker (void *arg);
+void event_cb (smtp_session_t session, int event_no, void *arg, ...);
+void count_recipient (smtp_recipient_t recipient,
+		      const char *mailbox, void *arg);
+void status_cb (smtp_session_t session, struct smtp_status_record *records,
+		int nrecords, void *arg);
+double elapsed (const struct timespec *start, const struct timespec *end);
+int compare_double (const void *a, const void *b);
+void write_stdout (const char *buf, int len, void *arg);
+void usage (void);
+
+int
+main (int argc, char **argv)
+{
+  struct worker *workers, total;
+  smtp_session_t session;
+  struct timespec start, end;
+  struct rusage ru;
+  char buf[128];
+  struct sigaction sa;
+  const char *spool = NULL, *shared_cache = NULL;
+  double seconds, sum, *latency;
+  int c, i, nconnections = 4, metrics = 0, window = 0;
+  long quit_linger = -1;
+
+  while ((c = getopt_long (argc, argv, "h:f:c:b:d:tTIEARkMS:B:w:q:",
+			   longopts, NULL)) != EOF)
+    switch (c)
+      {
+      case 'h':
+        host = optarg;
+        break;
+
+      case 'f':
+        from = optarg;
+        break;
+
+      case 'c':
+        nconnections = atoi (optarg);
+        break;
+
+      case 'b':
+        batch = atoi (optarg);
+        break;
+
+      case 'd':
+        spool = optarg;
+        break;
+
+      case 't':
+        starttls = Starttls_ENABLED;
+        break;
+
+      case 'T':
+        starttls = Starttls_REQUIRED;
+        break;
+
+      case 'I':
+        starttls = Starttls_IMPLICIT;
+        break;
+
+      case 'E':
+        early_data = 1;
+        break;
+
+      case 'A':
+        async_tls = 1;
+        break;
+
+      case 'R':
+        resume = 0;
+        break;
+
+      case 'k':
+        insecure = 1;
+        break;
+
+      case 'M':
+        metrics = 1;
+        break;
+
+      case 'S':
+        shared_cache = optarg;
+        break;
+
+      case 'B':
+        status_batch = atoi (optarg);
+        break;
+
+      case 'w':
+        window = atoi (optarg);
+        break;
+
+      case 'q':
+        quit_linger = atol (optarg);
+        break;
+
+      default:
+        usage ();
+        exit (2);
+      }
+
+  /* Either a manifest or a spool directory and its recipients. */
+  if (nconnections < 1 || batch < 1 || status_batch < 0 || window < 0
+      || quit_linger < -1
+      || (spool == NULL && optind != argc - 1)
+      || (spool != NULL && optind >= argc))
+    {
+      usage ();
+      exit (2);
+    }
+
+  if (spool != NULL)
+    c = read_spool (spool, &argv[optind], argc - optind);
+  else
+    c = read_manifest (argv[optind]);
+  if (!c)
+    exit (1);
+  if (njobs == 0)
+    {
+      fprintf (stderr, "no messages to send\n");
+      exit (1);
+    }
+
+  for (i = 0; i < njobs; i++)
+    if ((jobs[i].text = load_message (jobs[i].path)) == NULL)
+      {
+	fprintf (stderr, "can't read %s: %s\n", jobs[i].path, strerror (errno));
+	exit (1);
+      }
+
+  /* Don't die on a dropped connection.  */
+  sa.sa_handler = SIG_IGN;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction (SIGPIPE, &sa, NULL);
+
+  if (metrics)
+    smtp_metrics_enable (1);
+
+  /* Share TLS sessions and resolver results with other instances.  */
+  if (shared_cache != NULL && !smtp_shared_cache_attach (shared_cache, 0))
+    {
+      fprintf (stderr, "can't attach %s: %s\n", shared_cache,
+	       smtp_strerror (smtp_errno (), buf, sizeof buf));
+      exit (1);
+    }
+
+  /* Configure a prototype session once and share it between the
+     workers.  Each worker's sessions borrow its settings.  */
+  session = smtp_create_session ();
+  smtp_set_server (session, host);
+  smtp_set_eventcb (session, event_cb, NULL);
+  smtp_set_pipeline_window (session, window, 0);
+  smtp_set_quit_linger (session, quit_linger);
+  if (starttls != Starttls_DISABLED)
+    {
+      smtp_starttls_enable (session, starttls);
+      smtp_starttls_set_resumption (session, resume);
+      smtp_starttls_set_early_data (session, early_data);
+      smtp_starttls_set_async (session, async_tls);
+    }
+  if ((config = smtp_create_config (session)) == NULL)
+    {
+      fprintf (stderr, "bad configuration: %s\n",
+	       smtp_strerror (smtp_errno (), buf, sizeof buf));
+      exit (1);
+    }
+
+  if ((workers = calloc (nconnections, sizeof (struct worker))) == NULL)
+    {
+      perror ("calloc");
+      exit (1);
+    }
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < nconnections; i++)
+    if ((errno = pthread_create (&workers[i].thread, NULL,
+				 worker, &workers[i])) != 0)
+      {
+	perror ("pthread_create");
+	exit (1);
+      }
+  memset (&total, 0, sizeof total);
+  for (i = 0; i < nconnections; i++)
+    {
+      pthread_join (workers[i].thread, NULL);
+      total.sessions += workers[i].sessions;
+      total.failed_sessions += workers[i].failed_sessions;
+      total.handshakes += workers[i].handshakes;
+      total.resumed += workers[i].resumed;
+      total.accepted += workers[i].accepted;
+      total.rejected += workers[i].rejected;
+      total.rcpt_accepted += workers[i].rcpt_accepted;
+      total.rcpt_rejected += workers[i].rcpt_rejected;
+      total.nlatency += workers[i].nlatency;
+      total.batches += workers[i].batches;
+    }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  seconds = elapsed (&start, &end);
+  smtp_destroy_config (config);
+
+  printf ("messages:    %lu accepted, %lu rejected, %lu not sent\n",
+	  total.accepted, total.rejected,
+	  njobs - total.accepted - total.rejected);
+  printf ("recipients:  %lu accepted, %lu rejected\n",
+	  total.rcpt_accepted, total.rcpt_rejected);
+  printf ("sessions:    %lu, %lu failed\n",
+	  total.sessions, total.failed_sessions);
+  if (starttls != Starttls_DISABLED)
+    printf ("TLS:         %lu handshakes, %lu resumed\n",
+	    total.handshakes, total.resumed);
+  if (status_batch > 0)
+    printf ("status:      %lu reports in %lu batches\n",
+	    total.accepted + total.rejected
+	    + total.rcpt_accepted + total.rcpt_rejected, total.batches);
+  printf ("elapsed:     %.3f s\n", seconds);
+  if (getrusage (RUSAGE_SELF, &ru) == 0)
+    printf ("cpu:         user %.3f s, system %.3f s\n",
+	    ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+  if (seconds > 0.0)
+    printf ("throughput:  %.1f messages/s\n",
+	    (total.accepted + total.rejected) / seconds);
+
+  /* Gather the per-message latencies and report the distribution.  */
+  if (total.nlatency > 0
+      && (latency = malloc (total.nlatency * sizeof (double))) != NULL)
+    {
+      c = 0;
+      for (i = 0; i < nconnections; i++)
+	{
+	  memcpy (latency + c, workers[i].latency,
+		  workers[i].nlatency * sizeof (double));
+	  c += workers[i].nlatency;
+	}
+      qsort (latency, c, sizeof (double), compare_double);
+      for (sum = 0.0, i = 0; i < c; i++)
+	sum += latency[i];
+      printf ("latency ms:  min %.2f avg %.2f p50 %.2f p90 %.2f "
+	      "p99 %.2f max %.2f\n",
+	      latency[0] * 1e3, sum / c * 1e3, latency[c / 2] * 1e3,
+	      latency[c * 90 / 100] * 1e3, latency[c * 99 / 100] * 1e3,
+	      latency[c - 1] * 1e3);
+      free (latency);
+    }
+
+  if (metrics)
+    {
+      smtp_metrics_t snapshot = smtp_metrics_snapshot ();
+
+      if (snapshot != NULL)
+	{
+	  printf ("\n");
+	  smtp_metrics_write_prometheus (snapshot, write_stdout, NULL);
+	  smtp_metrics_destroy (snapshot);
+	}
+    }
+
+  exit (total.failed_sessions > 0 || total.rejected > 0 ? 1 : 0);
+}
+
+/* Read the manifest.  */
+int
+read_manifest (const char *path)
+{
+  FILE *fp;
+  char buf[4096], *p, *file, **recipients;
+  int nrecipients, lineno = 0;
+
+  if ((fp = fopen (path, "r")) == NULL)
+    {
+      fprintf (stderr, "can't open %s: %s\n", path, strerror (errno));
+      return 0;
+    }
+  while (fgets (buf, sizeof buf, fp) != NULL)
+    {
+      lineno++;
+      if ((file = strtok (buf, " \t\r\n")) == NULL || *file == '#')
+	continue;
+      recipients = NULL;
+      nrecipients = 0;
+      while ((p = strtok (NULL, " \t\r\n")) != NULL)
+	{
+	  recipients = realloc (recipients, (nrecipients + 1) * sizeof (char *));
+	  if (recipients == NULL || (p = strdup (p)) == NULL)
+	    {
+	      perror ("malloc");
+	      fclose (fp);
+	      return 0;
+	    }
+	  recipients[nrecipients++] = p;
+	}
+      if (nrecipients == 0)
+	{
+	  fprintf (stderr, "%s:%d: no recipients\n", path, lineno);
+	  fclose (fp);
+	  return 0;
+	}
+      if ((file = strdup (file)) == NULL
+	  || !add_job (file, recipients, nrecipients))
+	{
+	  perror ("malloc");
+	  fclose (fp);
+	  return 0;
+	}
+    }
+  fclose (fp);
+  return 1;
+}
+
+/* Queue every regular file in the spool directory.  */
+int
+read_spool (const char *dir, char **recipients, int nrecipients)
+{
+  DIR *dp;
+  struct dirent *de;
+  char *path;
+
+  if ((dp = opendir (dir)) == NULL)
+    {
+      fprintf (stderr, "can't open %s: %s\n", dir, strerror (errno));
+      return 0;
+    }
+  while ((de = readdir (dp)) != NULL)
+    {
+      if (de->d_name[0] == '.')
+	continue;
+      if ((path = malloc (strlen (dir) + strlen (de->d_name) + 2)) == NULL)
+	{
+	  perror ("malloc");
+	  closedir (dp);
+	  return 0;
+	}
+      sprintf (path, "%s/%s", dir, de->d_name);
+      if (!add_job (path, recipients, nrecipients))
+	{
+	  perror ("malloc");
+	  closedir (dp);
+	  return 0;
+	}
+    }
+  closedir (dp);
+  return 1;
+}
+
+int
+add_job (char *path, char **recipients, int nrecipients)
+{
+  struct job *njob;
+
+  if ((njob = realloc (jobs, (njobs + 1) * sizeof (struct job))) == NULL)
+    return 0;
+  jobs = njob;
+  njob = &jobs[njobs++];
+  njob->path = path;
+  njob->recipients = recipients;
+  njob->nrecipients = nrecipients;
+  njob->text = NULL;
+  return 1;
+}
+
+/* Load a message, converting bare LF to CRLF so that libESMTP can send
+   it unmodified in a single piece.  */
+char *
+load_message (const char *path)
+{
+  FILE *fp;
+  char *text, *ntext;
+  size_t len = 0, alloc = 8192;
+  int c, prev = 0;
+
+  if ((fp = fopen (path, "r")) == NULL)
+    return NULL;
+  if ((text = malloc (alloc)) == NULL)
+    {
+      fclose (fp);
+      return NULL;
+    }
+  while ((c = getc (fp)) != EOF)
+    {
+      /* Room for CR, LF and the terminating NUL.  */
+      if (len + 3 > alloc)
+	{
+	  alloc *= 2;
+	  if ((ntext = realloc (text, alloc)) == NULL)
+	    {
+	      free (text);
+	      fclose (fp);
+	      return NULL;
+	    }
+	  text = ntext;
+	}
+      if (c == '\n' && prev != '\r')
+	text[len++] = '\r';
+      text[len++] = c;
+      prev = c;
+    }
+  fclose (fp);
+  text[len] = '\0';
+  return text;
+}
+
+/* Send batches of messages until the queue is empty.  */
+void *
+worker (void *arg)
+{
+  struct worker *w = arg;
+  smtp_session_t session;
+  smtp_message_t message;
+  struct job *job;
+  char buf[128];
+  int first, n, i, j;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&job_mutex);
+      first = next_job;
+      n = njobs - first < batch ? njobs - first : batch;
+      next_job += n;
+      pthread_mutex_unlock (&job_mutex);
+      if (n == 0)
+	break;
+
+      /* Make room for the latencies of this batch.  */
+      if (w->nlatency + n > w->alatency)
+	{
+	  double *nlatency;
+
+	  nlatency = realloc (w->latency,
+			      (w->nlatency + n) * sizeof (double));
+	  if (nlatency == NULL)
+	    {
+	      perror ("realloc");
+	      exit (1);
+	    }
+	  w->latency = nlatency;
+	  w->alatency = w->nlatency + n;
+	}
+
+      session = smtp_create_session_from_config (config);
+      smtp_set_application_data_release (session, w, NULL);
+      if (status_batch > 0)
+	{
+	  /* Collect the status of messages and recipients in batches,
+	     as an application writing them to a database might.  */
+	  if (w->records == NULL
+	      && (w->records = calloc (status_batch,
+				       sizeof (struct smtp_status_record)))
+		 == NULL)
+	    {
+	      perror ("calloc");
+	      exit (1);
+	    }
+	  smtp_set_status_batch (session, w->records, status_batch, 100,
+				 status_cb, w);
+	}
+      for (i = first; i < first + n; i++)
+	{
+	  job = &jobs[i];
+	  message = smtp_add_message (session);
+	  smtp_set_reverse_path (message, from);
+	  smtp_set_message_str (message, job->text);
+	  for (j = 0; j < job->nrecipients; j++)
+	    smtp_add_recipient (message, job->recipients[j]);
+	}
+
+      w->sessions++;
+      if (!smtp_start_session (session))
+	{
+	  w->failed_sessions++;
+	  fprintf (stderr, "SMTP server problem %s\n",
+		   smtp_strerror (smtp_errno (), buf, sizeof buf));
+	}
+      smtp_destroy_session (session);
+    }
+  return NULL;
+}
+
+/* Record TLS handshakes and per-message latency.  */
+void
+event_cb (smtp_session_t session, int event_no, void *arg, ...)
+{
+  struct worker *w = smtp_get_application_data (session);
+  struct timespec now;
+  const smtp_status_t *status;
+  smtp_message_t message;
+  va_list alist;
+  int *ok;
+  SSL *ssl;
+
+  va_start (alist, arg);
+  switch (event_no)
+    {
+    case SMTP_EV_CONNECT:
+      clock_gettime (CLOCK_MONOTONIC, &w->mark);
+      break;
+
+    case SMTP_EV_MESSAGESENT:
+      message = va_arg (alist, smtp_message_t);
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      if (w->nlatency < w->alatency)
+	w->latency[w->nlatency++] = elapsed (&w->mark, &now);
+      w->mark = now;
+      if (status_batch > 0)
+	break;
+      status = smtp_message_transfer_status (message);
+      if (status->code / 100 == 2)
+	w->accepted++;
+      else
+	w->rejected++;
+      smtp_enumerate_recipients (message, count_recipient, w);
+      break;
+
+    case SMTP_EV_STARTTLS_OK:
+      ssl = va_arg (alist, SSL *);
+      w->handshakes++;
+      if (SSL_session_reused (ssl))
+	w->resumed++;
+      break;
+
+    case SMTP_EV_INVALID_PEER_CERTIFICATE:
+      (void) va_arg (alist, long);
+      ok = va_arg (alist, int *);
+      *ok = insecure;
+      break;
+
+    case SMTP_EV_NO_PEER_CERTIFICATE:
+    case SMTP_EV_WRONG_PEER_CERTIFICATE:
+      ok = va_arg (alist, int *);
+      *ok = insecure;
+      break;
+    }
+  va_end (alist);
+}
+
+void
+count_recipient (smtp_recipient_t recipient,
+		 const char *mailbox __attribute__ ((unused)), void *arg)
+{
+  struct worker *w = arg;
+  const smtp_status_t *status;
+
+  status = smtp_recipient_status (recipient);
+  if (status->code / 100 == 2)
+    w->rcpt_accepted++;
+  else
+    w->rcpt_rejected++;
+}
+
+/* Count the status reports in a batch.  */
+void
+status_cb (smtp_session_t session __attribute__ ((unused)),
+	   struct smtp_status_record *records, int nrecords, void *arg)
+{
+  struct worker *w = arg;
+  int i, ok;
+
+  w->batches++;
+  for (i = 0; i < nrecords; i++)
+    {
+      ok = records[i].status->code / 100 == 2;
+      if (records[i].recipient == NULL)
+	{
+	  if (ok)
+	    w->accepted++;
+	  else
+	    w->rejected++;
+	}
+      else if (ok)
+	w->rcpt_accepted++;
+      else
+	w->rcpt_rejected++;
+    }
+}
+
+double
+elapsed (const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int
+compare_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+void
+write_stdout (const char *buf, int len, void *arg __attribute__ ((unused)))
+{
+  fwrite (buf, 1, len, stdout);
+}
+
+void
+usage (void)
+{
+  fputs ("usage: mail-bulk [options] manifest\n"
+	 "       mail-bulk [options] -d spool recipient ...\n"
+	 "\t-h,--host=hostname[:service]\tMTA (default localhost:25)\n"
+	 "\t-f,--reverse-path=mailbox\tenvelope sender\n"
+	 "\t-c,--connections=N\t\tnumber of parallel connections (default 4)\n"
+	 "\t-b,--batch=N\t\t\tmessages per connection (default 100)\n"
+	 "\t-d,--spool=directory\t\tsend every file in directory\n"
+	 "\t-t,--tls\t\t\tuse STARTTLS if offered\n"
+	 "\t-T,--require-tls\t\trequire STARTTLS\n"
+	 "\t-I,--implicit-tls\t\tuse TLS from the start, as on port 465\n"
+	 "\t-E,--early-data\t\tsend EHLO as TLS early data when resuming\n"
+	 "\t-A,--async-tls\t\t\tuse OpenSSL async jobs for TLS\n"
+	 "\t-R,--no-resume\t\t\tdo not resume TLS sessions\n"
+	 "\t-k,--insecure\t\t\taccept unverified server certificates\n"
+	 "\t-M,--metrics\t\t\tprint libESMTP metrics at the end\n"
+	 "\t-S,--shared-cache=name\t\tshare caches with other processes\n"
+	 "\t-B,--status-batch=N\t\tcollect status reports in batches of N\n"
+	 "\t-w,--window=N\t\t\tat most N pipelined commands in flight\n"
+	 "\t-q,--quit-linger=N\t\tpipeline QUIT, wait N ms for its reply\n",
+	 stderr);
+}
@@ -60,6 +60,9 @@ struct option longopts[] =
     { "tls", no_argument, NULL, 't', }, 
     { "require-tls", no_argument, NULL, 'T', }, 
     { "noauth", no_argument, NULL, 1, }, 
+    { "digest", required_argument, NULL, 2, }, 
+    { "burl", required_argument, NULL, 3, }, 
+    { "priority", required_argument, NULL, 4, }, 
 
     { "to", required_argument, NULL, TO, },
     { "cc", required_argument, NULL, CC, },
@@ -72,6 +75,7 @@ const char *readlinefp_cb (void **buf, int *len, void *arg);
 void monitor_cb (const char *buf, int buflen, int writing, void *arg);
 void print_recipient_status (smtp_recipient_t recipient,
 			     const char *mailbox, void *arg);
+void print_digest (smtp_message_t message, const char *name);
 int authinteract (auth_client_request_t request, char **result, int fields,
                   void *arg);
 int tlsinteract (char *buf, int buflen, int rwflag, void *arg);
@@ -94,6 +98,7 @@ main (int argc, char **argv)
   char *host = NULL;
   char *from = NULL;
   char *subject = NULL;
+  char *digest = NULL;
   int nocrlf = 0;
   int noauth = 0;
   int to_cc_bcc = 0;
@@ -164,6 +169,19 @@ main (int argc, char **argv)
         noauth = 1;
         break;
 
+      case 2:
+        digest = optarg;
+        break;
+
+      case 3:
+        /* The server fetches this part of the message itself. */
+        smtp_burl_add_url (message, optarg);
+        break;
+
+      case 4:
+        smtp_message_set_priority (message, atoi (optarg));
+        break;
+
       case TO:
         smtp_set_header (message, "To", NULL, optarg);
         to_cc_bcc = 1;
@@ -225,6 +243,13 @@ main (int argc, char **argv)
    */
   smtp_set_reverse_path (message, from);
 
+  /* Compute a digest of the message as it is sent.  */
+  if (digest != NULL && !smtp_message_set_digest (message, digest))
+    {
+      fprintf (stderr, "unknown digest %s\n", digest);
+      exit (2);
+    }
+
 #if 0
   /* The message-id is OPTIONAL but SHOULD be present.  By default
      libESMTP supplies one.  If this is not desirable, the following
@@ -292,6 +317,8 @@ main (int argc, char **argv)
       printf ("%d %s", status->code,
               (status->text != NULL) ? status->text : "\n");
       smtp_enumerate_recipients (message, print_recipient_status, NULL);
+      if (digest != NULL)
+        print_digest (message, digest);
     }
 
   /* Free resources consumed by the program.
@@ -314,6 +341,25 @@ print_recipient_status (smtp_recipient_t recipient,
   printf ("%s: %d %s", mailbox, status->code, status->text);
 }
 
+/* Report the size of the message and its digest.  */
+void
+print_digest (smtp_message_t message, const char *name)
+{
+  unsigned char md[64];
+  size_t i, len;
+
+  printf ("%lu octets, %lu on the wire\n",
+          smtp_message_content_octets (message),
+          smtp_message_wire_octets (message));
+  len = smtp_message_get_digest (message, md, sizeof md);
+  if (len == 0)
+    return;
+  printf ("%s: ", name);
+  for (i = 0; i < len; i++)
+    printf ("%02x", md[i]);
+  printf ("\n");
+}
+
 /* Callback function to read the message from a file.  Since libESMTP
    does not provide callbacks which translate line endings, one must
    be provided by the application.
@@ -537,6 +583,8 @@ void event_cb (smtp_session_t session unused, int event_no, void *arg,...)
     puts("SMTP_EV_NO_CLIENT_CERTIFICATE - accepted.");
     *ok = 1; break;
   }
+  case SMTP_EV_EXTNA_BURL:
+    puts("SMTP_EV_EXTNA_BURL - server cannot fetch message parts."); break;
   default:
     printf("Got event: %d - ignored.\n", event_no);
   }
@@ -572,6 +620,9 @@ usage (void)
          "\t-t --tls -- use STARTTLS extension if possible\n"
          "\t-T --require-tls -- require use of STARTTLS extension\n"
          "\t   --noauth -- do not attempt to authenticate to the MSA\n"
+         "\t   --digest name -- report size and digest of the message sent\n"
+         "\t   --burl url -- append content the server fetches from url\n"
+         "\t   --priority n -- set message priority from -9 to 9\n"
          "\t   --version -- show version info and exit\n"
          "\t   --help -- this message\n"
          "\n"
@@ -0,0 +1,344 @@
+/*
+ *  A libESMTP Example Application.
+ *  Copyright (C) 2001,2002,2021  Brian Stafford <https://libesmtp.github.io/>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 2 of the License,
+ *  or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Replay the server side of a transcript recorded using
+   smtp_set_transcript_fd().  The program listens on the loopback
+   interface and plays back one recorded connection for each connection
+   accepted.  Each server reply is sent once the client has sent as many
+   lines as it had when the reply was recorded, after the recorded
+   delay.  This reproduces slow greetings, tarpitting and stalls after
+   the message data so that the client's behaviour can be measured
+   repeatably.
+
+   The client must send the same commands and message as when the
+   transcript was recorded, otherwise replies will be sent at the wrong
+   time.  Since the replay server does not implement TLS, transcripts of
+   sessions using STARTTLS cannot be replayed.
+ */
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAGIC	"%libesmtp-transcript 1\n"
+
+struct option longopts[] =
+  {
+    { "help", no_argument, NULL, '?', },
+    { "port", required_argument, NULL, 'p', },
+    { "scale", required_argument, NULL, 's', },
+    { "repeat", required_argument, NULL, 'n', },
+
+    { NULL, 0, NULL, 0, },
+  };
+
+struct record
+  {
+    int kind;			/* 'C' client data, 'S' server data */
+    long usec;			/* delay since previous record */
+    size_t len;
+    size_t lines;		/* lines of client data */
+    const char *data;		/* server data */
+  };
+
+struct connection
+  {
+    struct record *records;
+    int nrecords;
+  };
+
+char *load_file (const char *path, size_t *size);
+int parse_transcript (char *text, size_t size,
+		      struct connection **connections);
+void replay (int fd, const struct connection *conn, double scale);
+void delay (long usec, double scale);
+void usage (void);
+
+int
+main (int argc, char **argv)
+{
+  struct connection *connections;
+  struct sockaddr_in sin;
+  socklen_t len;
+  struct sigaction sa;
+  char *text;
+  size_t size;
+  double scale = 1.0;
+  int c, i, sd, fd, nconnections, port = 0, repeat = 1;
+
+  while ((c = getopt_long (argc, argv, "p:s:n:", longopts, NULL)) != EOF)
+    switch (c)
+      {
+      case 'p':
+        port = atoi (optarg);
+        break;
+
+      case 's':
+        scale = atof (optarg);
+        break;
+
+      case 'n':
+        repeat = atoi (optarg);
+        break;
+
+      default:
+        usage ();
+        exit (2);
+      }
+  if (optind != argc - 1 || scale < 0.0)
+    {
+      usage ();
+      exit (2);
+    }
+
+  if ((text = load_file (argv[optind], &size)) == NULL)
+    {
+      fprintf (stderr, "can't read %s: %s\n", argv[optind], strerror (errno));
+      exit (1);
+    }
+  if ((nconnections = parse_transcript (text, size, &connections)) <= 0)
+    {
+      fprintf (stderr, "%s: not a valid transcript\n", argv[optind]);
+      exit (1);
+    }
+
+  sa.sa_handler = SIG_IGN;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction (SIGPIPE, &sa, NULL);
+
+  if ((sd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+      perror ("socket");
+      exit (1);
+    }
+  i = 1;
+  setsockopt (sd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof i);
+  memset (&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  sin.sin_port = htons (port);
+  len = sizeof sin;
+  if (bind (sd, (struct sockaddr *) &sin, sizeof sin) < 0
+      || listen (sd, 5) < 0
+      || getsockname (sd, (struct sockaddr *) &sin, &len) < 0)
+    {
+      perror ("bind");
+      exit (1);
+    }
+  printf ("listening on 127.0.0.1:%d\n", ntohs (sin.sin_port));
+  fflush (stdout);
+
+  /* Replay each connection in turn, repeating the whole transcript if
+     requested.  A repeat count of zero replays forever.  */
+  for (c = 0; repeat == 0 || c < repeat; c++)
+    for (i = 0; i < nconnections; i++)
+      {
+	while ((fd = accept (sd, NULL, NULL)) < 0)
+	  if (errno != EINTR)
+	    {
+	      perror ("accept");
+	      exit (1);
+	    }
+	replay (fd, &connections[i], scale);
+	close (fd);
+      }
+  exit (0);
+}
+
+/* Read the entire transcript into memory.  */
+char *
+load_file (const char *path, size_t *size)
+{
+  FILE *fp;
+  char *text, *ntext;
+  size_t alloc = 65536, n;
+
+  if ((fp = fopen (path, "r")) == NULL)
+    return NULL;
+  if ((text = malloc (alloc)) == NULL)
+    {
+      fclose (fp);
+      return NULL;
+    }
+  *size = 0;
+  while ((n = fread (text + *size, 1, alloc - *size, fp)) > 0)
+    {
+      *size += n;
+      if (*size == alloc)
+	{
+	  alloc *= 2;
+	  if ((ntext = realloc (text, alloc)) == NULL)
+	    {
+	      free (text);
+	      fclose (fp);
+	      return NULL;
+	    }
+	  text = ntext;
+	}
+    }
+  fclose (fp);
+  return text;
+}
+
+/* Split the transcript into connections and records.  The records point
+   into the transcript text.  Returns the number of connections or -1 if
+   the transcript is malformed.  */
+int
+parse_transcript (char *text, size_t size, struct connection **connections)
+{
+  struct connection *conn = NULL, *nconn;
+  struct record *rec;
+  char *p = text, *end = text + size, *eol;
+  int nconnections = 0, kind;
+  long usec;
+  size_t len, lines = 0;
+
+  if (size < sizeof MAGIC - 1 || memcmp (text, MAGIC, sizeof MAGIC - 1) != 0)
+    return -1;
+  p += sizeof MAGIC - 1;
+  *connections = NULL;
+  while (p < end)
+    {
+      if ((eol = memchr (p, '\n', end - p)) == NULL)
+	return -1;
+      *eol = '\0';
+      kind = *p;
+      if (kind == 'A')
+	{
+	  nconn = realloc (*connections,
+			   (nconnections + 1) * sizeof (struct connection));
+	  if (nconn == NULL)
+	    return -1;
+	  *connections = nconn;
+	  conn = &nconn[nconnections++];
+	  conn->records = NULL;
+	  conn->nrecords = 0;
+	  p = eol + 1;
+	  continue;
+	}
+      if (conn == NULL)
+	return -1;
+      if (kind == 'C')
+	{
+	  if (sscanf (p + 1, "%ld %zu %zu", &usec, &len, &lines) != 3)
+	    return -1;
+	}
+      else if (kind != 'S' || sscanf (p + 1, "%ld %zu", &usec, &len) != 2)
+	return -1;
+      p = eol + 1;
+      rec = realloc (conn->records, (conn->nrecords + 1) * sizeof *rec);
+      if (rec == NULL)
+	return -1;
+      conn->records = rec;
+      rec = &rec[conn->nrecords++];
+      rec->kind = kind;
+      rec->usec = usec;
+      rec->len = len;
+      rec->lines = lines;
+      rec->data = NULL;
+      if (kind == 'S')
+	{
+	  if ((size_t) (end - p) < len)
+	    return -1;
+	  rec->data = p;
+	  p += len;
+	}
+    }
+  return nconnections;
+}
+
+/* Play back the server side of a connection.  */
+void
+replay (int fd, const struct connection *conn, double scale)
+{
+  const struct record *rec;
+  char buf[8192], *p;
+  size_t expect = 0, received = 0, sent;
+  ssize_t n;
+  int i;
+
+  for (i = 0; i < conn->nrecords; i++)
+    {
+      rec = &conn->records[i];
+      if (rec->kind == 'C')
+	{
+	  expect += rec->lines;
+	  continue;
+	}
+
+      /* Wait for the client to catch up with the recording. */
+      while (received < expect)
+	{
+	  if ((n = read (fd, buf, sizeof buf)) < 0 && errno == EINTR)
+	    continue;
+	  if (n <= 0)
+	    return;
+	  for (p = buf; (p = memchr (p, '\n', buf + n - p)) != NULL; p++)
+	    received++;
+	}
+
+      delay (rec->usec, scale);
+      for (sent = 0; sent < rec->len; sent += n)
+	if ((n = write (fd, rec->data + sent, rec->len - sent)) < 0)
+	  {
+	    if (errno == EINTR)
+	      n = 0;
+	    else
+	      return;
+	  }
+    }
+
+  /* Wait for the client to close the connection. */
+  while ((n = read (fd, buf, sizeof buf)) > 0 || (n < 0 && errno == EINTR))
+    ;
+}
+
+void
+delay (long usec, double scale)
+{
+  struct timespec ts;
+  double seconds = usec * scale / 1e6;
+
+  if (seconds <= 0.0)
+    return;
+  ts.tv_sec = (time_t) seconds;
+  ts.tv_nsec = (long) ((seconds - ts.tv_sec) * 1e9);
+  while (nanosleep (&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+void
+usage (void)
+{
+  fputs ("usage: smtp-replay [options] transcript\n"
+	 "\t-p,--port=N\t\tlisten on port N (default any free port)\n"
+	 "\t-s,--scale=X\t\tmultiply recorded delays by X (default 1)\n"
+	 "\t-n,--repeat=N\t\treplay the transcript N times, 0 for ever\n",
+	 stderr);
+}
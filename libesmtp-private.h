@@ -23,6 +23,8 @@
  */
 
 #include <stddef.h>		/* for size_t */
+#include <time.h>		/* for time_t */
+#include <sys/socket.h>		/* for struct sockaddr_storage */
 
 #ifdef USE_TLS
 #include <openssl/ssl.h>
@@ -31,6 +33,7 @@
 #include "message-source.h"
 #include "concatenate.h"
 #include "auth-client.h"
+#include "metrics.h"
 
 /* SMTP Extensions */
 
@@ -49,11 +52,25 @@
 #define EXT_ETRN		_BIT(10)/* RFC 1985 */
 #define EXT_XUSR		_BIT(11)/* sendmail */
 #define EXT_XEXCH50		_BIT(12)/* exchange */
+#define EXT_LIMITS		_BIT(13)/* RFC 9422 */
+#define EXT_BURL		_BIT(14)/* RFC 4468 */
+#define EXT_MTPRIORITY		_BIT(15)/* RFC 6710 */
+
+/* Local address to bind outgoing connections to */
+struct local_address
+  {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char *name;				/* Address as set by the app */
+  };
 
 struct smtp_session
   {
   /* Local info */
     char *localhost;			/* Domain name of localhost */
+    struct local_address *local_addresses;
+    int n_local_addresses;
+    enum local_address_selection local_address_selection;
 
   /* MTA */
     char *host;				/* Host domain name of SMTP server */
@@ -67,6 +84,7 @@ struct smtp_session
   /* Messages */
     struct smtp_message *messages;	/* list of messages to submit */
     struct smtp_message *end_messages;
+    struct smtp_message *schedule;	/* first message in sending order */
 
   /* Protocol events */
     smtp_eventcb_t event_cb;		/* Protocol event callback */
@@ -82,6 +100,8 @@ struct smtp_session
     struct smtp_message *current_message;
     struct smtp_recipient *cmd_recipient;
     struct smtp_recipient *rsp_recipient;
+    struct smtp_recipient *xact_first;	/* First recipient in transaction */
+    struct smtp_recipient *xact_end;	/* First recipient after transaction */
     msg_source_t msg_source;
 
   /* SMTP timeouts */
@@ -90,6 +110,7 @@ struct smtp_session
     long data_timeout;			/* default 2 minutes */
     long transfer_timeout;		/* default 3 minutes */
     long data2_timeout;			/* default 10 minutes */
+    long quit_linger;			/* -1 unless QUIT is pipelined */
 
   /* Status */
     smtp_status_t mta_status;		/* Status from MTA greeting */
@@ -99,6 +120,14 @@ struct smtp_session
     unsigned long required_extensions;
     unsigned long size_limit;		/* RFC 1870 */
     long min_by_time;			/* RFC 2852 */
+    long rcpt_max;			/* RFC 9422, zero if no limit */
+    long rcpt_domain_max;
+    long mail_max;
+    long mail_count;			/* MAIL commands this connection */
+
+  /* PIPELINING window, zero for no limit */
+    int pipeline_commands;		/* Commands awaiting response */
+    unsigned long pipeline_octets;	/* Octets awaiting response */
 
   /* Interface to RFC 4954 AUTH and SASL */
     auth_context_t auth_context;
@@ -121,18 +150,52 @@ struct smtp_session
 
 #ifdef USE_CHUNKING
     int bdat_pipelined;
+    struct catbuf bdat_pending;		/* Chunk held back for BDAT LAST */
+    struct smtp_burl_part *cmd_burl_part; /* Next part to send by BURL */
 #endif
 
+  /* Transcript */
+    int transcript_fd;			/* -1 if not recording */
+    struct timespec transcript_time;	/* Time of previous record */
+
+  /* Metrics */
+    struct metrics_server *metrics;	/* NULL unless metrics are enabled */
+    struct metrics_inflight inflight;	/* Commands awaiting a response */
+
+  /* Batched status reports */
+    smtp_status_batchcb_t status_cb;
+    void *status_cb_arg;
+    struct smtp_status_record *status_records;
+    int status_max;			/* Zero unless batching */
+    int status_count;			/* Records in the buffer */
+    long status_timeout;		/* Maximum age in milliseconds */
+    struct timespec status_first;	/* Time of the oldest record */
+
+  /* Shared configuration */
+    smtp_config_t config;		/* Session created from config */
+    auth_context_t owned_auth_context;	/* Copied from the config */
+
   /* Miscellaneous options and flags */
     unsigned int try_fallback_server : 1;
     unsigned int require_all_recipients : 1;
     unsigned int authenticated : 1;
+    unsigned int mail_pipelined : 1;	/* MAIL sent before DATA response */
+    unsigned int quit_pipelined : 1;	/* QUIT sent with the message data */
+    unsigned int reconnect : 1;		/* MAILMAX reached, work remains */
+    unsigned int prioritised : 1;	/* Messages have priority or deadline */
+    unsigned int borrowed_host : 1;	/* host and port belong to config */
+    unsigned int borrowed_localhost : 1;
+    unsigned int borrowed_local_addresses : 1;
 #ifdef USE_CHUNKING
     unsigned int bdat_abort_pipeline : 1;
     unsigned int bdat_last_issued : 1;
 #endif
 #ifdef USE_TLS
     unsigned int using_tls : 1;
+    unsigned int tls_resumption : 1;	/* Save and resume TLS sessions */
+    unsigned int tls_early_data : 1;	/* Send EHLO as TLS early data */
+    unsigned int tls_async : 1;		/* Use OpenSSL async jobs */
+    unsigned int early_ehlo : 1;	/* EHLO was sent as early data */
 #endif
   };
 
@@ -183,6 +246,38 @@ struct smtp_message
 
   /* 8BITMIME  (RFC 6152) */
     enum e8bitmime_body e8bitmime;
+
+  /* VERP - one transaction per recipient */
+    char verp_delimiters[2];		/* e.g. '+' and '=' */
+    struct catbuf hdr_cache;		/* Processed headers for reuse */
+    unsigned int verp : 1;
+    unsigned int hdr_cached : 1;	/* hdr_cache is complete */
+
+#ifdef USE_CHUNKING
+  /* BURL  (RFC 4468) */
+    struct smtp_burl_part *burl_parts;	/* Parts following the content */
+    struct smtp_burl_part *end_burl_parts;
+#endif
+
+  /* Scheduling */
+    struct smtp_message *sched_next;	/* Next message in sending order */
+    int priority;			/* -9 (lowest) to +9 (highest) */
+    int sched_age;			/* Sessions for which message was deferred */
+    int sched_seq;			/* Position in list of messages */
+    long sched_remaining;		/* Seconds to deadline when scheduled */
+    time_t deadline;			/* Send before this time if possible */
+    unsigned int scheduled : 1;		/* Included in a previous schedule */
+
+  /* Accounting */
+    unsigned long content_octets;	/* Content octets transferred */
+    unsigned long wire_octets;		/* Including transparency */
+#ifdef USE_TLS
+    const EVP_MD *digest_md;		/* NULL unless computing a digest */
+    EVP_MD_CTX *digest_ctx;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len;		/* Zero until transfer completes */
+    unsigned int digest_active : 1;
+#endif
   };
 
 struct smtp_recipient
@@ -215,6 +310,17 @@ struct smtp_recipient
 					  (item)->next = NULL;		\
 					} while (0)
 
+/* Message priorities.  The range is the same as RFC 6710 MT-PRIORITY.
+   A message's priority is raised by one for each session in which it is
+   deferred so that low priority messages cannot be starved.  */
+
+#define PRIORITY_MIN		(-9)
+#define PRIORITY_MAX		(+9)
+
+/* Maximum commands awaiting a response when a pipeline window is set. */
+
+#define PIPELINE_WINDOW_MAX	256
+
 /* RFC 5321 minimum timeouts */
 
 #define GREETING_DEFAULT	( 5 * 60l * 1000l)
@@ -227,6 +333,36 @@ struct smtp_recipient
 
 int initial_transaction_state (smtp_session_t session);
 int next_message (smtp_session_t session);
+int session_urgency (smtp_session_t session, time_t *deadline);
+int next_transaction (smtp_session_t session);
+int pipeline_quit (smtp_session_t session);
+void mark_recipients_complete (smtp_session_t session, int code);
+void destroy_local_addresses (smtp_session_t session);
+int default_localhost (smtp_session_t session);
+unsigned int hash_server_name (const char *name);
+
+/* message-digest.c */
+
+void digest_start (smtp_message_t message);
+void digest_update (smtp_message_t message, const char *data, size_t len);
+void digest_finish (smtp_message_t message);
+void digest_destroy (smtp_message_t message);
+
+/* status-batch.c */
+
+void status_batch_flush (smtp_session_t session);
+void status_batch_check (smtp_session_t session);
+void status_batch_add (smtp_session_t session, smtp_message_t message,
+		       smtp_recipient_t recipient);
+
+/* smtp-config.c */
+
+auth_context_t config_auth_context (smtp_config_t config);
+
+/* transcript.c */
+
+void transcript_connect (smtp_session_t session);
+void transcript_record (const char *buf, int len, int writing, void *arg);
 
 /* errors.c */
 
@@ -246,7 +382,15 @@ int select_auth_mechanism (smtp_session_t session);
 /* smtp-tls.c */
 
 int select_starttls (smtp_session_t session);
+int prepare_starttls_context (smtp_session_t session);
 void destroy_starttls_context (smtp_session_t session);
+void tls_session_done (smtp_session_t session, SSL *ssl);
+#endif
+
+#ifdef USE_CHUNKING
+/* smtp-burl.c */
+
+void destroy_burl_parts (smtp_message_t message);
 #endif
 
 #ifdef USE_ETRN
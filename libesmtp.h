@@ -52,6 +52,7 @@ extern "C" {
 typedef struct smtp_session *smtp_session_t;
 typedef struct smtp_message *smtp_message_t;
 typedef struct smtp_recipient *smtp_recipient_t;
+typedef struct smtp_config *smtp_config_t;
 
 /**
  * typedef smtp_enumerate_messagecb_t - Message callback.
@@ -83,7 +84,24 @@ int smtp_enumerate_messages (smtp_session_t session,
 int smtp_set_server (smtp_session_t session, const char *hostport);
 const char *smtp_get_server_name (smtp_session_t session);
 int smtp_set_hostname (smtp_session_t session, const char *hostname);
+
+/**
+ * enum local_address_selection - Choice of local address.
+ * @Local_ROUND_ROBIN: Use each local address in turn.
+ * @Local_HASH: Select the local address using a hash of the server name.
+ */
+enum local_address_selection
+  {
+    Local_ROUND_ROBIN,
+    Local_HASH
+  };
+int smtp_set_local_addresses (smtp_session_t session,
+			      const char *const addresses[], int naddresses,
+			      enum local_address_selection how);
 int smtp_set_reverse_path (smtp_message_t message, const char *mailbox);
+int smtp_message_set_verp (smtp_message_t message, const char *delimiters);
+int smtp_message_set_priority (smtp_message_t message, int priority);
+int smtp_message_set_deadline (smtp_message_t message, long seconds);
 smtp_recipient_t smtp_add_recipient (smtp_message_t message,
                                      const char *mailbox);
 int smtp_enumerate_recipients (smtp_message_t message,
@@ -111,6 +129,7 @@ enum
     SMTP_EV_MESSAGESENT,
     SMTP_EV_DISCONNECT,
     SMTP_EV_SYNTAXWARNING,
+    SMTP_EV_BINDFAILED,
 
   /* Protocol extension progress */
     SMTP_EV_ETRNSTATUS = 1000,
@@ -122,6 +141,7 @@ enum
     SMTP_EV_EXTNA_ETRN,
     SMTP_EV_EXTNA_CHUNKING,
     SMTP_EV_EXTNA_BINARYMIME,
+    SMTP_EV_EXTNA_BURL,
 
   /* Extensions specific events */
     SMTP_EV_DELIVERBY_EXPIRED = 3000,
@@ -143,9 +163,22 @@ typedef void (*smtp_monitorcb_t) (const char *buf, int buflen,
 				  int writing, void *arg);
 int smtp_set_monitorcb (smtp_session_t session, smtp_monitorcb_t cb, void *arg,
 			int headers);
+int smtp_set_transcript_fd (smtp_session_t session, int fd);
 int smtp_start_session (smtp_session_t session);
 int smtp_destroy_session (smtp_session_t session);
 
+smtp_config_t smtp_create_config (smtp_session_t prototype);
+smtp_session_t smtp_create_session_from_config (smtp_config_t config);
+int smtp_destroy_config (smtp_config_t config);
+
+typedef struct smtp_runtime *smtp_runtime_t;
+typedef void (*smtp_runtime_donecb_t) (smtp_session_t session, int ok,
+				       void *arg);
+smtp_runtime_t smtp_runtime_create (int nshards, int nthreads);
+int smtp_runtime_submit (smtp_runtime_t runtime, smtp_session_t session,
+			 smtp_runtime_donecb_t cb, void *arg);
+int smtp_runtime_destroy (smtp_runtime_t runtime);
+
 struct smtp_status
   {
     int code;			/* SMTP protocol status code */
@@ -159,6 +192,24 @@ typedef struct smtp_status smtp_status_t;
 const smtp_status_t *smtp_message_transfer_status (smtp_message_t message);
 const smtp_status_t *smtp_reverse_path_status (smtp_message_t message);
 int smtp_message_reset_status (smtp_message_t recipient);
+int smtp_message_set_digest (smtp_message_t message, const char *name);
+size_t smtp_message_get_digest (smtp_message_t message, unsigned char *buf,
+				size_t len);
+unsigned long smtp_message_content_octets (smtp_message_t message);
+unsigned long smtp_message_wire_octets (smtp_message_t message);
+
+struct smtp_status_record
+  {
+    smtp_message_t message;
+    smtp_recipient_t recipient;		/* NULL for the message status */
+    const smtp_status_t *status;
+  };
+typedef void (*smtp_status_batchcb_t) (smtp_session_t session,
+				       struct smtp_status_record *records,
+				       int nrecords, void *arg);
+int smtp_set_status_batch (smtp_session_t session,
+			   struct smtp_status_record *records, int nrecords,
+			   long timeout, smtp_status_batchcb_t cb, void *arg);
 const smtp_status_t *smtp_recipient_status (smtp_recipient_t recipient);
 int smtp_recipient_check_complete (smtp_recipient_t recipient);
 int smtp_recipient_reset_status (smtp_recipient_t recipient);
@@ -189,6 +240,9 @@ void smtp_recipient_set_application_data_release (smtp_recipient_t recipient,
 void *smtp_recipient_get_application_data (smtp_recipient_t recipient);
 
 int smtp_option_require_all_recipients (smtp_session_t session, int state);
+int smtp_set_pipeline_window (smtp_session_t session, int commands,
+			      unsigned long octets);
+int smtp_set_quit_linger (smtp_session_t session, long milliseconds);
 
 #ifdef _auth_client_h
 int smtp_auth_set_context (smtp_session_t session, auth_context_t context);
@@ -322,6 +376,13 @@ enum by_mode
 int smtp_deliverby_set_mode (smtp_message_t message,
 			     long time, enum by_mode mode, int trace);
 
+/*
+	RFC 4468.  Message Submission BURL Extension
+ */
+
+int smtp_burl_add_url (smtp_message_t message, const char *url);
+int smtp_burl_add_literal (smtp_message_t message, const char *data, int len);
+
 /*
     	RFC 3207.  SMTP Starttls extension.
  */
@@ -330,14 +391,19 @@ int smtp_deliverby_set_mode (smtp_message_t message,
  * @Starttls_DISABLED: Do not use TLS, even if offered by the MTA.
  * @Starttls_ENABLED: Use TLS if offered by the MTA.
  * @Starttls_REQUIRED: Exit session if TLS is not offered by the MTA.
+ * @Starttls_IMPLICIT: Negotiate TLS on connecting, before the greeting.
  */
 enum starttls_option
   {
     Starttls_DISABLED,
     Starttls_ENABLED,
-    Starttls_REQUIRED
+    Starttls_REQUIRED,
+    Starttls_IMPLICIT
   };
 int smtp_starttls_enable (smtp_session_t session, enum starttls_option how);
+int smtp_starttls_set_resumption (smtp_session_t session, int enable);
+int smtp_starttls_set_early_data (smtp_session_t session, int enable);
+int smtp_starttls_set_async (smtp_session_t session, int enable);
 
 /* Only delare this if the app has incuded <openssl/ssl.h> which
    defines the symbol tested. */
@@ -382,6 +448,60 @@ void smtp_etrn_set_application_data_release (smtp_etrn_node_t node, void *data,
                                              void (*release) (void *));
 void *smtp_etrn_get_application_data (smtp_etrn_node_t node);
 
+/*
+	Allocation statistics
+ */
+
+/**
+ * struct smtp_alloc_stats - Heap allocation statistics.
+ * @allocs: Number of blocks allocated.
+ * @reallocs: Number of blocks resized.
+ * @frees: Number of blocks freed.
+ * @bytes: Total bytes allocated.
+ * @current: Bytes currently allocated.
+ * @peak: Maximum bytes allocated at any time.
+ */
+struct smtp_alloc_stats
+  {
+    unsigned long allocs;
+    unsigned long reallocs;
+    unsigned long frees;
+    unsigned long bytes;
+    unsigned long current;
+    unsigned long peak;
+  };
+int smtp_alloc_stats (struct smtp_alloc_stats *stats, int reset);
+
+/*
+	Caches shared between processes
+ */
+
+int smtp_shared_cache_attach (const char *name, size_t size);
+int smtp_shared_cache_detach (void);
+
+/*
+	Metrics
+ */
+
+typedef struct smtp_metrics *smtp_metrics_t;
+
+/**
+ * typedef smtp_metrics_writecb_t - Metrics output callback.
+ * @buf: Formatted text.
+ * @len: Length of text.
+ * @arg: User data.
+ */
+typedef void (*smtp_metrics_writecb_t) (const char *buf, int len, void *arg);
+
+int smtp_metrics_enable (int enable);
+smtp_metrics_t smtp_metrics_snapshot (void);
+int smtp_metrics_merge (smtp_metrics_t dst, smtp_metrics_t src);
+void smtp_metrics_destroy (smtp_metrics_t metrics);
+int smtp_metrics_write_prometheus (smtp_metrics_t metrics,
+				   smtp_metrics_writecb_t cb, void *arg);
+int smtp_metrics_write_json (smtp_metrics_t metrics,
+			     smtp_metrics_writecb_t cb, void *arg);
+
 #ifdef __cplusplus
 };
 #endif
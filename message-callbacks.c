@@ -28,6 +28,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+#include <missing.h> /* declarations for missing library functions */
+
 #include "libesmtp.h"
 
 #define BUFLEN	8192
@@ -0,0 +1,226 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2002-2004  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <errno.h>
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+
+/**
+ * DOC: Message Accounting
+ *
+ * Message Accounting
+ * ------------------
+ *
+ * libESMTP counts the octets of each message as it is transferred to the
+ * server and may optionally compute a message digest at the same time.
+ * Since the counts and digest are computed as the message is copied to
+ * the network, the application does not need to read the message a second
+ * time to obtain its size or a checksum for reconciliation or archiving.
+ *
+ * The content octets and the digest cover the message exactly as
+ * transferred, that is, after header processing by libESMTP, but
+ * excluding the SMTP transparency mechanism.  The wire octets count the
+ * message data as it appears on the network, including dot stuffing and
+ * the terminating ``.`` line for DATA, or the BDAT commands for CHUNKING.
+ * The values describe the most recent transfer of the message; in VERP
+ * mode this is the transfer to the last recipient.
+ *
+ * Digests require libESMTP to be built with OpenSSL.  Any digest algorithm
+ * known to OpenSSL may be selected by name.
+ */
+
+/**
+ * smtp_message_content_octets() - Octets of message content.
+ * @message: The message.
+ *
+ * Report the size of the message content sent by the most recent transfer,
+ * after header processing.
+ *
+ * Return: Number of octets, zero if the message has not been transferred.
+ */
+unsigned long
+smtp_message_content_octets (smtp_message_t message)
+{
+  SMTPAPI_CHECK_ARGS (message != NULL, 0);
+
+  return message->content_octets;
+}
+
+/**
+ * smtp_message_wire_octets() - Octets of message data on the wire.
+ * @message: The message.
+ *
+ * Report the number of octets sent to the server to transfer the message
+ * content, including dot stuffing and the end of data indication or the
+ * BDAT commands.
+ *
+ * Return: Number of octets, zero if the message has not been transferred.
+ */
+unsigned long
+smtp_message_wire_octets (smtp_message_t message)
+{
+  SMTPAPI_CHECK_ARGS (message != NULL, 0);
+
+  return message->wire_octets;
+}
+
+#ifdef USE_TLS
+
+/**
+ * smtp_message_set_digest() - Compute a digest of the message.
+ * @message: The message.
+ * @name: Name of the digest algorithm, e.g. ``"sha256"``, or NULL.
+ *
+ * Compute a digest of the message content while it is transferred.  The
+ * digest algorithm is looked up by name using OpenSSL.  Set @name to NULL
+ * to stop computing the digest.
+ *
+ * Return: Non-zero on success, zero if the algorithm is unknown or
+ * libESMTP does not support digests.
+ */
+int
+smtp_message_set_digest (smtp_message_t message, const char *name)
+{
+  const EVP_MD *md = NULL;
+
+  SMTPAPI_CHECK_ARGS (message != NULL, 0);
+
+  if (name != NULL && (md = EVP_get_digestbyname (name)) == NULL)
+    {
+      set_errno (EINVAL);
+      return 0;
+    }
+  if (md != NULL && message->digest_ctx == NULL
+      && (message->digest_ctx = EVP_MD_CTX_new ()) == NULL)
+    {
+      set_errno (ENOMEM);
+      return 0;
+    }
+  message->digest_md = md;
+  message->digest_len = 0;
+  return 1;
+}
+
+/**
+ * smtp_message_get_digest() - Retrieve the message digest.
+ * @message: The message.
+ * @buf: Buffer to receive the digest.
+ * @len: Length of @buf.
+ *
+ * Copy the binary digest computed by the most recent complete transfer of
+ * the message to @buf.  A buffer of ``EVP_MAX_MD_SIZE`` octets is always
+ * sufficient.
+ *
+ * Return: Length of the digest, zero if no digest is available or @buf is
+ * too small.
+ */
+size_t
+smtp_message_get_digest (smtp_message_t message, unsigned char *buf,
+			 size_t len)
+{
+  SMTPAPI_CHECK_ARGS (message != NULL && buf != NULL, 0);
+
+  if (message->digest_len == 0 || len < message->digest_len)
+    return 0;
+  memcpy (buf, message->digest, message->digest_len);
+  return message->digest_len;
+}
+
+#else
+
+int
+smtp_message_set_digest (smtp_message_t message,
+			 const char *name __attribute__ ((unused)))
+{
+  SMTPAPI_CHECK_ARGS (message != NULL, 0);
+
+  set_errno (ENOSYS);
+  return 0;
+}
+
+size_t
+smtp_message_get_digest (smtp_message_t message,
+			 unsigned char *buf __attribute__ ((unused)),
+			 size_t len __attribute__ ((unused)))
+{
+  SMTPAPI_CHECK_ARGS (message != NULL, 0);
+
+  return 0;
+}
+
+#endif
+
+/* Start accounting for a transfer of the message.  */
+void
+digest_start (smtp_message_t message)
+{
+  message->content_octets = 0;
+  message->wire_octets = 0;
+#ifdef USE_TLS
+  message->digest_len = 0;
+  message->digest_active = message->digest_md != NULL
+  			   && EVP_DigestInit_ex (message->digest_ctx,
+			   			 message->digest_md, NULL);
+#endif
+}
+
+/* Account for message content about to be written to the server.  */
+void
+digest_update (smtp_message_t message,
+	       const char *data __attribute__ ((unused)), size_t len)
+{
+  message->content_octets += len;
+#ifdef USE_TLS
+  if (message->digest_active
+      && !EVP_DigestUpdate (message->digest_ctx, data, len))
+    message->digest_active = 0;
+#endif
+}
+
+/* The transfer is complete.  Finalise the digest.  */
+void
+digest_finish (smtp_message_t message __attribute__ ((unused)))
+{
+#ifdef USE_TLS
+  unsigned int len;
+
+  if (message->digest_active
+      && EVP_DigestFinal_ex (message->digest_ctx, message->digest, &len))
+    message->digest_len = len;
+  message->digest_active = 0;
+#endif
+}
+
+/* Free resources used for accounting.  */
+void
+digest_destroy (smtp_message_t message __attribute__ ((unused)))
+{
+#ifdef USE_TLS
+  if (message->digest_ctx != NULL)
+    EVP_MD_CTX_free (message->digest_ctx);
+#endif
+}
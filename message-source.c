@@ -31,6 +31,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+
+#include <missing.h> /* declarations for missing library functions */
+
 #include "message-source.h"
 
 /* This is similar to code in siobuf.c */
@@ -199,6 +202,24 @@ msg_nextc (msg_source_t source)
   return *source->rp;
 }
 
+/* Discard the message headers, that is, all lines up to and including
+   the first empty line.  This is used when previously processed headers
+   are reused.  Returns zero if the message ends before the headers do.
+ */
+int
+msg_skip_headers (msg_source_t source)
+{
+  const char *line;
+  int len;
+
+  assert (source != NULL);
+
+  while ((line = msg_gets (source, &len, 0)) != NULL)
+    if (len == 2 && line[0] == '\r' && line[1] == '\n')
+      return 1;
+  return 0;
+}
+
 /* Block oriented reader.  The output buffer is not used for efficiency.
  */
 const char *
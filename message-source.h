@@ -37,6 +37,7 @@ void msg_source_set_cb (msg_source_t source,
 void msg_rewind (msg_source_t source);
 const char *msg_gets (msg_source_t source, int *len, int concatenate);
 int msg_nextc (msg_source_t source);
+int msg_skip_headers (msg_source_t source);
 const char *msg_getb (msg_source_t source, int *len);
 
 #endif
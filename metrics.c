@@ -0,0 +1,746 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+#include "metrics.h"
+#include "attribute.h"
+
+/**
+ * DOC: Metrics
+ *
+ * Metrics
+ * -------
+ *
+ * libESMTP can count connections, messages, recipients, octets and server
+ * replies and record latency histograms for TCP connection, TLS handshake, command
+ * round trip and the wait for the server to accept the message data.  All
+ * figures are kept per server, identified by the ``host:port`` string
+ * passed to smtp_set_server().
+ *
+ * Recording is disabled by default and is enabled for the whole process
+ * using smtp_metrics_enable().  Each thread records into its own private
+ * tables so that sessions running concurrently do not contend with each
+ * other.  smtp_metrics_snapshot() collects the figures from all threads,
+ * including threads which have since exited, into a &smtp_metrics_t which
+ * may be formatted for Prometheus or as JSON.
+ *
+ * Histogram buckets are powers of two microseconds, bucket *i* counting
+ * durations from 2^i up to 2^(i+1) microseconds.
+ */
+
+/* Each thread has a table of servers.  Only the owning thread writes to
+   its table, so counters are updated using a relaxed load and store
+   rather than a read-modify-write.  Snapshots may be taken concurrently
+   from any thread and will see each counter either before or after an
+   update.  A slot is published by setting its `used' flag once the
+   name is filled in; slots are never released until the thread exits.
+   Servers which do not fit in the table are recorded in an overflow slot
+   named "*".  */
+
+#define METRICS_NAME_MAX	128
+#define METRICS_SLOTS		64
+
+struct metrics_histogram_data
+  {
+    atomic_ulong bucket[METRICS_NBUCKETS];
+    atomic_ulong count;
+    atomic_ulong sum_us;
+  };
+
+struct metrics_server
+  {
+    atomic_int used;
+    char name[METRICS_NAME_MAX];
+    atomic_ulong counter[METRICS_NCOUNTERS];
+    struct metrics_histogram_data histogram[METRICS_NHISTOGRAMS];
+  };
+
+struct metrics_shard
+  {
+    struct metrics_shard *next;
+    struct metrics_server slot[METRICS_SLOTS];
+    struct metrics_server overflow;
+  };
+
+/* Totals in a snapshot */
+struct metrics_totals
+  {
+    char *name;
+    unsigned long counter[METRICS_NCOUNTERS];
+    struct
+      {
+	unsigned long bucket[METRICS_NBUCKETS];
+	unsigned long count;
+	unsigned long sum_us;
+      }
+    histogram[METRICS_NHISTOGRAMS];
+  };
+
+struct smtp_metrics
+  {
+    struct metrics_totals *servers;
+    int nservers;
+    int nalloc;
+  };
+
+static const struct
+  {
+    const char *name;
+    const char *help;
+  }
+counter_info[METRICS_NCOUNTERS] =
+  {
+    { "connections", "TCP connections established" },
+    { "connect_failures", "TCP connections which failed" },
+    { "tls_failures", "TLS handshakes which failed" },
+    { "tls_early_data", "TLS early data accepted by the server" },
+    { "tls_early_rejected", "TLS early data rejected by the server" },
+    { "tls_sessions_uncached", "TLS sessions too large for the shared cache" },
+    { "messages_accepted", "Messages accepted by the server" },
+    { "messages_failed", "Messages refused by the server" },
+    { "recipients_accepted", "Recipients accepted by the server" },
+    { "recipients_failed", "Recipients refused by the server" },
+    { "replies_2xx", "Server replies with a 2xx status" },
+    { "replies_3xx", "Server replies with a 3xx status" },
+    { "replies_4xx", "Server replies with a 4xx status" },
+    { "replies_5xx", "Server replies with a 5xx status" },
+    { "octets_sent", "Octets sent to the server" },
+    { "octets_received", "Octets received from the server" },
+  },
+histogram_info[METRICS_NHISTOGRAMS] =
+  {
+    { "connect", "Time to establish the TCP connection" },
+    { "tls_handshake", "Time to complete the TLS handshake" },
+    { "command_rtt", "Time from sending a command to its reply" },
+    { "final_response", "Time from end of message to the server's reply" },
+  };
+
+static atomic_int metrics_enabled;
+
+#ifdef USE_PTHREADS
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static struct metrics_shard *metrics_shards;
+static struct smtp_metrics metrics_retired;	/* Totals for exited threads */
+#else
+static struct metrics_shard metrics_shard;
+#define metrics_shards	(&metrics_shard)
+#endif
+
+/*****************************************************************************
+ * Snapshot totals
+ *****************************************************************************/
+
+static struct metrics_totals *
+totals_lookup (struct smtp_metrics *metrics, const char *name)
+{
+  struct metrics_totals *totals;
+  int i;
+
+  for (i = 0; i < metrics->nservers; i++)
+    if (strcmp (metrics->servers[i].name, name) == 0)
+      return &metrics->servers[i];
+
+  if (metrics->nservers >= metrics->nalloc)
+    {
+      int nalloc = metrics->nalloc > 0 ? metrics->nalloc * 2 : 8;
+
+      totals = realloc (metrics->servers, nalloc * sizeof *totals);
+      if (totals == NULL)
+	return NULL;
+      metrics->servers = totals;
+      metrics->nalloc = nalloc;
+    }
+  totals = &metrics->servers[metrics->nservers];
+  memset (totals, 0, sizeof *totals);
+  if ((totals->name = strdup (name)) == NULL)
+    return NULL;
+  metrics->nservers++;
+  return totals;
+}
+
+static int
+merge_server (struct smtp_metrics *metrics, struct metrics_server *server)
+{
+  struct metrics_totals *totals;
+  struct metrics_histogram_data *hist;
+  int i, j;
+
+  if (!atomic_load_explicit (&server->used, memory_order_acquire))
+    return 1;
+  if ((totals = totals_lookup (metrics, server->name)) == NULL)
+    return 0;
+  for (i = 0; i < METRICS_NCOUNTERS; i++)
+    totals->counter[i] += atomic_load_explicit (&server->counter[i],
+						memory_order_relaxed);
+  for (i = 0; i < METRICS_NHISTOGRAMS; i++)
+    {
+      hist = &server->histogram[i];
+      for (j = 0; j < METRICS_NBUCKETS; j++)
+	totals->histogram[i].bucket[j]
+	  += atomic_load_explicit (&hist->bucket[j], memory_order_relaxed);
+      totals->histogram[i].count += atomic_load_explicit (&hist->count,
+							   memory_order_relaxed);
+      totals->histogram[i].sum_us += atomic_load_explicit (&hist->sum_us,
+							    memory_order_relaxed);
+    }
+  return 1;
+}
+
+static int
+merge_shard (struct smtp_metrics *metrics, struct metrics_shard *shard)
+{
+  int i;
+
+  for (i = 0; i < METRICS_SLOTS; i++)
+    if (!merge_server (metrics, &shard->slot[i]))
+      return 0;
+  return merge_server (metrics, &shard->overflow);
+}
+
+static int
+merge_metrics (struct smtp_metrics *dst, const struct smtp_metrics *src)
+{
+  struct metrics_totals *totals;
+  const struct metrics_totals *from;
+  int i, j, k;
+
+  for (i = 0; i < src->nservers; i++)
+    {
+      from = &src->servers[i];
+      if ((totals = totals_lookup (dst, from->name)) == NULL)
+	return 0;
+      for (j = 0; j < METRICS_NCOUNTERS; j++)
+	totals->counter[j] += from->counter[j];
+      for (j = 0; j < METRICS_NHISTOGRAMS; j++)
+	{
+	  for (k = 0; k < METRICS_NBUCKETS; k++)
+	    totals->histogram[j].bucket[k] += from->histogram[j].bucket[k];
+	  totals->histogram[j].count += from->histogram[j].count;
+	  totals->histogram[j].sum_us += from->histogram[j].sum_us;
+	}
+    }
+  return 1;
+}
+
+static void
+free_totals (struct smtp_metrics *metrics)
+{
+  int i;
+
+  for (i = 0; i < metrics->nservers; i++)
+    free (metrics->servers[i].name);
+  free (metrics->servers);
+  memset (metrics, 0, sizeof *metrics);
+}
+
+/*****************************************************************************
+ * Per-thread tables
+ *****************************************************************************/
+
+#ifdef USE_PTHREADS
+/* When a thread exits, fold its figures into the retired totals so that
+   memory does not grow with the number of threads ever created.  */
+static void
+shard_destroy (void *value)
+{
+  struct metrics_shard *shard = value, **p;
+
+  pthread_mutex_lock (&metrics_mutex);
+  for (p = &metrics_shards; *p != NULL; p = &(*p)->next)
+    if (*p == shard)
+      {
+	*p = shard->next;
+	break;
+      }
+  merge_shard (&metrics_retired, shard);
+  pthread_mutex_unlock (&metrics_mutex);
+  free (shard);
+}
+
+static void
+metrics_key_create (void)
+{
+  pthread_key_create (&metrics_key, shard_destroy);
+}
+
+static struct metrics_shard *
+get_shard (void)
+{
+  struct metrics_shard *shard;
+
+  pthread_once (&metrics_once, metrics_key_create);
+  shard = pthread_getspecific (metrics_key);
+  if (shard == NULL)
+    {
+      if ((shard = calloc (1, sizeof *shard)) == NULL)
+	return NULL;
+      if (pthread_setspecific (metrics_key, shard) != 0)
+	{
+	  free (shard);
+	  return NULL;
+	}
+      pthread_mutex_lock (&metrics_mutex);
+      shard->next = metrics_shards;
+      metrics_shards = shard;
+      pthread_mutex_unlock (&metrics_mutex);
+    }
+  return shard;
+}
+#else
+#define get_shard()	(&metrics_shard)
+#endif
+
+static void
+claim_slot (struct metrics_server *server, const char *name)
+{
+  strlcpy (server->name, name, sizeof server->name);
+  atomic_store_explicit (&server->used, 1, memory_order_release);
+}
+
+/* Find the calling thread's slot for the server at host:port, or NULL if
+   metrics are disabled.  The result is valid until the thread exits.  */
+struct metrics_server *
+metrics_server (const char *host, const char *port)
+{
+  struct metrics_shard *shard;
+  struct metrics_server *server;
+  char name[METRICS_NAME_MAX];
+  unsigned int hash, i;
+
+  if (!atomic_load_explicit (&metrics_enabled, memory_order_relaxed))
+    return NULL;
+  if ((shard = get_shard ()) == NULL)
+    return NULL;
+
+  snprintf (name, sizeof name, "%s:%s",
+	    (host != NULL && *host != '\0') ? host : "localhost", port);
+  hash = hash_server_name (name);
+  for (i = 0; i < METRICS_SLOTS; i++)
+    {
+      server = &shard->slot[(hash + i) % METRICS_SLOTS];
+      if (!atomic_load_explicit (&server->used, memory_order_relaxed))
+	{
+	  claim_slot (server, name);
+	  return server;
+	}
+      if (strcmp (server->name, name) == 0)
+	return server;
+    }
+  server = &shard->overflow;
+  if (!atomic_load_explicit (&server->used, memory_order_relaxed))
+    claim_slot (server, "*");
+  return server;
+}
+
+/*****************************************************************************
+ * Recording
+ *****************************************************************************/
+
+static inline void
+add (atomic_ulong *value, unsigned long n)
+{
+  atomic_store_explicit (value,
+			 atomic_load_explicit (value, memory_order_relaxed) + n,
+			 memory_order_relaxed);
+}
+
+void
+metrics_now (struct timespec *ts)
+{
+  clock_gettime (CLOCK_MONOTONIC, ts);
+}
+
+void
+metrics_count (struct metrics_server *server,
+	       enum metrics_counter counter, unsigned long n)
+{
+  if (server != NULL)
+    add (&server->counter[counter], n);
+}
+
+void
+metrics_reply (struct metrics_server *server, int code)
+{
+  code /= 100;
+  if (server != NULL && code >= 2 && code <= 5)
+    add (&server->counter[METRICS_REPLIES_2XX + code - 2], 1);
+}
+
+/* Record the time elapsed since `start'.  */
+void
+metrics_time (struct metrics_server *server, enum metrics_histogram histogram,
+	      const struct timespec *start)
+{
+  struct metrics_histogram_data *hist;
+  struct timespec now;
+  long usec;
+  int b;
+
+  if (server == NULL)
+    return;
+  metrics_now (&now);
+  usec = (now.tv_sec - start->tv_sec) * 1000000L
+	 + (now.tv_nsec - start->tv_nsec) / 1000L;
+  if (usec < 0)
+    usec = 0;
+  for (b = 0; b < METRICS_NBUCKETS - 1 && (usec >> (b + 1)) != 0; b++)
+    ;
+  hist = &server->histogram[histogram];
+  add (&hist->bucket[b], 1);
+  add (&hist->count, 1);
+  add (&hist->sum_us, usec);
+}
+
+/* Responses arrive in the same order as commands are sent, so the send
+   times are kept in a ring buffer.  When the ring is full, later commands
+   are counted instead and their responses are not timed; recording
+   resumes once all outstanding responses have been read.  */
+
+void
+metrics_inflight_reset (struct metrics_inflight *inflight)
+{
+  inflight->head = inflight->count = inflight->lost = 0;
+}
+
+void
+metrics_command_sent (struct metrics_server *server,
+		      struct metrics_inflight *inflight)
+{
+  if (server == NULL)
+    return;
+  if (inflight->lost > 0 || inflight->count >= METRICS_INFLIGHT)
+    {
+      inflight->lost++;
+      return;
+    }
+  metrics_now (&inflight->sent[(inflight->head + inflight->count)
+			       % METRICS_INFLIGHT]);
+  inflight->count++;
+}
+
+void
+metrics_response_read (struct metrics_server *server,
+		       struct metrics_inflight *inflight, int final)
+{
+  struct timespec *sent;
+
+  if (server == NULL)
+    return;
+  if (inflight->count > 0)
+    {
+      sent = &inflight->sent[inflight->head];
+      inflight->head = (inflight->head + 1) % METRICS_INFLIGHT;
+      inflight->count--;
+      metrics_time (server, final ? METRICS_FINAL_WAIT : METRICS_COMMAND_RTT,
+		    sent);
+    }
+  else if (inflight->lost > 0)
+    inflight->lost--;
+}
+
+/*****************************************************************************
+ * API
+ *****************************************************************************/
+
+/**
+ * smtp_metrics_enable() - Enable or disable metrics.
+ * @enable: Non-zero to record metrics.
+ *
+ * Enable or disable recording of metrics for all sessions in the process.
+ * A change takes effect from the next call to smtp_start_session().
+ * Figures already recorded are retained when recording is disabled.
+ *
+ * Return: The previous setting.
+ */
+int
+smtp_metrics_enable (int enable)
+{
+  return atomic_exchange (&metrics_enabled, enable != 0);
+}
+
+/**
+ * smtp_metrics_snapshot() - Collect metrics.
+ *
+ * Collect the metrics recorded by all threads, merging the figures for
+ * each server.  The snapshot is independent of further recording and
+ * must be released with smtp_metrics_destroy().
+ *
+ * Return: The snapshot or %NULL on failure.
+ */
+smtp_metrics_t
+smtp_metrics_snapshot (void)
+{
+  struct smtp_metrics *metrics;
+  struct metrics_shard *shard;
+  int ok;
+
+  if ((metrics = calloc (1, sizeof *metrics)) == NULL)
+    {
+      set_errno (ENOMEM);
+      return NULL;
+    }
+#ifdef USE_PTHREADS
+  pthread_mutex_lock (&metrics_mutex);
+  ok = merge_metrics (metrics, &metrics_retired);
+#else
+  ok = 1;
+#endif
+  for (shard = metrics_shards; ok && shard != NULL; shard = shard->next)
+    ok = merge_shard (metrics, shard);
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock (&metrics_mutex);
+#endif
+  if (!ok)
+    {
+      smtp_metrics_destroy (metrics);
+      set_errno (ENOMEM);
+      return NULL;
+    }
+  return metrics;
+}
+
+/**
+ * smtp_metrics_merge() - Merge metrics.
+ * @dst: Snapshot to which figures are added.
+ * @src: Snapshot from which figures are taken.
+ *
+ * Add the figures in @src to those in @dst, for example to accumulate
+ * snapshots taken in several processes.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_metrics_merge (smtp_metrics_t dst, smtp_metrics_t src)
+{
+  SMTPAPI_CHECK_ARGS (dst != NULL && src != NULL && dst != src, 0);
+
+  if (!merge_metrics (dst, src))
+    {
+      set_errno (ENOMEM);
+      return 0;
+    }
+  return 1;
+}
+
+/**
+ * smtp_metrics_destroy() - Release a snapshot.
+ * @metrics: The snapshot.
+ */
+void
+smtp_metrics_destroy (smtp_metrics_t metrics)
+{
+  if (metrics == NULL)
+    return;
+  free_totals (metrics);
+  free (metrics);
+}
+
+/*****************************************************************************
+ * Formatting
+ *****************************************************************************/
+
+struct writer
+  {
+    smtp_metrics_writecb_t cb;
+    void *arg;
+  };
+
+static void emit (struct writer *writer, const char *format, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void
+emit (struct writer *writer, const char *format, ...)
+{
+  char buf[512];
+  va_list alist;
+  int len;
+
+  va_start (alist, format);
+  len = vsnprintf (buf, sizeof buf, format, alist);
+  va_end (alist);
+  if (len < 0)
+    return;
+  if (len >= (int) sizeof buf)
+    len = sizeof buf - 1;
+  (*writer->cb) (buf, len, writer->arg);
+}
+
+/* Escape a server name for use in a quoted string.  Both formats use
+   backslash escapes; control characters are replaced.  */
+static const char *
+quote (char *buf, size_t size, const char *name)
+{
+  char *p = buf;
+
+  while (*name != '\0' && p + 3 < buf + size)
+    {
+      if (*name == '"' || *name == '\\')
+	*p++ = '\\';
+      *p++ = ((unsigned char) *name < ' ') ? '?' : *name;
+      name++;
+    }
+  *p = '\0';
+  return buf;
+}
+
+/**
+ * smtp_metrics_write_prometheus() - Format metrics for Prometheus.
+ * @metrics: The snapshot.
+ * @cb: Callback to receive the output.
+ * @arg: Argument passed to @cb.
+ *
+ * Format the snapshot in the Prometheus text exposition format.  Each
+ * metric has a ``server`` label.  Counters are named
+ * ``esmtp_<name>_total`` and histograms ``esmtp_<name>_seconds``.  The
+ * output is passed to @cb in a series of pieces, none of which contain a
+ * partial line.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_metrics_write_prometheus (smtp_metrics_t metrics,
+			       smtp_metrics_writecb_t cb, void *arg)
+{
+  struct writer writer;
+  struct metrics_totals *totals;
+  char server[2 * METRICS_NAME_MAX];
+  unsigned long cumulative;
+  int i, j, k;
+
+  SMTPAPI_CHECK_ARGS (metrics != NULL && cb != NULL, 0);
+
+  writer.cb = cb;
+  writer.arg = arg;
+  for (i = 0; i < METRICS_NCOUNTERS; i++)
+    {
+      emit (&writer, "# HELP esmtp_%s_total %s.\n"
+		     "# TYPE esmtp_%s_total counter\n",
+	    counter_info[i].name, counter_info[i].help, counter_info[i].name);
+      for (j = 0; j < metrics->nservers; j++)
+	{
+	  totals = &metrics->servers[j];
+	  emit (&writer, "esmtp_%s_total{server=\"%s\"} %lu\n",
+		counter_info[i].name,
+		quote (server, sizeof server, totals->name),
+		totals->counter[i]);
+	}
+    }
+  for (i = 0; i < METRICS_NHISTOGRAMS; i++)
+    {
+      emit (&writer, "# HELP esmtp_%s_seconds %s.\n"
+		     "# TYPE esmtp_%s_seconds histogram\n",
+	    histogram_info[i].name, histogram_info[i].help,
+	    histogram_info[i].name);
+      for (j = 0; j < metrics->nservers; j++)
+	{
+	  totals = &metrics->servers[j];
+	  quote (server, sizeof server, totals->name);
+	  cumulative = 0;
+	  for (k = 0; k < METRICS_NBUCKETS - 1; k++)
+	    {
+	      cumulative += totals->histogram[i].bucket[k];
+	      emit (&writer,
+		    "esmtp_%s_seconds_bucket{server=\"%s\",le=\"%g\"} %lu\n",
+		    histogram_info[i].name, server,
+		    (double) (2UL << k) / 1e6, cumulative);
+	    }
+	  emit (&writer,
+		"esmtp_%s_seconds_bucket{server=\"%s\",le=\"+Inf\"} %lu\n"
+		"esmtp_%s_seconds_sum{server=\"%s\"} %.6f\n"
+		"esmtp_%s_seconds_count{server=\"%s\"} %lu\n",
+		histogram_info[i].name, server, totals->histogram[i].count,
+		histogram_info[i].name, server,
+		(double) totals->histogram[i].sum_us / 1e6,
+		histogram_info[i].name, server, totals->histogram[i].count);
+	}
+    }
+  return 1;
+}
+
+/**
+ * smtp_metrics_write_json() - Format metrics as JSON.
+ * @metrics: The snapshot.
+ * @cb: Callback to receive the output.
+ * @arg: Argument passed to @cb.
+ *
+ * Format the snapshot as a JSON object.  The ``servers`` member is an
+ * array with an object for each server.  Each has a ``server`` member
+ * with the server name, a member for each counter and an object for each
+ * histogram with ``count``, ``sum_us`` and a ``buckets`` array of
+ * per-bucket counts, where element *i* counts durations from 2^i up to
+ * 2^(i+1) microseconds.  The output is passed to @cb in a series of
+ * pieces.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_metrics_write_json (smtp_metrics_t metrics,
+			 smtp_metrics_writecb_t cb, void *arg)
+{
+  struct writer writer;
+  struct metrics_totals *totals;
+  char server[2 * METRICS_NAME_MAX];
+  int i, j, k;
+
+  SMTPAPI_CHECK_ARGS (metrics != NULL && cb != NULL, 0);
+
+  writer.cb = cb;
+  writer.arg = arg;
+  emit (&writer, "{\"servers\":[");
+  for (i = 0; i < metrics->nservers; i++)
+    {
+      totals = &metrics->servers[i];
+      emit (&writer, "%s{\"server\":\"%s\"", i > 0 ? "," : "",
+	    quote (server, sizeof server, totals->name));
+      for (j = 0; j < METRICS_NCOUNTERS; j++)
+	emit (&writer, ",\"%s\":%lu", counter_info[j].name, totals->counter[j]);
+      for (j = 0; j < METRICS_NHISTOGRAMS; j++)
+	{
+	  emit (&writer, ",\"%s\":{\"count\":%lu,\"sum_us\":%lu,\"buckets\":[",
+		histogram_info[j].name, totals->histogram[j].count,
+		totals->histogram[j].sum_us);
+	  for (k = 0; k < METRICS_NBUCKETS; k++)
+	    emit (&writer, "%s%lu", k > 0 ? "," : "",
+		  totals->histogram[j].bucket[k]);
+	  emit (&writer, "]}");
+	}
+      emit (&writer, "}");
+    }
+  emit (&writer, "]}\n");
+  return 1;
+}
@@ -0,0 +1,92 @@
+#ifndef _metrics_h
+#define _metrics_h
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <time.h>
+
+/* Counters and latency histograms are kept per server.  The recording
+   functions accept a NULL server, which is what metrics_server() returns
+   when metrics are disabled, so call sites need not check.  */
+
+enum metrics_counter
+  {
+    METRICS_CONNECTIONS,
+    METRICS_CONNECT_FAILURES,
+    METRICS_TLS_FAILURES,
+    METRICS_TLS_EARLY_DATA,
+    METRICS_TLS_EARLY_REJECTED,
+    METRICS_TLS_SESSIONS_UNCACHED,
+    METRICS_MESSAGES_ACCEPTED,
+    METRICS_MESSAGES_FAILED,
+    METRICS_RECIPIENTS_ACCEPTED,
+    METRICS_RECIPIENTS_FAILED,
+    METRICS_REPLIES_2XX,
+    METRICS_REPLIES_3XX,
+    METRICS_REPLIES_4XX,
+    METRICS_REPLIES_5XX,
+    METRICS_OCTETS_SENT,
+    METRICS_OCTETS_RECEIVED,
+    METRICS_NCOUNTERS
+  };
+
+enum metrics_histogram
+  {
+    METRICS_CONNECT_TIME,		/* TCP connect() */
+    METRICS_TLS_TIME,			/* TLS handshake */
+    METRICS_COMMAND_RTT,		/* Command to response */
+    METRICS_FINAL_WAIT,			/* End of message data to response */
+    METRICS_NHISTOGRAMS
+  };
+
+/* Bucket i counts samples in the range [2^i, 2^(i+1)) microseconds,
+   bucket 0 also counts samples under 1us.  The last bucket is unbounded.  */
+#define METRICS_NBUCKETS	32
+
+/* Send times of commands awaiting a response.  */
+#define METRICS_INFLIGHT	64
+
+struct metrics_inflight
+  {
+    struct timespec sent[METRICS_INFLIGHT];
+    int head, count;
+    int lost;				/* Commands sent when ring was full */
+  };
+
+struct metrics_server;
+
+struct metrics_server *metrics_server (const char *host, const char *port);
+void metrics_now (struct timespec *ts);
+void metrics_count (struct metrics_server *server,
+		    enum metrics_counter counter, unsigned long n);
+void metrics_time (struct metrics_server *server,
+		   enum metrics_histogram histogram,
+		   const struct timespec *start);
+void metrics_reply (struct metrics_server *server, int code);
+
+void metrics_command_sent (struct metrics_server *server,
+			   struct metrics_inflight *inflight);
+void metrics_response_read (struct metrics_server *server,
+			    struct metrics_inflight *inflight, int final);
+void metrics_inflight_reset (struct metrics_inflight *inflight);
+
+#endif
@@ -47,4 +47,7 @@ void *memrchr (const void *a, int c, size_t len);
 size_t strlcpy (char *dest, const char *src, size_t dest_size);
 #endif
 
+/* Count heap allocations if so configured */
+#include "alloc-stats.h"
+
 #endif
@@ -0,0 +1,180 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+/* OAUTHBEARER (RFC 7628) and the older XOAUTH2 mechanism used by some
+   providers.  Both send an OAuth 2.0 bearer token in the initial response.
+   This file is built once for each mechanism, selected by defining
+   XOAUTH2.
+
+   The token is requested from the application using the AUTH_TOKEN
+   flag.  Applications should normally supply tokens with
+   auth_set_token_cb() so that they are cached and refreshed before they
+   expire.  */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "auth-client.h"
+#include "auth-plugin.h"
+
+#define NELT(x)		(sizeof x / sizeof x[0])
+
+static int oauth_init (void *pctx);
+static void oauth_destroy (void *ctx);
+static const char *oauth_response (void *ctx, const char *challenge, int *len,
+				   auth_interact_t interact, void *arg);
+
+const struct auth_client_plugin sasl_client =
+  {
+  /* Plugin information */
+#ifdef XOAUTH2
+    "XOAUTH2",
+    "XOAUTH2 mechanism (OAuth 2.0 bearer token)",
+#else
+    "OAUTHBEARER",
+    "OAUTHBEARER mechanism (RFC 7628)",
+#endif
+  /* Plugin instance */
+    oauth_init,
+    oauth_destroy,
+  /* Authentication */
+    oauth_response,
+    AUTH_PLUGIN_PLAIN,
+  /* Security Layer */
+    0,
+    NULL,
+    NULL,
+  };
+
+static const struct auth_client_request client_request[] =
+  {
+    { "user",		AUTH_CLEARTEXT | AUTH_USER,	"User Name",	255, },
+    { "token",		AUTH_CLEARTEXT | AUTH_TOKEN,	"Access Token",	0, },
+  };
+
+struct oauth_context
+  {
+    int state;
+    char *buf;
+    size_t len;
+  };
+
+static int
+oauth_init (void *pctx)
+{
+  struct oauth_context *oauth;
+
+  oauth = calloc (1, sizeof (struct oauth_context));
+  if (oauth == NULL)
+    return 0;
+
+  *(void **) pctx = oauth;
+  return 1;
+}
+
+static void
+oauth_destroy (void *ctx)
+{
+  struct oauth_context *oauth = ctx;
+
+  if (oauth->buf != NULL)
+    {
+      memset (oauth->buf, '\0', oauth->len);
+      free (oauth->buf);
+    }
+  free (oauth);
+}
+
+#ifndef XOAUTH2
+/* Copy the user name to the GS2 header, RFC 5801, escaping ',' and '='.
+   Return the end of the copy.  */
+static char *
+copy_saslname (char *p, const char *user)
+{
+  for (; *user != '\0'; user++)
+    if (*user == ',')
+      {
+	memcpy (p, "=2C", 3);
+	p += 3;
+      }
+    else if (*user == '=')
+      {
+	memcpy (p, "=3D", 3);
+	p += 3;
+      }
+    else
+      *p++ = *user;
+  return p;
+}
+#endif
+
+static const char *
+oauth_response (void *ctx, const char *challenge __attribute__ ((unused)),
+		int *len, auth_interact_t interact, void *arg)
+{
+  struct oauth_context *oauth = ctx;
+  char *result[NELT (client_request)];
+  char *p;
+
+  switch (oauth->state)
+    {
+    case 0:
+      if (!(*interact) (client_request, result, NELT (client_request), arg))
+	break;
+
+      /* Allow for the user name to be escaped. */
+      oauth->len = 3 * strlen (result[0]) + strlen (result[1]) + 32;
+      if ((oauth->buf = malloc (oauth->len)) == NULL)
+	break;
+#ifdef XOAUTH2
+      p = oauth->buf + sprintf (oauth->buf, "user=%s\001", result[0]);
+#else
+      p = oauth->buf;
+      memcpy (p, "n,a=", 4);
+      p = copy_saslname (p + 4, result[0]);
+      memcpy (p, ",\001", 2);
+      p += 2;
+#endif
+      p += sprintf (p, "auth=Bearer %s\001\001", result[1]);
+      *len = p - oauth->buf;
+      oauth->state = 1;
+      return oauth->buf;
+
+    case 1:
+      /* The server rejected the token and sent the reason as a challenge.
+	 Respond as required for the server to complete the exchange with
+	 a failure.  */
+      oauth->state = -1;
+#ifdef XOAUTH2
+      *len = 0;
+      return "";
+#else
+      *len = 1;
+      return "\001";
+#endif
+    }
+  *len = 0;
+  return NULL;
+}
@@ -0,0 +1,58 @@
+#ifndef _probes_h
+#define _probes_h
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Static tracepoints for use with SystemTap, bpftrace, perf and similar
+   tools.  When the library is built with USDT probes, each tracepoint is
+   a single nop instruction plus an ELF note describing its arguments.
+   Otherwise the macros only evaluate their arguments, which are always
+   cheap expressions without side effects.
+
+   Probes are in the "libesmtp" provider.  Double underscores in the
+   probe names below are shown as hyphens by the tracing tools.
+
+   cmd (session, state)			command handler called for state
+   rsp (session, state)			response handler called for state
+   sio__flush (sio, octets)		write buffer flushed to the server
+   sio__fill (sio, octets)		read buffer filled from the server
+   tls__handshake__start (session)
+   tls__handshake__done (session, ok)
+   dns__start (session, host)		getaddrinfo() called for the MTA
+   dns__done (session, host, status)	getaddrinfo() result
+   message__start (session, message)	MAIL command issued
+   message__done (session, message, code)  final response to message
+ */
+
+#ifdef USE_USDT
+#include <sys/sdt.h>
+
+#define PROBE1(name,a)		DTRACE_PROBE1 (libesmtp, name, a)
+#define PROBE2(name,a,b)	DTRACE_PROBE2 (libesmtp, name, a, b)
+#define PROBE3(name,a,b,c)	DTRACE_PROBE3 (libesmtp, name, a, b, c)
+#else
+#define PROBE1(name,a)		do { (void) (a); } while (0)
+#define PROBE2(name,a,b)	do { (void) (a); (void) (b); } while (0)
+#define PROBE3(name,a,b,c)	do { (void) (a); (void) (b); (void) (c); } while (0)
+#endif
+
+#endif
@@ -26,6 +26,7 @@
 
 #include <config.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -33,10 +34,12 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <missing.h> /* declarations for missing library functions */
 
 #include <sys/socket.h>
+#include <netinet/in.h>
 #if HAVE_LWRES_NETDB_H
 # include <lwres/netdb.h>
 #else
@@ -53,6 +56,8 @@
 #include "tokens.h"
 #include "headers.h"
 #include "protocol.h"
+#include "probes.h"
+#include "shmcache.h"
 
 struct protocol_states
   {
@@ -102,39 +107,460 @@ next_recipient (smtp_recipient_t recipient)
 int
 next_message (smtp_session_t session)
 {
-  while ((session->current_message = session->current_message->next) != NULL)
+  /* Headers cached for VERP are not needed once the message is done. */
+  if (session->current_message->hdr_cached)
+    {
+      cat_free (&session->current_message->hdr_cache);
+      session->current_message->hdr_cached = 0;
+    }
+
+  while ((session->current_message = session->current_message->sched_next)
+	 != NULL)
     if (set_first_recipient (session))
       return 1;
   return 0;
 }
 
+/* Return the domain part of a mailbox.  */
+static const char *
+mailbox_domain (const char *mailbox)
+{
+  const char *at;
+
+  at = strrchr (mailbox, '@');
+  return at != NULL ? at + 1 : "";
+}
+
+/* Check if the recipient's domain differs from that of each unsent
+   recipient from first up to, but not including, the recipient.  */
+static int
+new_domain (smtp_recipient_t first, smtp_recipient_t recipient)
+{
+  const char *domain;
+
+  domain = mailbox_domain (recipient->mailbox);
+  for (; first != recipient; first = next_recipient (first))
+    if (strcasecmp (mailbox_domain (first->mailbox), domain) == 0)
+      return 0;
+  return 1;
+}
+
+/* Find the first recipient after the transaction starting with first.  In
+   VERP mode the transaction is for a single recipient, otherwise it is for
+   all the message's remaining recipients, split if necessary to keep
+   within the server's RCPTMAX and RCPTDOMAINMAX limits.  NULL means the
+   transaction extends to the end of the message.  */
+static smtp_recipient_t
+transaction_end (smtp_session_t session, smtp_recipient_t first)
+{
+  smtp_recipient_t recipient;
+  long nrcpt, ndomains;
+
+  if (session->current_message->verp)
+    return next_recipient (first);
+  if (session->rcpt_max <= 0 && session->rcpt_domain_max <= 0)
+    return NULL;
+
+  nrcpt = ndomains = 0;
+  for (recipient = first;
+       recipient != NULL;
+       recipient = next_recipient (recipient))
+    {
+      if (session->rcpt_max > 0 && nrcpt >= session->rcpt_max)
+	break;
+      if (session->rcpt_domain_max > 0 && new_domain (first, recipient))
+	{
+	  if (ndomains >= session->rcpt_domain_max)
+	    break;
+	  ndomains++;
+	}
+      nrcpt++;
+    }
+  return recipient;
+}
+
+/* Check if the server's MAILMAX limit permits another transaction on this
+   connection.  If not, the session must reconnect to continue.  */
+static int
+transaction_permitted (smtp_session_t session)
+{
+  if (session->mail_max > 0 && session->mail_count >= session->mail_max)
+    {
+      session->reconnect = 1;
+      return 0;
+    }
+  return 1;
+}
+
+/* Move on to the next transaction.  Normally this is the next unsent
+   message however, in VERP mode or when the server limits the recipients
+   per transaction, a message is split into several transactions, in which
+   case the next transaction starts with the next unsent recipient of the
+   current message.  Return zero if there are no more transactions or if
+   the next one must wait for a new connection.  */
+int
+next_transaction (smtp_session_t session)
+{
+  if (session->xact_end != NULL)
+    {
+      session->cmd_recipient = session->rsp_recipient = session->xact_end;
+      session->xact_end = NULL;
+    }
+  else if (!next_message (session))
+    return 0;
+  return transaction_permitted (session);
+}
+
+/* Check if QUIT should be sent with the end of the current transaction's
+   message data.  This is only done when requested, when the server
+   supports PIPELINING and when no transactions remain, since QUIT always
+   follows the response to the last message whatever the outcome.  */
+int
+pipeline_quit (smtp_session_t session)
+{
+  smtp_message_t message;
+  smtp_recipient_t recipient;
+
+  if (session->quit_linger < 0 || !(session->extensions & EXT_PIPELINING)
+      || session->xact_end != NULL)
+    return 0;
+  for (message = session->current_message->sched_next;
+       message != NULL;
+       message = message->sched_next)
+    for (recipient = message->recipients;
+	 recipient != NULL;
+	 recipient = recipient->next)
+      if (!recipient->complete)
+	return 0;
+  session->quit_pipelined = 1;
+  return 1;
+}
+
+/* Mark recipients in the current transaction complete following the
+   final response to DATA or BDAT.  When the MTA accepts the message,
+   only recipients for which it has accepted responsibility for delivery
+   are complete, otherwise if the message was permanently rejected, it
+   cannot be accepted for any recipient.  */
+void
+mark_recipients_complete (smtp_session_t session, int code)
+{
+  smtp_recipient_t recipient;
+
+  for (recipient = session->xact_first;
+       recipient != NULL && recipient != session->xact_end;
+       recipient = recipient->next)
+    if (code == 5)
+      recipient->complete = 1;
+    else if (code == 2 && !recipient->complete
+	     && recipient->status.code >= 200 && recipient->status.code <= 299)
+      recipient->complete = 1;
+}
+
+/* Return the message's priority, raised by the number of sessions in
+   which it was deferred.  */
+static int
+effective_priority (smtp_message_t message)
+{
+  int priority;
+
+  priority = message->priority + message->sched_age;
+  return priority < PRIORITY_MAX ? priority : PRIORITY_MAX;
+}
+
+/* Time remaining before a message should be sent.  If the application has
+   not set a deadline, the DELIVERBY time is used if set.  */
+static long
+time_remaining (smtp_message_t message, time_t now)
+{
+  if (message->deadline != 0)
+    return message->deadline - now;
+  if (message->by_mode != By_NOTSET)
+    return message->by_time;
+  return LONG_MAX;
+}
+
+/* Order messages by priority, then by deadline.  Otherwise messages are
+   sent in the order they were added to the session.  */
+static int
+compare_messages (const void *a, const void *b)
+{
+  smtp_message_t ma = *(const smtp_message_t *) a;
+  smtp_message_t mb = *(const smtp_message_t *) b;
+  long ta, tb;
+  int pa, pb;
+
+  pa = effective_priority (ma);
+  pb = effective_priority (mb);
+  if (pa != pb)
+    return pb - pa;
+  ta = ma->sched_remaining;
+  tb = mb->sched_remaining;
+  if (ta != tb)
+    return ta < tb ? -1 : 1;
+  return ma->sched_seq - mb->sched_seq;
+}
+
+/* Decide the order in which messages are sent, linking the messages
+   using their sched_next pointers.  Messages still unsent from a previous
+   schedule are aged first.  If no priorities or deadlines have been set
+   or memory is short, messages are sent in the order they were added.  */
+static void
+schedule_messages (smtp_session_t session)
+{
+  smtp_message_t message, *sched;
+  time_t now;
+  int i, n;
+
+  session->schedule = session->messages;
+  n = 0;
+  for (message = session->messages; message != NULL; message = message->next)
+    {
+      session->current_message = message;
+      if (message->scheduled && set_first_recipient (session)
+          && message->sched_age < PRIORITY_MAX - PRIORITY_MIN)
+	message->sched_age++;
+      message->scheduled = 1;
+      message->sched_next = message->next;
+      message->sched_seq = n++;
+    }
+  session->current_message = NULL;
+
+  if (!session->prioritised || n < 2)
+    return;
+  if ((sched = malloc (n * sizeof (smtp_message_t))) == NULL)
+    return;
+  now = time (NULL);
+  for (message = session->messages; message != NULL; message = message->next)
+    {
+      message->sched_remaining = time_remaining (message, now);
+      sched[message->sched_seq] = message;
+    }
+  qsort (sched, n, sizeof (smtp_message_t), compare_messages);
+
+  for (i = 0; i < n - 1; i++)
+    sched[i]->sched_next = sched[i + 1];
+  sched[n - 1]->sched_next = NULL;
+  session->schedule = sched[0];
+  free (sched);
+}
+
+/* Find the most urgent unsent message in the session, that is the one
+   sent first if the session were started now.  Return its effective
+   priority and set *deadline to its deadline or Deliver By time, or zero
+   if it has neither.  A session without priorities or deadlines has
+   priority zero and no deadline.  Used to order sessions waiting to run
+   in a runtime.  */
+int
+session_urgency (smtp_session_t session, time_t *deadline)
+{
+  smtp_message_t message;
+  smtp_recipient_t recipient;
+  time_t now, when;
+  int priority, best;
+
+  *deadline = 0;
+  if (!session->prioritised)
+    return 0;
+
+  now = time (NULL);
+  best = INT_MIN;
+  for (message = session->messages; message != NULL; message = message->next)
+    {
+      for (recipient = message->recipients; recipient != NULL;
+	   recipient = recipient->next)
+	if (!recipient->complete)
+	  break;
+      if (recipient == NULL)
+	continue;
+
+      if (message->deadline != 0)
+	when = message->deadline;
+      else if (message->by_mode != By_NOTSET)
+	when = now + message->by_time;
+      else
+	when = 0;
+      priority = effective_priority (message);
+      if (priority > best)
+	{
+	  best = priority;
+	  *deadline = when;
+	}
+      else if (priority == best && when != 0
+	       && (*deadline == 0 || when < *deadline))
+	*deadline = when;
+    }
+  return best != INT_MIN ? best : 0;
+}
+
 /* Set the current message to the first unsent message in the
    session.  */
 static int
 set_first_message (smtp_session_t session)
 {
-  for (session->current_message = session->messages;
+  schedule_messages (session);
+  for (session->current_message = session->schedule;
        session->current_message != NULL;
-       session->current_message = session->current_message->next)
+       session->current_message = session->current_message->sched_next)
     if (set_first_recipient (session))
       return 1;
   return 0;
 }
 
+/*****************************************************************************
+ * Local address selection.
+ *****************************************************************************/
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+static pthread_mutex_t local_address_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static unsigned int local_address_counter;
+
+void
+destroy_local_addresses (smtp_session_t session)
+{
+  int i;
+
+  if (!session->borrowed_local_addresses)
+    {
+      for (i = 0; i < session->n_local_addresses; i++)
+	free (session->local_addresses[i].name);
+      if (session->local_addresses != NULL)
+	free (session->local_addresses);
+    }
+  session->borrowed_local_addresses = 0;
+  session->local_addresses = NULL;
+  session->n_local_addresses = 0;
+}
+
+/* FNV-1a hash of the server name, ignoring case. */
+unsigned int
+hash_server_name (const char *name)
+{
+  unsigned int hash = 2166136261u;
+
+  if (name != NULL)
+    while (*name != '\0')
+      {
+	hash ^= (unsigned char) tolower ((unsigned char) *name++);
+	hash *= 16777619u;
+      }
+  return hash;
+}
+
+/* Return the nth local address with the required address family. */
+static struct local_address *
+nth_local_address (smtp_session_t session, int family, int n)
+{
+  int i;
+
+  for (i = 0; i < session->n_local_addresses; i++)
+    if (session->local_addresses[i].addr.ss_family == family && n-- == 0)
+      return &session->local_addresses[i];
+  return NULL;
+}
+
+/* Bind the socket to one of the session's local addresses.  Addresses
+   are tried in turn, starting with the selected one, until bind()
+   succeeds.  Returns zero if the socket could not be bound.  */
+static int
+bind_local_address (smtp_session_t session, int sd, int family)
+{
+  struct local_address *local;
+  unsigned int start;
+  int i, n, err;
+#ifdef IP_BIND_ADDRESS_NO_PORT
+  int one = 1;
+#endif
+
+  for (n = 0; nth_local_address (session, family, n) != NULL; n++)
+    ;
+  if (n == 0)
+    {
+      set_errno (EAFNOSUPPORT);
+      return 0;
+    }
+
+  if (session->local_address_selection == Local_HASH)
+    start = hash_server_name (session->host);
+  else
+    {
+#ifdef USE_PTHREADS
+      pthread_mutex_lock (&local_address_mutex);
+#endif
+      start = local_address_counter++;
+#ifdef USE_PTHREADS
+      pthread_mutex_unlock (&local_address_mutex);
+#endif
+    }
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+  /* Defer allocation of the ephemeral port until connect() so that the
+     port is only required to be unique for the full 4-tuple.  Otherwise
+     binding many connections to the same address exhausts the ports.  */
+  setsockopt (sd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof one);
+#endif
+
+  for (i = 0; i < n; i++)
+    {
+      local = nth_local_address (session, family, (start + i) % n);
+      if (bind (sd, (struct sockaddr *) &local->addr, local->addrlen) == 0)
+	return 1;
+      err = errno;
+      set_errno (err);
+      if (session->event_cb != NULL)
+	(*session->event_cb) (session, SMTP_EV_BINDFAILED,
+			      session->event_cb_arg, local->name, err);
+    }
+  return 0;
+}
+
 /*****************************************************************************
  * The main protocol engine.
  *****************************************************************************/
 
-int
-do_session (smtp_session_t session)
+/* Check if the next response is the server's verdict on the message data,
+   so that metrics can distinguish it from the ordinary command round
+   trip.  */
+static int
+final_response (smtp_session_t session)
 {
-  struct addrinfo hints, *res, *addrs;
-  int err;
-  int sd;
-  siobuf_t conn;
-  int nresp, status, want_flush, fast;
-  char *nodename;
+#ifdef USE_CHUNKING
+  if (session->rsp_state == S_bdat || session->rsp_state == S_bdat2)
+    return session->bdat_last_issued && session->bdat_pipelined == 1;
+#endif
+  return session->rsp_state == S_data2;
+}
+
+/* Check if the pipeline window is full, given the number of commands and
+   octets awaiting a response.  */
+static int
+window_full (smtp_session_t session, int nresp, unsigned long octets)
+{
+  if (nresp <= 0
+      || (session->pipeline_commands == 0 && session->pipeline_octets == 0))
+    return 0;
+  if (nresp >= PIPELINE_WINDOW_MAX)
+    return 1;
+  if (session->pipeline_commands > 0 && nresp >= session->pipeline_commands)
+    return 1;
+  return session->pipeline_octets > 0 && octets >= session->pipeline_octets;
+}
 
+/* Free the server addresses, which may have come from the shared cache.  */
+static void
+release_addresses (struct addrinfo *res, int cached)
+{
+  if (cached)
+    free (res);
+  else
+    freeaddrinfo (res);
+}
+
+/* Use the system's host name if the application has not set one.  */
+int
+default_localhost (smtp_session_t session)
+{
 #if HAVE_UNAME
   if (session->localhost == NULL)
     {
@@ -170,6 +596,26 @@ do_session (smtp_session_t session)
         }
     }
 #endif
+  return 1;
+}
+
+int
+do_session (smtp_session_t session)
+{
+  struct addrinfo hints, *res, *addrs;
+  char key[1024];
+  int err, cached;
+  int sd;
+  siobuf_t conn;
+  int nresp, status, want_flush, fast, stalled, reconnect;
+  unsigned long window[PIPELINE_WINDOW_MAX], acked;
+  unsigned int issued, answered;
+  char *nodename;
+  struct timespec start;
+  unsigned long sent, received;
+
+  if (!default_localhost (session))
+    return 0;
 
   /* Initialise the current message and recipient variables in the
      session.  This returns zero if there is no work to do.  */
@@ -206,39 +652,67 @@ do_session (smtp_session_t session)
   hints.ai_flags = AI_CANONNAME;
   hints.ai_family = PF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
-  err = getaddrinfo (nodename, session->port, &hints, &res);
-  if (err != 0)
+  cached = 0;
+  if (nodename != NULL)
     {
-      set_herror (err);
-      return 0;
+      snprintf (key, sizeof key, "%s:%s", nodename, session->port);
+      if ((res = shmcache_getaddrinfo (key)) != NULL)
+	cached = 1;
+    }
+  if (!cached)
+    {
+      PROBE2 (dns__start, session, nodename);
+      err = getaddrinfo (nodename, session->port, &hints, &res);
+      PROBE3 (dns__done, session, nodename, err);
+      if (err != 0)
+	{
+	  set_herror (err);
+	  return 0;
+	}
+      if (nodename != NULL)
+	shmcache_putaddrinfo (key, res);
     }
 
   session->canon = res->ai_canonname != NULL ? strdup (res->ai_canonname) : NULL;
+  session->metrics = metrics_server (session->host, session->port);
 
   /* Try to establish an SMTP session with each host in turn until one
-     succeeds.  */
-  for (addrs = res; addrs != NULL; addrs = addrs->ai_next)
+     succeeds.  If the server's MAILMAX limit ends a session with work
+     remaining, connect to the same host again.  */
+  reconnect = 0;
+  for (addrs = res; addrs != NULL; addrs = reconnect ? addrs : addrs->ai_next)
     {
+      reconnect = 0;
       sd = socket (addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
       if (sd < 0)
 	{
 	  set_errno (errno);
 	  continue;
 	}
+      if (session->n_local_addresses > 0
+	  && !bind_local_address (session, sd, addrs->ai_family))
+	{
+	  close (sd);
+	  continue;
+	}
+      metrics_now (&start);
       if (connect (sd, addrs->ai_addr, addrs->ai_addrlen) < 0)
 	{
 	  /* Failed to connect.  Close the socket and try again.  */
 	  set_errno (errno);
 	  close (sd);
+	  metrics_count (session->metrics, METRICS_CONNECT_FAILURES, 1);
 	  continue;
 	}
+      metrics_time (session->metrics, METRICS_CONNECT_TIME, &start);
+      metrics_count (session->metrics, METRICS_CONNECTIONS, 1);
 
       /* Add buffering to the socket */
       conn = sio_attach (sd, sd, SIO_BUFSIZE);
       if (conn == NULL)
 	{
 	  set_errno (ENOMEM);
-	  freeaddrinfo (res);
+	  release_addresses (res, cached);
 	  close (sd);
 	  return 0;
 	}
@@ -248,6 +722,13 @@ do_session (smtp_session_t session)
       if (session->monitor_cb != NULL)
 	sio_set_monitorcb (conn, session->monitor_cb, session->monitor_cb_arg);
 
+      /* Unlike the monitor, the transcript includes the message. */
+      if (session->transcript_fd >= 0)
+	{
+	  transcript_connect (session);
+	  sio_set_recordcb (conn, transcript_record, session);
+	}
+
       if (session->event_cb != NULL)
 	(*session->event_cb) (session, SMTP_EV_CONNECT, session->event_cb_arg);
 
@@ -292,25 +773,37 @@ do_session (smtp_session_t session)
       /* Reset variables to their initial state before entering the protocol
 	 main loop. */
       session->extensions = 0;
+      session->rcpt_max = session->rcpt_domain_max = session->mail_max = 0;
+      session->mail_count = 0;
+      session->reconnect = 0;
       session->try_fallback_server = 0;
       reset_status (&session->mta_status);
       destroy_auth_mechanisms (session);
       session->authenticated = 0;
+      session->mail_pipelined = 0;
+      session->quit_pipelined = 0;
+      session->xact_first = session->xact_end = NULL;
+      metrics_inflight_reset (&session->inflight);
 #ifdef USE_TLS
       session->using_tls = 0;
 #endif
 
       nresp = 0;
+      issued = answered = 0;
+      acked = 0;
       session->cmd_state = session->rsp_state = 0;
       while (session->rsp_state >= 0)
 	{
 	  if (session->cmd_state == -1)
 	    session->cmd_state = session->rsp_state;
+	  PROBE2 (cmd, session, session->cmd_state);
 	  (*protocol_states[session->cmd_state].cmd) (conn, session);
 	  sio_mark (conn);
 	  if (!(session->extensions & EXT_PIPELINING))
 	    session->cmd_state = -1;
 	  nresp++;
+	  window[issued++ % PIPELINE_WINDOW_MAX] = sio_get_position (conn);
+	  metrics_command_sent (session->metrics, &session->inflight);
 
 	  if (session->rsp_state < 0)
 	    break;
@@ -334,11 +827,34 @@ do_session (smtp_session_t session)
 	     After explicitly flushing the buffer, sio_poll blocks
 	     waiting to read data from the server since the server may
 	     take some time to complete the pending commands.
+
+	     If the pipeline window is full, `stalled' is set.  The buffer
+	     is flushed and sio_poll blocks until enough responses have
+	     been read to make room for the next command.
            */
-	  want_flush = (session->cmd_state == -1);
-	  fast = (session->cmd_state != -1);
+	  stalled = (session->cmd_state != -1
+		     && window_full (session, nresp,
+				     sio_get_position (conn) - acked));
+	  want_flush = (session->cmd_state == -1 || stalled);
+	  fast = !want_flush;
 	  while ((status = sio_poll (conn, nresp > 0, want_flush, fast)) > 0)
 	    {
+	      /* XXX - Here I assume that once the write fd becomes
+		       available for writing, it stays that way until
+		       it is written to.  I.e. a blocking read() or a
+		       subsequent poll() will not revoke the writable
+		       status.	Could somebody confirm that this is the
+		       case? */
+	      /* Flush before reading.  Data which is not a response, such
+		 as a TLS 1.3 session ticket, can make the socket readable
+		 before the pending commands have been sent; the response
+		 handler would then block waiting for a reply to a command
+		 the server has not yet received.  */
+	      if (status & SIO_WRITE)
+		{
+		  sio_flush (conn);
+		  want_flush = 0;
+		}
 	      if (status & SIO_READ)
 		{
 		  nresp--;
@@ -353,30 +869,55 @@ do_session (smtp_session_t session)
 	             must be read from the server before processing and
 	             an individual response may be larger than the read
 	             buffer.  */
+		  metrics_response_read (session->metrics, &session->inflight,
+					 final_response (session));
+		  PROBE2 (rsp, session, session->rsp_state);
 		  (*protocol_states[session->rsp_state].rsp) (conn, session);
-		}
-	      /* XXX - Here I assume that once the write fd becomes
-		       available for writing, it stays that way until
-		       it is written to.  I.e. a blocking read() or a
-		       subsequent poll() will not revoke the writable
-		       status.	Could somebody confirm that this is the
-		       case? */
-	      if (status & SIO_WRITE)
-		{
-		  sio_flush (conn);
-		  want_flush = 0;
+
+		  /* Don't wait long for the reply to a pipelined QUIT. */
+		  if (session->quit_pipelined && session->rsp_state == S_quit)
+		    sio_set_timeout (conn, session->quit_linger);
+
+		  /* Resume issuing commands once the window has room. */
+		  acked = window[answered++ % PIPELINE_WINDOW_MAX];
+		  if (stalled
+		      && !window_full (session, nresp,
+				       sio_get_position (conn) - acked))
+		    {
+		      stalled = 0;
+		      fast = (session->cmd_state != -1);
+		    }
 		}
 	    }
 	  if (status < 0)
 	    {
-	      set_error (SMTP_ERR_DROPPED_CONNECTION);
+	      /* The session is complete if the server does not reply to a
+		 pipelined QUIT in time.  */
+	      if (!(session->quit_pipelined && session->rsp_state == S_quit))
+		set_error (SMTP_ERR_DROPPED_CONNECTION);
 	      break;
 	    }
+
+	  /* Report status in batches when all the responses to a pipelined
+	     batch of commands have been read, or if the oldest report is
+	     due.  */
+	  if (nresp == 0 && (session->extensions & EXT_PIPELINING))
+	    status_batch_flush (session);
+	  else
+	    status_batch_check (session);
 	}
 
+      sio_get_octets (conn, &sent, &received);
+      metrics_count (session->metrics, METRICS_OCTETS_SENT, sent);
+      metrics_count (session->metrics, METRICS_OCTETS_RECEIVED, received);
+#ifdef USE_TLS
+      if (session->using_tls)
+	tls_session_done (session, sio_get_ssl (conn));
+#endif
       sio_detach (conn);
       close (sd);
 
+      status_batch_flush (session);
       if (session->event_cb != NULL)
 	(*session->event_cb) (session, SMTP_EV_DISCONNECT,
 	                      session->event_cb_arg);
@@ -384,15 +925,20 @@ do_session (smtp_session_t session)
       /* This flag will be set if the server was reached OK but was the
          wrong kind of server or the client is told to go away.  So if
          not set the protocol must have concluded sucessfully. */
+      if (session->reconnect && !session->try_fallback_server)
+	{
+	  reconnect = 1;
+	  continue;
+	}
       if (!session->try_fallback_server)
 	{
-	  freeaddrinfo (res);
+	  release_addresses (res, cached);
 	  return 1;
         }
     }
 
   /* If the loop terminated, couldn't work with any servers. */
-  freeaddrinfo (res);
+  release_addresses (res, cached);
   return 0;
 }
 
@@ -575,6 +1121,8 @@ read_smtp_response (siobuf_t conn, smtp_session_t session,
   concatenate (&text, "", 1);
   status->text = cat_shrink (&text, NULL);
 
+  metrics_reply (session->metrics, status->code);
+
   return status->code / 100;
 }
 
@@ -595,6 +1143,15 @@ cmd_greeting (siobuf_t conn, smtp_session_t session)
 {
   /* Set a five minute timeout. */
   sio_set_timeout (conn, session->greeting_timeout);
+#ifdef USE_TLS
+  /* With implicit TLS the handshake precedes the greeting. */
+  if (session->starttls_enabled == Starttls_IMPLICIT
+      && !implicit_tls (conn, session))
+    {
+      session->cmd_state = session->rsp_state = -1;
+      return;
+    }
+#endif
   session->cmd_state = -1;
 }
 
@@ -643,7 +1200,13 @@ rsp_greeting (siobuf_t conn, smtp_session_t session)
 void
 cmd_ehlo (siobuf_t conn, smtp_session_t session)
 {
-  sio_printf (conn, "EHLO %s\r\n", session->localhost);
+#ifdef USE_TLS
+  /* The server has EHLO already if it accepted it as TLS early data. */
+  if (session->early_ehlo)
+    session->early_ehlo = 0;
+  else
+#endif
+    sio_printf (conn, "EHLO %s\r\n", session->localhost);
   session->cmd_state = -1;
 }
 
@@ -684,6 +1247,13 @@ report_extensions (smtp_session_t session)
 			      session->event_cb_arg);
       exts |= EXT_BINARYMIME;
     }
+  if (no_required_extension (session, EXT_BURL))
+    {
+      if (session->event_cb != NULL)
+	(*session->event_cb) (session, SMTP_EV_EXTNA_BURL,
+			      session->event_cb_arg);
+      exts |= EXT_BURL;
+    }
 #endif
   if (no_required_extension (session, EXT_8BITMIME))
     {
@@ -706,6 +1276,31 @@ report_extensions (smtp_session_t session)
   return !exts;
 }
 
+/* Parse the parameters of the LIMITS keyword, RFC 9422.  Unknown limits
+   and values that are not positive are ignored.  */
+static void
+set_limits (smtp_session_t session, const char *p)
+{
+  char token[64];
+  const char *value;
+  long limit;
+
+  while (read_atom (skipblank (p), &p, token, sizeof token))
+    {
+      if ((value = strchr (token, '=')) == NULL)
+	continue;
+      limit = strtol (value + 1, NULL, 10);
+      if (limit <= 0)
+	continue;
+      if (strncasecmp (token, "RCPTMAX=", 8) == 0)
+	session->rcpt_max = limit;
+      else if (strncasecmp (token, "RCPTDOMAINMAX=", 14) == 0)
+	session->rcpt_domain_max = limit;
+      else if (strncasecmp (token, "MAILMAX=", 8) == 0)
+	session->mail_max = limit;
+    }
+}
+
 static int
 cb_ehlo (smtp_session_t session, char *buf)
 {
@@ -763,6 +1358,15 @@ cb_ehlo (smtp_session_t session, char *buf)
     }
   else if (strcasecmp (token, "ETRN") == 0)		/* RFC 1985 */
     session->extensions |= EXT_ETRN;
+  else if (strcasecmp (token, "MT-PRIORITY") == 0)	/* RFC 6710 */
+    session->extensions |= EXT_MTPRIORITY;
+  else if (strcasecmp (token, "BURL") == 0)		/* RFC 4468 */
+    session->extensions |= EXT_BURL;
+  else if (strcasecmp (token, "LIMITS") == 0)		/* RFC 9422 */
+    {
+      session->extensions |= EXT_LIMITS;
+      set_limits (session, p);
+    }
   else if (strcasecmp (token, "XUSR") == 0)	/* sendmail (I feel ill) */
     session->extensions |= EXT_XUSR;
   else if (strcasecmp (token, "XEXCH50") == 0)	/* exchange (I feel worse) */
@@ -777,6 +1381,7 @@ rsp_ehlo (siobuf_t conn, smtp_session_t session)
   int code;
 
   session->extensions = 0;
+  session->rcpt_max = session->rcpt_domain_max = session->mail_max = 0;
   destroy_auth_mechanisms (session);
   code = read_smtp_response (conn, session, &session->mta_status, cb_ehlo);
   if (code < 0)
@@ -952,6 +1557,37 @@ rsp_helo (siobuf_t conn, smtp_session_t session)
  * MAIL FROM: 
  *****************************************************************************/
 
+/* Write a VERP reverse path for the recipient.  The recipient's local
+   part and domain are inserted before the '@' of the reverse path mailbox
+   using the message's VERP delimiters, for example owner-list@example.org
+   and user@example.com gives owner-list+user=example.com@example.org.
+   The parts are written directly to the connection so that the address is
+   never truncated.  If it is too long the MTA rejects the MAIL command.  */
+static void
+verp_write_reverse_path (siobuf_t conn, smtp_message_t message,
+			 smtp_recipient_t recipient)
+{
+  const char *mailbox, *at, *rat;
+
+  mailbox = message->reverse_path_mailbox;
+  if (mailbox == NULL || *mailbox == '\0')
+    return;
+
+  if ((at = strrchr (mailbox, '@')) == NULL)
+    at = strchr (mailbox, '\0');
+  sio_write (conn, mailbox, at - mailbox);
+  sio_write (conn, &message->verp_delimiters[0], 1);
+  if ((rat = strrchr (recipient->mailbox, '@')) == NULL)
+    sio_write (conn, recipient->mailbox, -1);
+  else
+    {
+      sio_write (conn, recipient->mailbox, rat - recipient->mailbox);
+      sio_write (conn, &message->verp_delimiters[1], 1);
+      sio_write (conn, rat + 1, -1);
+    }
+  sio_write (conn, at, -1);
+}
+
 /* MAIL FROM: is the first step in sending a message.  Select the first
    or a subsequent message from the session structure.  The message sender
    is taken from the message structure.
@@ -966,12 +1602,19 @@ cmd_mail (siobuf_t conn, smtp_session_t session)
   char xtext[256];
 
   /* Set a five minute timeout.  This stays in force until the DATA
-     command. */
-  sio_set_timeout (conn, session->envelope_timeout);
+     command.  If MAIL follows the end of the previous message's data,
+     the longer timeout for the data response is needed.  */
+  sio_set_timeout (conn, session->mail_pipelined ? session->data2_timeout
+						 : session->envelope_timeout);
 
   message = session->current_message;
-  mailbox = message->reverse_path_mailbox;
-  sio_printf (conn, "MAIL FROM:<%s>", (mailbox != NULL) ? mailbox : "");
+  PROBE2 (message__start, session, message);
+  sio_write (conn, "MAIL FROM:<", -1);
+  if (message->verp)
+    verp_write_reverse_path (conn, message, session->cmd_recipient);
+  else if ((mailbox = message->reverse_path_mailbox) != NULL)
+    sio_write (conn, mailbox, -1);
+  sio_write (conn, ">", 1);
 
   /* SIZE: SIZE=message-size-estimate */
   if ((session->extensions & EXT_SIZE) && message->size_estimate > 0)
@@ -1034,6 +1677,12 @@ cmd_mail (siobuf_t conn, smtp_session_t session)
       		  mode[message->by_mode], (message->by_trace) ? "T" : "");
     }
 
+  /* MT-PRIORITY: MT-PRIORITY=priority.  Zero is the default so it is
+     not sent.  The priority is sent as set by the application, without
+     the increase used to order deferred messages.  */
+  if ((session->extensions & EXT_MTPRIORITY) && message->priority != 0)
+    sio_printf (conn, " MT-PRIORITY=%d", message->priority);
+
   sio_write (conn, "\r\n", 2);
   /* TODO: until code to prevent issuing of further RCPT commands and to
            discard RCPT responses cascading from an error response to
@@ -1064,9 +1713,12 @@ rsp_mail (siobuf_t conn, smtp_session_t session)
   if (session->event_cb != NULL)
     (*session->event_cb) (session, SMTP_EV_MAILSTATUS, session->event_cb_arg,
   			  message->reverse_path_mailbox, message);
+  session->mail_count += 1;
+  session->xact_first = session->rsp_recipient;
+  session->xact_end = transaction_end (session, session->rsp_recipient);
   if (code != 2)
     {
-      if (next_message (session))
+      if (next_transaction (session))
 	session->rsp_state = initial_transaction_state (session);
       else
 	session->rsp_state = S_quit;
@@ -1138,7 +1790,7 @@ cmd_rcpt (siobuf_t conn, smtp_session_t session)
   sio_write (conn, "\r\n", 2);
 
   session->cmd_recipient = next_recipient (session->cmd_recipient);
-  if (session->cmd_recipient != NULL)
+  if (session->cmd_recipient != session->xact_end)
     session->cmd_state = S_rcpt;
   else if (session->require_all_recipients)
     /* can't pipeline the DATA command when require_all_recpients is set. */
@@ -1168,6 +1820,8 @@ rsp_rcpt (siobuf_t conn, smtp_session_t session)
     session->current_message->valid_recipients += 1;
   else
     session->current_message->failed_recipients += 1;
+  metrics_count (session->metrics, code == 2 ? METRICS_RECIPIENTS_ACCEPTED
+					     : METRICS_RECIPIENTS_FAILED, 1);
 
   /* MTA will never accept this recipient.  Make sure it isn't used
      again. */
@@ -1175,19 +1829,21 @@ rsp_rcpt (siobuf_t conn, smtp_session_t session)
     session->rsp_recipient->complete = 1;
 
   /* Notify the RCPT TO: status */
+  status_batch_add (session, session->current_message,
+		    session->rsp_recipient);
   if (session->event_cb != NULL)
     (*session->event_cb) (session, SMTP_EV_RCPTSTATUS, session->event_cb_arg,
   			  session->rsp_recipient->mailbox,
   			  session->rsp_recipient);
 
   session->rsp_recipient = next_recipient (session->rsp_recipient);
-  if (session->rsp_recipient != NULL)
+  if (session->rsp_recipient != session->xact_end)
     session->rsp_state = S_rcpt;
   else if (session->require_all_recipients
            && session->current_message->failed_recipients > 0)
     {
       reset_status (&session->current_message->message_status);
-      session->rsp_state = next_message (session) ? S_rset : S_quit;
+      session->rsp_state = next_transaction (session) ? S_rset : S_quit;
     }
   else
 #ifdef USE_CHUNKING
@@ -1234,7 +1890,7 @@ rsp_data (siobuf_t conn, smtp_session_t session)
 	 copied to the server.
 
 	 Play safe and issue the RSET command.  */
-      if (next_message (session))
+      if (next_transaction (session))
 	session->rsp_state = S_rset;
       else
 	session->rsp_state = S_quit;
@@ -1248,24 +1904,59 @@ rsp_data (siobuf_t conn, smtp_session_t session)
     session->rsp_state = S_data2;
 
   /* Notify end of message here if not transferring anything */
+  if (code != 3)
+    {
+      PROBE3 (message__done, session, message, message->message_status.code);
+      metrics_count (session->metrics, METRICS_MESSAGES_FAILED, 1);
+      status_batch_add (session, message, NULL);
+    }
   if (code != 3 && session->event_cb != NULL)
     (*session->event_cb) (session, SMTP_EV_MESSAGESENT,
     			  session->event_cb_arg, message);
 }
 
+/* Write a block of text to the server using dot stuffing.  N.B. because
+   of dot stuffing, it is necessary to find the line breaks during the
+   copy.  Returns zero if the text is not terminated by a line break.  */
+static int
+dot_stuff_write (siobuf_t conn, smtp_message_t message,
+		 const char *text, int len)
+{
+  const char *pline, *p;
+
+  digest_update (message, text, len);
+  for (pline = text; pline < text + len; pline = p)
+    {
+      p = memchr (pline, '\n', text + len - pline);
+      if (p == NULL)
+	return 0;
+      if (pline[0] == '.')
+	{
+	  sio_write (conn, ".", 1);
+	  message->wire_octets += 1;
+	}
+      sio_write (conn, pline, ++p - pline);
+      message->wire_octets += p - pline;
+    }
+  return 1;
+}
+
 /* Read the message from the application using the callback.
    Break into lines and copy to the server. */
 void
 cmd_data2 (siobuf_t conn, smtp_session_t session)
 {
-  const char *line, *header, *pline, *p;
-  int c, len;
+  const char *line, *header;
+  int c, len, quit, cache;
+  smtp_message_t message;
+
+  message = session->current_message;
 
   /* RFC 2920 - some servers may return a 354 response to DATA even
      if there are no valid recipients.  If this happens just send a
      line containing .\r\n to terminate the command.  It will then
      fail as expected. */
-  if (session->current_message->valid_recipients == 0)
+  if (message->valid_recipients == 0)
     {
       sio_write (conn, ".\r\n", 3);
       session->cmd_state = -1;
@@ -1275,9 +1966,7 @@ cmd_data2 (siobuf_t conn, smtp_session_t session)
   sio_set_timeout (conn, session->transfer_timeout);
 
   /* Arrange to read the current message from the application. */
-  msg_source_set_cb (session->msg_source,
-		     session->current_message->cb,
-		     session->current_message->cb_arg);
+  msg_source_set_cb (session->msg_source, message->cb, message->cb_arg);
 
   /* Arrange *not* to have the message contents monitored.  This is
      purely to avoid overwhelming the application with data. */
@@ -1286,7 +1975,38 @@ cmd_data2 (siobuf_t conn, smtp_session_t session)
   /* Make sure we read the message from the beginning and get
      the header processing right.  */
   msg_rewind (session->msg_source);
-  reset_header_table (session->current_message);
+  digest_start (message);
+
+  /* In VERP mode, or when the server limits the recipients per
+     transaction, the message is transferred several times.  The headers
+     are processed on the first transfer and saved.  For subsequent
+     transfers the application's headers are skipped and the saved
+     headers are sent instead, so that generated headers such as
+     Message-Id: are the same in each copy.  */
+  cache = message->verp || session->xact_end != NULL;
+  if (message->hdr_cached)
+    {
+      errno = 0;
+      msg_skip_headers (session->msg_source);
+      if (errno != 0)
+	{
+	  set_errno (errno);
+	  session->cmd_state = session->rsp_state = -1;
+	  return;
+	}
+      header = cat_buffer (&message->hdr_cache, &len);
+      if (session->event_cb != NULL)
+	(*session->event_cb) (session, SMTP_EV_MESSAGEDATA,
+			      session->event_cb_arg, message, len);
+      if (session->monitor_cb && session->monitor_cb_headers)
+	(*session->monitor_cb) (header, len, SMTP_CB_HEADERS,
+				session->monitor_cb_arg);
+      dot_stuff_write (conn, message, header, len);
+      goto body;
+    }
+  reset_header_table (message);
+  if (cache)
+    cat_reset (&message->hdr_cache, 0);
 
   /* Read and process header lines from the application.
      This step in processing
@@ -1324,14 +2044,13 @@ cmd_data2 (siobuf_t conn, smtp_session_t session)
          to the remote MTA.   If header is NULL this header has been
          deleted by the library.  If header == line it is passed
          unchanged otherwise, header must be freed after use. */
-      header = process_header (session->current_message, line, &len);
+      header = process_header (message, line, &len);
       if (header != NULL && len > 0)
 	{
 	  /* Notify byte count to the application. */
 	  if (session->event_cb != NULL)
 	    (*session->event_cb) (session, SMTP_EV_MESSAGEDATA,
-				  session->event_cb_arg,
-				  session->current_message, len);
+				  session->event_cb_arg, message, len);
 
 	  /* During data transfer, if we are monitoring the message
 	     headers, call the monitor callback directly, once per header.
@@ -1342,22 +2061,15 @@ cmd_data2 (siobuf_t conn, smtp_session_t session)
 	    (*session->monitor_cb) (header, len, SMTP_CB_HEADERS,
 	    			    session->monitor_cb_arg);
 
-	  /* Write the header using dot stuffing.  N.B. because of
-	     dot stuffing, it is necessary to find the line breaks
-	     during the copy. */
-	  for (pline = header; pline < header + len; pline = p)
+	  /* Write the header using dot stuffing. */
+	  if (!dot_stuff_write (conn, message, header, len))
 	    {
-	      p = memchr (pline, '\n', header + len - pline);
-	      if (p == NULL)
-	        {
-		  set_errno (ERANGE);
-		  session->cmd_state = session->rsp_state = -1;
-		  return;
-	        }
-	      if (pline[0] == '.')
-		sio_write (conn, ".", 1);
-	      sio_write (conn, pline, ++p - pline);
+	      set_errno (ERANGE);
+	      session->cmd_state = session->rsp_state = -1;
+	      return;
 	    }
+	  if (cache)
+	    concatenate (&message->hdr_cache, header, len);
 	}
       errno = 0;
     }
@@ -1379,36 +2091,35 @@ break_2:
      Message-Id: or To:/Cc:/Bcc: headers.  In the most extreme case the
      application might just send a CRLF followed by the message body.
      Libesmtp will then provide all the necessary headers. */
-  while ((header = missing_header (session->current_message, &len)) != NULL)
+  while ((header = missing_header (message, &len)) != NULL)
     if (len > 0)
       {
 	/* Notify byte count to the application. */
 	if (session->event_cb != NULL)
 	  (*session->event_cb) (session, SMTP_EV_MESSAGEDATA,
-				session->event_cb_arg,
-				session->current_message, len);
+				session->event_cb_arg, message, len);
 
 	if (session->monitor_cb && session->monitor_cb_headers)
 	  (*session->monitor_cb) (header, len, SMTP_CB_HEADERS,
 				  session->monitor_cb_arg);
-	for (pline = header; pline < header + len; pline = p)
+	if (!dot_stuff_write (conn, message, header, len))
 	  {
-	    p = memchr (pline, '\n', header + len - pline);
-	    if (p == NULL)
-	      {
-		set_errno (ERANGE);
-		session->cmd_state = session->rsp_state = -1;
-		return;
-	      }
-	    if (pline[0] == '.')
-	      sio_write (conn, ".", 1);
-	    sio_write (conn, pline, ++p - pline);
+	    set_errno (ERANGE);
+	    session->cmd_state = session->rsp_state = -1;
+	    return;
 	  }
+	if (cache)
+	  concatenate (&message->hdr_cache, header, len);
       }
 
   /* ... and finally terminate the message headers */
   sio_write (conn, "\r\n", 2);
+  digest_update (message, "\r\n", 2);
+  message->wire_octets += 2;
+  if (cache)
+    message->hdr_cached = concatenate (&message->hdr_cache, "\r\n", 2) != NULL;
 
+body:
   /* Read message body lines from the application and write them
      to the remote MTA using dot stuffing. */
   errno = 0;
@@ -1417,12 +2128,16 @@ break_2:
       /* Notify byte count to the application. */
       if (session->event_cb != NULL)
 	(*session->event_cb) (session, SMTP_EV_MESSAGEDATA,
-	                      session->event_cb_arg,
-	                      session->current_message, len);
+	                      session->event_cb_arg, message, len);
 
+      digest_update (message, line, len);
       if (line[0] == '.')
-	sio_write (conn, ".", 1);
+	{
+	  sio_write (conn, ".", 1);
+	  message->wire_octets += 1;
+	}
       sio_write (conn, line, len);
+      message->wire_octets += len;
       errno = 0;
     }
   if (errno != 0)
@@ -1432,21 +2147,42 @@ break_2:
       return;
     }
 
-  /* Terminate the DATA command.  Explicitly flush the buffer here.
-     This would have happened in the protocol loop anyway but doing it
-     here makes the output of strace more intuitive. */
+  /* Terminate the DATA command.  Explicitly flush the buffer here unless
+     QUIT is to be sent in the same write.  This would have happened in
+     the protocol loop anyway but doing it here makes the output of strace
+     more intuitive. */
   sio_write (conn, ".\r\n", 3);
-  sio_flush (conn);
+  quit = pipeline_quit (session);
+  if (!quit)
+    sio_flush (conn);
+  message->wire_octets += 3;
+  digest_finish (message);
 
   sio_set_timeout (conn, session->data2_timeout);
-  session->cmd_state = -1;
+
+  /* When a message is split into several transactions and pipelining,
+     the next transaction can start without waiting for the response to
+     the message data since the transaction is complete whatever the
+     outcome.  */
+  if (session->xact_end != NULL && (session->extensions & EXT_PIPELINING)
+      && (session->mail_max <= 0 || session->mail_count < session->mail_max))
+    {
+      if (session->monitor_cb != NULL)
+	sio_set_monitorcb (conn, session->monitor_cb, session->monitor_cb_arg);
+      session->mail_pipelined = 1;
+      session->cmd_recipient = session->xact_end;
+      session->cmd_state = initial_transaction_state (session);
+    }
+  else if (quit)
+    session->cmd_state = S_quit;
+  else
+    session->cmd_state = -1;
 }
 
 void
 rsp_data2 (siobuf_t conn, smtp_session_t session)
 {
   int code;
-  smtp_recipient_t recipient;
 
   /* Reinstate the protocol monitor. */
   if (session->monitor_cb != NULL)
@@ -1461,33 +2197,27 @@ rsp_data2 (siobuf_t conn, smtp_session_t session)
       return;
     }
 
-  if (code == 2)
-    {
-      /* Mark all the recipients complete for which the MTA has accepted
-         responsibility for delivery.  */
-      for (recipient = session->current_message->recipients;
-	   recipient != NULL;
-	   recipient = recipient->next)
-	if (!recipient->complete
-	    && recipient->status.code >= 200 && recipient->status.code <= 299)
-	  recipient->complete = 1;
-    }
-  else if (code == 5)
-    {
-      /* Mark all the recipients complete.  This message cannot be
-         accepted for any recipients.  */
-      for (recipient = session->current_message->recipients;
-	   recipient != NULL;
-	   recipient = recipient->next)
-	recipient->complete = 1;
-    }
-
+  mark_recipients_complete (session, code);
 
+  PROBE3 (message__done, session, session->current_message,
+	  session->current_message->message_status.code);
+  metrics_count (session->metrics, code == 2 ? METRICS_MESSAGES_ACCEPTED
+					     : METRICS_MESSAGES_FAILED, 1);
+  status_batch_add (session, session->current_message, NULL);
   if (session->event_cb != NULL)
     (*session->event_cb) (session, SMTP_EV_MESSAGESENT,
                           session->event_cb_arg, session->current_message);
 
-  if (next_message (session))
+  /* If the next transaction's MAIL command has already been sent, RSET
+     cannot be issued, however RFC 5321 is clear that the transaction is
+     ended by the response to the message data whatever the outcome.  */
+  if (session->mail_pipelined)
+    {
+      session->mail_pipelined = 0;
+      next_transaction (session);
+      session->rsp_state = initial_transaction_state (session);
+    }
+  else if (next_transaction (session))
     session->rsp_state = (code == 2) ? initial_transaction_state (session)
                                      : S_rset;
   else
@@ -39,4 +39,12 @@ int read_smtp_response (siobuf_t conn, smtp_session_t session,
 			struct smtp_status *status,
 			int (*cb) (smtp_session_t, char *));
 
+#ifdef USE_TLS
+int implicit_tls (siobuf_t conn, smtp_session_t session);
+#endif
+
+#ifdef USE_CHUNKING
+int burl_write (siobuf_t conn, smtp_session_t session);
+#endif
+
 #endif
@@ -0,0 +1,438 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+# define _GNU_SOURCE	/* pthread_setaffinity_np() */
+#endif
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef USE_PTHREADS
+# include <pthread.h>
+# ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#  include <sched.h>
+# endif
+#endif
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+
+/**
+ * DOC: Runtime
+ *
+ * Runtime
+ * -------
+ *
+ * Applications which run very large numbers of sessions may hand them to a
+ * runtime rather than managing threads themselves.  The runtime is divided
+ * into shards, by default one for each online CPU.  Each shard owns a few
+ * threads which are bound to its CPU where the platform permits.
+ * smtp_runtime_submit() assigns a session to a shard using a hash of its
+ * server name so that all sessions for a server run on the same CPU.  Per
+ * server state, such as the TLS session cache and metrics, is then touched
+ * from one CPU only.
+ *
+ * Submission is lock free and may be done from any thread.  Each thread of
+ * a shard takes sessions from the shard's queue and runs them to completion
+ * using smtp_start_session().  Since sessions block while waiting for the
+ * server, the number of threads per shard sets the number of sessions the
+ * shard runs concurrently.
+ *
+ * Sessions waiting in a shard's queue are ordered by their most urgent
+ * unsent message, using the priorities and deadlines described under
+ * Message Scheduling, and otherwise run in the order submitted.  The
+ * ordering is decided when the session is submitted.  Each time a waiting
+ * session is overtaken by eight others, its priority is raised by one, so
+ * a steady supply of urgent sessions cannot postpone bulk sessions
+ * indefinitely.  Sessions on different shards are not ordered with respect
+ * to each other.
+ *
+ * Once submitted, the session belongs to the runtime until the completion
+ * callback is called, on the thread that ran the session.  The callback may
+ * call smtp_errno() to find why a session failed and may destroy the
+ * session.  Callbacks set on the session must be thread safe.
+ */
+
+#ifdef USE_PTHREADS
+
+/* A waiting job's priority is raised by one each time this many jobs are
+   queued ahead of it.  */
+#define RUNTIME_AGE_OVERTAKEN	8
+
+struct runtime_job
+  {
+    struct runtime_job *next;
+    smtp_session_t session;
+    smtp_runtime_donecb_t cb;
+    void *arg;
+    int priority;			/* Most urgent message in the session */
+    int overtaken;			/* Jobs queued ahead of this one */
+    time_t deadline;			/* Zero if none */
+  };
+
+struct runtime_shard
+  {
+    /* Jobs are pushed here by any thread, most recent first. */
+    _Atomic (struct runtime_job *) submitted;
+    atomic_int sleeping;		/* Threads waiting for jobs */
+
+    /* The following are used only by the shard's threads. */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct runtime_job *queue;		/* Jobs in the order to be run */
+    struct runtime_job *end_queue;
+    struct smtp_runtime *runtime;
+    int cpu;				/* CPU for the threads, or -1 */
+  };
+
+struct smtp_runtime
+  {
+    atomic_int stopping;
+    int nshards;
+    int nthreads;			/* Threads per shard */
+    int nstarted;			/* Threads created */
+    struct runtime_shard *shards;
+    pthread_t *threads;
+  };
+
+static int
+job_priority (const struct runtime_job *job)
+{
+  int priority;
+
+  priority = job->priority + job->overtaken / RUNTIME_AGE_OVERTAKEN;
+  return priority < PRIORITY_MAX ? priority : PRIORITY_MAX;
+}
+
+/* Non-zero if job a should run before job b, that is if it has a higher
+   priority, or the same priority and an earlier deadline.  */
+static int
+job_before (const struct runtime_job *a, const struct runtime_job *b)
+{
+  int pa, pb;
+
+  pa = job_priority (a);
+  pb = job_priority (b);
+  if (pa != pb)
+    return pa > pb;
+  return a->deadline != 0 && (b->deadline == 0 || a->deadline < b->deadline);
+}
+
+/* Add a job to the queue after the jobs which should run before it or
+   are equally urgent.  Each job it overtakes is aged.  */
+static void
+runtime_enqueue (struct runtime_shard *shard, struct runtime_job *job)
+{
+  struct runtime_job **link, *waiting;
+
+  job->next = NULL;
+  if (shard->queue == NULL)
+    {
+      shard->queue = shard->end_queue = job;
+      return;
+    }
+  if (!job_before (job, shard->end_queue))
+    {
+      shard->end_queue->next = job;
+      shard->end_queue = job;
+      return;
+    }
+  for (link = &shard->queue; !job_before (job, *link); link = &(*link)->next)
+    ;
+  job->next = *link;
+  *link = job;
+  for (waiting = job->next; waiting != NULL; waiting = waiting->next)
+    waiting->overtaken++;
+}
+
+/* Take the submitted jobs and add them to the queue in the order in
+   which they were submitted.  Called with the shard's mutex held.  */
+static void
+runtime_collect (struct runtime_shard *shard)
+{
+  struct runtime_job *job, *next, *jobs = NULL;
+
+  for (job = atomic_exchange (&shard->submitted, NULL); job != NULL; job = next)
+    {
+      next = job->next;
+      job->next = jobs;
+      jobs = job;
+    }
+  for (job = jobs; job != NULL; job = next)
+    {
+      next = job->next;
+      runtime_enqueue (shard, job);
+    }
+}
+
+static void *
+runtime_thread (void *arg)
+{
+  struct runtime_shard *shard = arg;
+  struct runtime_job *job;
+  int ok;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  if (shard->cpu >= 0)
+    {
+      cpu_set_t cpus;
+
+      CPU_ZERO (&cpus);
+      CPU_SET (shard->cpu, &cpus);
+      pthread_setaffinity_np (pthread_self (), sizeof cpus, &cpus);
+    }
+#endif
+
+  pthread_mutex_lock (&shard->mutex);
+  for (;;)
+    {
+      /* Collect newly submitted jobs so that urgent ones may overtake
+	 those already queued.  */
+      runtime_collect (shard);
+      if ((job = shard->queue) != NULL)
+	{
+	  /* Wake another thread if more jobs are waiting. */
+	  if ((shard->queue = job->next) == NULL)
+	    shard->end_queue = NULL;
+	  else if (atomic_load (&shard->sleeping) > 0)
+	    pthread_cond_signal (&shard->cond);
+	  pthread_mutex_unlock (&shard->mutex);
+
+	  ok = smtp_start_session (job->session);
+	  if (job->cb != NULL)
+	    (*job->cb) (job->session, ok, job->arg);
+	  free (job);
+
+	  pthread_mutex_lock (&shard->mutex);
+	  continue;
+	}
+      if (atomic_load (&shard->runtime->stopping))
+	break;
+
+      /* Announce that a thread is about to sleep before checking for jobs
+	 once more.  A submitter that pushes a job after the check sees the
+	 announcement and signals, but cannot do so until the thread is
+	 waiting since it must first acquire the mutex.  */
+      atomic_fetch_add (&shard->sleeping, 1);
+      while (shard->queue == NULL && atomic_load (&shard->submitted) == NULL
+	     && !atomic_load (&shard->runtime->stopping))
+	pthread_cond_wait (&shard->cond, &shard->mutex);
+      atomic_fetch_sub (&shard->sleeping, 1);
+    }
+  pthread_mutex_unlock (&shard->mutex);
+  return NULL;
+}
+
+static void
+runtime_stop (smtp_runtime_t runtime)
+{
+  int i;
+
+  atomic_store (&runtime->stopping, 1);
+  for (i = 0; i < runtime->nshards; i++)
+    {
+      pthread_mutex_lock (&runtime->shards[i].mutex);
+      pthread_cond_broadcast (&runtime->shards[i].cond);
+      pthread_mutex_unlock (&runtime->shards[i].mutex);
+    }
+  for (i = 0; i < runtime->nstarted; i++)
+    pthread_join (runtime->threads[i], NULL);
+  for (i = 0; i < runtime->nshards; i++)
+    {
+      pthread_mutex_destroy (&runtime->shards[i].mutex);
+      pthread_cond_destroy (&runtime->shards[i].cond);
+    }
+  free (runtime->threads);
+  free (runtime->shards);
+  free (runtime);
+}
+
+/**
+ * smtp_runtime_create() - Create a runtime.
+ * @nshards: Number of shards or zero for one per online CPU.
+ * @nthreads: Number of threads in each shard.
+ *
+ * Create a runtime with @nshards shards each running @nthreads threads.
+ * When @nshards is zero, the runtime has a shard for each online CPU and
+ * binds the threads of each shard to its CPU if the platform supports it.
+ *
+ * Return: The runtime or %NULL on failure.
+ */
+smtp_runtime_t
+smtp_runtime_create (int nshards, int nthreads)
+{
+  smtp_runtime_t runtime;
+  struct runtime_shard *shard;
+  long ncpus;
+  int i, err;
+
+  SMTPAPI_CHECK_ARGS (nshards >= 0 && nthreads > 0, NULL);
+
+  ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+  if (nshards == 0)
+    nshards = ncpus > 0 ? ncpus : 1;
+
+  if ((runtime = calloc (1, sizeof (struct smtp_runtime))) == NULL)
+    {
+      set_errno (ENOMEM);
+      return NULL;
+    }
+  runtime->nshards = nshards;
+  runtime->nthreads = nthreads;
+  runtime->shards = calloc (nshards, sizeof (struct runtime_shard));
+  runtime->threads = calloc ((size_t) nshards * nthreads, sizeof (pthread_t));
+  if (runtime->shards == NULL || runtime->threads == NULL)
+    {
+      free (runtime->shards);
+      free (runtime->threads);
+      free (runtime);
+      set_errno (ENOMEM);
+      return NULL;
+    }
+  for (i = 0; i < nshards; i++)
+    {
+      shard = &runtime->shards[i];
+      pthread_mutex_init (&shard->mutex, NULL);
+      pthread_cond_init (&shard->cond, NULL);
+      shard->runtime = runtime;
+      shard->cpu = (ncpus > 0 && nshards <= ncpus) ? i : -1;
+    }
+
+  for (i = 0; i < nshards * nthreads; i++)
+    {
+      shard = &runtime->shards[i / nthreads];
+      err = pthread_create (&runtime->threads[i], NULL, runtime_thread, shard);
+      if (err != 0)
+	{
+	  runtime_stop (runtime);
+	  set_errno (err);
+	  return NULL;
+	}
+      runtime->nstarted++;
+    }
+  return runtime;
+}
+
+/**
+ * smtp_runtime_submit() - Run a session on the runtime.
+ * @runtime: The runtime.
+ * @session: The session.
+ * @cb: Function called when the session is complete, or %NULL.
+ * @arg: User data passed to @cb.
+ *
+ * Queue @session on the shard selected by its server name, ahead of any
+ * waiting sessions whose messages are less urgent.  The session
+ * must be fully configured and must not be used by the application until
+ * @cb is called with the result of smtp_start_session().  This may be called
+ * from any thread, including from a completion callback.
+ *
+ * Return: Non zero on success, zero on failure.
+ */
+int
+smtp_runtime_submit (smtp_runtime_t runtime, smtp_session_t session,
+		     smtp_runtime_donecb_t cb, void *arg)
+{
+  struct runtime_shard *shard;
+  struct runtime_job *job;
+
+  SMTPAPI_CHECK_ARGS (runtime != NULL && session != NULL
+		      && !atomic_load (&runtime->stopping), 0);
+
+  if ((job = malloc (sizeof (struct runtime_job))) == NULL)
+    {
+      set_errno (ENOMEM);
+      return 0;
+    }
+  job->session = session;
+  job->cb = cb;
+  job->arg = arg;
+  job->priority = session_urgency (session, &job->deadline);
+  job->overtaken = 0;
+
+  shard = &runtime->shards[hash_server_name (session->host != NULL
+					     ? session->host : "")
+			   % runtime->nshards];
+  job->next = atomic_load (&shard->submitted);
+  while (!atomic_compare_exchange_weak (&shard->submitted, &job->next, job))
+    ;
+  if (atomic_load (&shard->sleeping) > 0)
+    {
+      pthread_mutex_lock (&shard->mutex);
+      pthread_cond_signal (&shard->cond);
+      pthread_mutex_unlock (&shard->mutex);
+    }
+  return 1;
+}
+
+/**
+ * smtp_runtime_destroy() - Destroy a runtime.
+ * @runtime: The runtime.
+ *
+ * Wait for all the sessions submitted to @runtime to complete, then stop
+ * its threads and release its resources.  No more sessions may be
+ * submitted once this is called.  It must not be called from a completion
+ * callback.
+ *
+ * Return: Non zero on success, zero on failure.
+ */
+int
+smtp_runtime_destroy (smtp_runtime_t runtime)
+{
+  SMTPAPI_CHECK_ARGS (runtime != NULL, 0);
+
+  runtime_stop (runtime);
+  return 1;
+}
+
+#else
+
+smtp_runtime_t
+smtp_runtime_create (int nshards __attribute__ ((unused)),
+		     int nthreads __attribute__ ((unused)))
+{
+  set_errno (ENOSYS);
+  return NULL;
+}
+
+int
+smtp_runtime_submit (smtp_runtime_t runtime __attribute__ ((unused)),
+		     smtp_session_t session __attribute__ ((unused)),
+		     smtp_runtime_donecb_t cb __attribute__ ((unused)),
+		     void *arg __attribute__ ((unused)))
+{
+  set_errno (ENOSYS);
+  return 0;
+}
+
+int
+smtp_runtime_destroy (smtp_runtime_t runtime __attribute__ ((unused)))
+{
+  set_errno (ENOSYS);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,419 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <config.h>
+
+/* SCRAM-SHA-256 (RFC 5802, RFC 7677) without channel binding.
+
+   Deriving the salted password costs one PBKDF2 computation with the
+   iteration count chosen by the server, typically 4096 or more rounds of
+   HMAC-SHA-256.  As suggested in RFC 5802, the derived client and server
+   keys are cached, indexed by a digest of the user name, password, salt
+   and iteration count, so that subsequent connections to the same server
+   only pay for a few HMACs.  The password is not prepared using SASLprep;
+   passwords containing non-ASCII characters may not work with all servers.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "auth-client.h"
+#include "auth-plugin.h"
+
+#define NELT(x)		(sizeof x / sizeof x[0])
+
+#define KEY_LEN		32		/* SHA-256 */
+#define NONCE_LEN	18		/* 24 characters in base 64 */
+#define KEY_CACHE	16
+#define MAX_ITERATIONS	1000000		/* Bounds the work a server can ask for */
+
+static int scram_init (void *pctx);
+static void scram_destroy (void *ctx);
+static const char *scram_response (void *ctx,
+				   const char *challenge, int *len,
+				   auth_interact_t interact, void *arg);
+
+const struct auth_client_plugin sasl_client =
+  {
+  /* Plugin information */
+    "SCRAM-SHA-256",
+    "Salted Challenge Response Authentication Mechanism (RFC 7677)",
+  /* Plugin instance */
+    scram_init,
+    scram_destroy,
+  /* Authentication */
+    scram_response,
+    0,
+  /* Security Layer */
+    0,
+    NULL,
+    NULL,
+  };
+
+static const struct auth_client_request client_request[] =
+  {
+    { "user",		AUTH_CLEARTEXT | AUTH_USER,	"User Name",	0, },
+    { "passphrase",	AUTH_PASS,			"Pass Phrase",	0, },
+  };
+
+struct scram_context
+  {
+    int state;
+    char *first_bare;			/* client-first-message-bare */
+    char *response;
+    int response_len;
+    unsigned char server_key[KEY_LEN];
+    unsigned char server_signature[KEY_LEN];
+  };
+
+/* Client and server keys derived from the salted password.  The cache is
+   direct mapped on the digest identifying the password, salt and
+   iteration count.  */
+struct scram_keys
+  {
+    unsigned char id[KEY_LEN];
+    unsigned char client_key[KEY_LEN];
+    unsigned char server_key[KEY_LEN];
+    int valid;
+  };
+static struct scram_keys key_cache[KEY_CACHE];
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+static pthread_mutex_t key_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int
+scram_init (void *pctx)
+{
+  struct scram_context *context;
+
+  context = malloc (sizeof (struct scram_context));
+  if (context == NULL)
+    return 0;
+  memset (context, 0, sizeof (struct scram_context));
+
+  *(void **) pctx = context;
+  return 1;
+}
+
+static void
+scram_destroy (void *ctx)
+{
+  struct scram_context *context = ctx;
+
+  free (context->first_bare);
+  if (context->response != NULL)
+    {
+      OPENSSL_cleanse (context->response, context->response_len);
+      free (context->response);
+    }
+  OPENSSL_cleanse (context, sizeof (struct scram_context));
+  free (context);
+}
+
+/* Find the value of the attribute in a comma separated list of
+   attribute=value pairs.  Returns the length of the value or -1.  */
+static int
+attribute (const char *msg, int len, char name, const char **value)
+{
+  const char *p, *end = msg + len, *comma;
+
+  for (p = msg; p < end; p = comma + 1)
+    {
+      if ((comma = memchr (p, ',', end - p)) == NULL)
+	comma = end;
+      if (comma - p >= 2 && p[0] == name && p[1] == '=')
+	{
+	  *value = p + 2;
+	  return comma - p - 2;
+	}
+    }
+  return -1;
+}
+
+/* Copy the user name, escaping ',' and '=' as required by RFC 5802.  */
+static char *
+escape_user (const char *user)
+{
+  char *buf, *p;
+
+  if ((buf = malloc (3 * strlen (user) + 1)) == NULL)
+    return NULL;
+  for (p = buf; *user != '\0'; user++)
+    if (*user == ',')
+      p += sprintf (p, "=2C");
+    else if (*user == '=')
+      p += sprintf (p, "=3D");
+    else
+      *p++ = *user;
+  *p = '\0';
+  return buf;
+}
+
+/* Derive the client and server keys, using the cache if possible.  */
+static int
+derive_keys (const char *user, const char *pass,
+	     const unsigned char *salt, int salt_len, int iterations,
+	     unsigned char client_key[KEY_LEN],
+	     unsigned char server_key[KEY_LEN])
+{
+  unsigned char id[KEY_LEN], salted[KEY_LEN];
+  struct scram_keys *keys;
+  EVP_MD_CTX *md;
+  int hit;
+
+  /* Identify the derivation without keeping the password.  */
+  if ((md = EVP_MD_CTX_new ()) == NULL)
+    return 0;
+  if (!EVP_DigestInit_ex (md, EVP_sha256 (), NULL)
+      || !EVP_DigestUpdate (md, user, strlen (user) + 1)
+      || !EVP_DigestUpdate (md, pass, strlen (pass) + 1)
+      || !EVP_DigestUpdate (md, salt, salt_len)
+      || !EVP_DigestUpdate (md, &iterations, sizeof iterations)
+      || !EVP_DigestFinal_ex (md, id, NULL))
+    {
+      EVP_MD_CTX_free (md);
+      return 0;
+    }
+  EVP_MD_CTX_free (md);
+
+  keys = &key_cache[id[0] % KEY_CACHE];
+#ifdef USE_PTHREADS
+  pthread_mutex_lock (&key_cache_mutex);
+#endif
+  hit = keys->valid && CRYPTO_memcmp (keys->id, id, sizeof id) == 0;
+  if (hit)
+    {
+      memcpy (client_key, keys->client_key, KEY_LEN);
+      memcpy (server_key, keys->server_key, KEY_LEN);
+    }
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock (&key_cache_mutex);
+#endif
+  if (hit)
+    return 1;
+
+  if (!PKCS5_PBKDF2_HMAC (pass, strlen (pass), salt, salt_len, iterations,
+			  EVP_sha256 (), sizeof salted, salted)
+      || HMAC (EVP_sha256 (), salted, sizeof salted,
+	       (const unsigned char *) "Client Key", 10,
+	       client_key, NULL) == NULL
+      || HMAC (EVP_sha256 (), salted, sizeof salted,
+	       (const unsigned char *) "Server Key", 10,
+	       server_key, NULL) == NULL)
+    {
+      OPENSSL_cleanse (salted, sizeof salted);
+      return 0;
+    }
+  OPENSSL_cleanse (salted, sizeof salted);
+
+#ifdef USE_PTHREADS
+  pthread_mutex_lock (&key_cache_mutex);
+#endif
+  memcpy (keys->id, id, sizeof id);
+  memcpy (keys->client_key, client_key, KEY_LEN);
+  memcpy (keys->server_key, server_key, KEY_LEN);
+  keys->valid = 1;
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock (&key_cache_mutex);
+#endif
+  return 1;
+}
+
+/* Send the client-first-message.  */
+static const char *
+client_first (struct scram_context *context, const char *user)
+{
+  unsigned char nonce[NONCE_LEN];
+  char cnonce[4 * NONCE_LEN / 3 + 1], *name;
+  size_t len;
+
+  if (RAND_bytes (nonce, sizeof nonce) != 1)
+    return NULL;
+  EVP_EncodeBlock ((unsigned char *) cnonce, nonce, sizeof nonce);
+  if ((name = escape_user (user)) == NULL)
+    return NULL;
+  len = strlen (name) + strlen (cnonce) + 6;
+  context->first_bare = malloc (len + 1);
+  context->response = malloc (len + 4);
+  if (context->first_bare == NULL || context->response == NULL)
+    {
+      free (name);
+      return NULL;
+    }
+  snprintf (context->first_bare, len + 1, "n=%s,r=%s", name, cnonce);
+  free (name);
+  context->response_len = snprintf (context->response, len + 4,
+				    "n,,%s", context->first_bare);
+  return context->response;
+}
+
+/* Compute the client-final-message from the server-first-message.  */
+static const char *
+client_final (struct scram_context *context,
+	      const char *challenge, int len, const char *user,
+	      const char *pass)
+{
+  unsigned char salt[256], client_key[KEY_LEN], stored_key[KEY_LEN];
+  unsigned char signature[KEY_LEN], proof[KEY_LEN];
+  char proof64[4 * KEY_LEN / 3 + 4], *auth_message, *response, *num;
+  const char *nonce, *salt64, *iter, *cnonce;
+  int nonce_len, salt64_len, iter_len, cnonce_len, salt_len, iterations;
+  int auth_len, response_len, i;
+
+  /* The server's nonce must extend the client's nonce.  */
+  nonce_len = attribute (challenge, len, 'r', &nonce);
+  salt64_len = attribute (challenge, len, 's', &salt64);
+  iter_len = attribute (challenge, len, 'i', &iter);
+  cnonce_len = attribute (context->first_bare, strlen (context->first_bare),
+			  'r', &cnonce);
+  if (len < 2 || challenge[0] != 'r' || nonce_len <= cnonce_len
+      || memcmp (nonce, cnonce, cnonce_len) != 0
+      || salt64_len <= 0 || salt64_len % 4 != 0
+      || (size_t) salt64_len / 4 * 3 > sizeof salt
+      || iter_len <= 0 || iter_len > 9)
+    return NULL;
+
+  if ((num = malloc (iter_len + 1)) == NULL)
+    return NULL;
+  memcpy (num, iter, iter_len);
+  num[iter_len] = '\0';
+  iterations = atoi (num);
+  free (num);
+  if (iterations <= 0 || iterations > MAX_ITERATIONS)
+    return NULL;
+
+  /* EVP_DecodeBlock() counts padding as data.  */
+  if ((salt_len = EVP_DecodeBlock (salt, (const unsigned char *) salt64,
+				   salt64_len)) < 0)
+    return NULL;
+  if (salt64[salt64_len - 1] == '=')
+    salt_len -= salt64[salt64_len - 2] == '=' ? 2 : 1;
+
+  if (!derive_keys (user, pass, salt, salt_len, iterations,
+		    client_key, context->server_key))
+    return NULL;
+
+  /* AuthMessage := client-first-message-bare + "," +
+		     server-first-message + "," +
+		     client-final-message-without-proof */
+  auth_len = strlen (context->first_bare) + len + nonce_len + 12;
+  response_len = nonce_len + sizeof proof64 + 16;
+  auth_message = malloc (auth_len);
+  response = malloc (response_len);
+  if (auth_message == NULL || response == NULL)
+    {
+      free (auth_message);
+      free (response);
+      return NULL;
+    }
+  response_len = snprintf (response, response_len, "c=biws,r=%.*s",
+			   nonce_len, nonce);
+  auth_len = snprintf (auth_message, auth_len, "%s,%.*s,%s",
+		       context->first_bare, len, challenge, response);
+
+  /* ClientProof := ClientKey XOR HMAC(H(ClientKey), AuthMessage) */
+  EVP_Digest (client_key, sizeof client_key, stored_key, NULL,
+	      EVP_sha256 (), NULL);
+  HMAC (EVP_sha256 (), stored_key, sizeof stored_key,
+	(unsigned char *) auth_message, auth_len, signature, NULL);
+  for (i = 0; i < KEY_LEN; i++)
+    proof[i] = client_key[i] ^ signature[i];
+  EVP_EncodeBlock ((unsigned char *) proof64, proof, sizeof proof);
+  response_len += sprintf (response + response_len, ",p=%s", proof64);
+
+  /* Expected ServerSignature := HMAC(ServerKey, AuthMessage) */
+  HMAC (EVP_sha256 (), context->server_key, sizeof context->server_key,
+	(unsigned char *) auth_message, auth_len,
+	context->server_signature, NULL);
+
+  OPENSSL_cleanse (client_key, sizeof client_key);
+  OPENSSL_cleanse (proof, sizeof proof);
+  free (auth_message);
+
+  OPENSSL_cleanse (context->response, context->response_len);
+  free (context->response);
+  context->response = response;
+  context->response_len = response_len;
+  return response;
+}
+
+/* Check the server-final-message proves the server knows the password.  */
+static int
+server_final (struct scram_context *context, const char *challenge, int len)
+{
+  unsigned char signature[(KEY_LEN + 2) / 3 * 3];
+  const char *v;
+  int v_len;
+
+  v_len = attribute (challenge, len, 'v', &v);
+  if (challenge[0] != 'v' || v_len != 4 * ((KEY_LEN + 2) / 3))
+    return 0;
+  if (EVP_DecodeBlock (signature, (const unsigned char *) v, v_len)
+      != (int) sizeof signature)
+    return 0;
+  return CRYPTO_memcmp (signature, context->server_signature, KEY_LEN) == 0;
+}
+
+static const char *
+scram_response (void *ctx, const char *challenge, int *len,
+		auth_interact_t interact, void *arg)
+{
+  struct scram_context *context = ctx;
+  char *result[NELT (client_request)];
+  const char *response = NULL;
+
+  switch (context->state)
+    {
+    case 0:	/* client-first-message */
+      if (!(*interact) (client_request, result, NELT (client_request), arg))
+        break;
+      response = client_first (context, result[0]);
+      context->state = 1;
+      break;
+
+    case 1:	/* server-first-message */
+      if (!(*interact) (client_request, result, NELT (client_request), arg))
+        break;
+      response = client_final (context, challenge, *len, result[0], result[1]);
+      context->state = 2;
+      break;
+
+    case 2:	/* server-final-message */
+      if (*len > 0 && server_final (context, challenge, *len))
+	{
+	  context->response_len = 0;
+	  response = "";
+	}
+      context->state = -1;
+      break;
+    }
+  *len = response != NULL ? context->response_len : 0;
+  return response;
+}
@@ -0,0 +1,487 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#if HAVE_LWRES_NETDB_H
+# include <lwres/netdb.h>
+#else
+# include <netdb.h>
+#endif
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+#include "shmcache.h"
+
+/**
+ * DOC: Shared Cache
+ *
+ * Shared Cache
+ * ------------
+ *
+ * Servers which fork a pool of worker processes would otherwise have each
+ * worker learn the same facts about the MTA independently.  A shared cache
+ * is a region of shared memory, attached using smtp_shared_cache_attach(),
+ * which holds:
+ *
+ * * TLS sessions for resumption, when enabled using
+ *   smtp_starttls_set_resumption(), so that the whole pool resumes the
+ *   sessions negotiated by any worker.
+ * * Whether each server offered STARTTLS.  If a server which previously
+ *   offered STARTTLS stops doing so, %Starttls_ENABLED is treated as
+ *   %Starttls_REQUIRED, as recommended by RFC 3207, so that an attacker
+ *   cannot silently downgrade the connection by removing the extension.
+ *   This is the only use made of the server's EHLO response.  The rest of
+ *   it is not reused because EHLO must still be sent and answered before
+ *   any other command in every session, so knowing the extensions in
+ *   advance saves no round trip.
+ * * The server addresses returned by the resolver, for one minute.
+ *
+ * If no name is given, an anonymous region is created which is inherited
+ * by processes forked after the call.  A named region is created in the
+ * POSIX shared memory namespace if it does not already exist and persists
+ * until removed using shm_unlink(), so that a freshly started process
+ * begins with a warm cache.  All processes sharing a cache should use the
+ * same TLS configuration.
+ *
+ * The cache is a fixed size hash table.  Each entry is protected by a
+ * sequence lock so that readers never block writers and never wait for
+ * each other; a reader which races with a writer retries a few times and
+ * then sees a miss.  A writer which dies part way through an update leaves
+ * its entry locked; after ten seconds the entry is reclaimed by the next
+ * process to write to it.  When the table is full the entries closest to
+ * expiry are replaced.
+ */
+
+#define SHMCACHE_MAGIC		"libesmtp-cache2"
+#define SHMCACHE_WAYS		4	/* Slots searched for each key */
+#define SHMCACHE_READ_TRIES	4	/* Attempts to read a busy slot */
+#define SHMCACHE_STALE		10	/* Seconds before a lock is reclaimed */
+#define SHMCACHE_DEFAULT_SIZE	(16L * 1024L * 1024L)
+#define RESOLVER_TTL		60	/* Seconds */
+
+struct shmcache_slot
+  {
+    atomic_ullong lock;			/* Sequence and time of claim */
+    unsigned int kind;
+    unsigned int hash;
+    unsigned int keylen;
+    unsigned int datalen;
+    long long expires;
+    char key[SHMCACHE_KEY_MAX];
+    unsigned char data[SHMCACHE_DATA_MAX];
+  };
+
+struct shmcache
+  {
+    char magic[sizeof SHMCACHE_MAGIC];
+    atomic_uint ready;
+    unsigned int slot_size;
+    unsigned int nslots;
+    struct shmcache_slot slot[];
+  };
+
+/* The low half of a slot's lock word is a sequence number, which is odd
+   while the slot is written, and the high half is the time at which the
+   writer claimed the slot.  Both change in a single compare and exchange,
+   so only one writer can reclaim a slot abandoned by a process which
+   died while holding it.  */
+#define LOCK_SEQUENCE(lock)	((unsigned int) (lock))
+#define LOCK_CLAIMED(lock)	((unsigned int) ((lock) >> 32))
+#define LOCK_WORD(seq, claimed)	(((unsigned long long) (claimed) << 32) \
+				 | (unsigned int) (seq))
+
+static struct shmcache *shared_cache;
+static size_t shared_cache_size;
+
+/* Wait for another process to finish creating the region.  */
+static int
+wait_for_creator (int fd, struct shmcache **cache, size_t *size)
+{
+  struct timespec ts = { 0, 10000000L };
+  struct stat st;
+  int i;
+
+  for (i = 0; i < 100; i++, nanosleep (&ts, NULL))
+    {
+      if (*cache == NULL)
+	{
+	  if (fstat (fd, &st) < 0)
+	    return 0;
+	  if (st.st_size == 0)
+	    continue;
+	  *size = st.st_size;
+	  *cache = mmap (NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	  if (*cache == MAP_FAILED)
+	    {
+	      *cache = NULL;
+	      return 0;
+	    }
+	}
+      if (*size >= sizeof (struct shmcache)
+	  && atomic_load_explicit (&(*cache)->ready, memory_order_acquire))
+	return 1;
+    }
+  return 0;
+}
+
+/**
+ * smtp_shared_cache_attach() - Attach a cache shared between processes.
+ * @name: Name of the shared memory region or %NULL.
+ * @size: Size of the region in bytes or zero for the default of 16MiB.
+ *
+ * Attach the process to a shared cache.  If @name is %NULL an anonymous
+ * region is created, which processes forked afterwards share.  Otherwise
+ * @name is a POSIX shared memory object name such as
+ * ``/myapp-smtp-cache``.  The object is created with @size bytes if it
+ * does not exist; if it does, its existing size is used.
+ *
+ * This must be called before any sessions are started.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_shared_cache_attach (const char *name, size_t size)
+{
+  static atomic_uint counter;
+  struct shmcache *cache = NULL;
+  char tmpname[64];
+  int fd, created = 0;
+
+  SMTPAPI_CHECK_ARGS (shared_cache == NULL, 0);
+  if (size == 0)
+    size = SHMCACHE_DEFAULT_SIZE;
+  SMTPAPI_CHECK_ARGS (size >= sizeof (struct shmcache)
+		      + SHMCACHE_WAYS * sizeof (struct shmcache_slot), 0);
+
+  if (name == NULL)
+    {
+      /* An unlinked object is just shared memory with a descriptor. */
+      snprintf (tmpname, sizeof tmpname, "/libesmtp-%ld-%u", (long) getpid (),
+		atomic_fetch_add (&counter, 1));
+      if ((fd = shm_open (tmpname, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0)
+	shm_unlink (tmpname);
+      created = 1;
+    }
+  else if ((fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0)
+    created = 1;
+  else if (errno == EEXIST)
+    fd = shm_open (name, O_RDWR, 0);
+  if (fd < 0)
+    {
+      set_errno (errno);
+      return 0;
+    }
+
+  if (created)
+    {
+      if (ftruncate (fd, size) < 0
+	  || (cache = mmap (NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+	  set_errno (errno);
+	  if (name != NULL)
+	    shm_unlink (name);
+	  close (fd);
+	  return 0;
+	}
+      /* ftruncate() zero fills, so the slots are empty. */
+      memcpy (cache->magic, SHMCACHE_MAGIC, sizeof SHMCACHE_MAGIC);
+      cache->slot_size = sizeof (struct shmcache_slot);
+      cache->nslots = (size - sizeof (struct shmcache))
+		      / sizeof (struct shmcache_slot);
+      atomic_store_explicit (&cache->ready, 1, memory_order_release);
+    }
+  else if (!wait_for_creator (fd, &cache, &size)
+	   || memcmp (cache->magic, SHMCACHE_MAGIC, sizeof SHMCACHE_MAGIC) != 0
+	   || cache->slot_size != sizeof (struct shmcache_slot)
+	   || cache->nslots < SHMCACHE_WAYS
+	   || size < sizeof (struct shmcache)
+		     + cache->nslots * sizeof (struct shmcache_slot))
+    {
+      if (cache != NULL)
+	munmap (cache, size);
+      close (fd);
+      set_error (SMTP_ERR_INVAL);
+      return 0;
+    }
+  close (fd);
+
+  shared_cache = cache;
+  shared_cache_size = size;
+  return 1;
+}
+
+/**
+ * smtp_shared_cache_detach() - Detach the shared cache.
+ *
+ * Detach the process from the shared cache.  This must not be called while
+ * any sessions are in progress.  A named region is not removed.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_shared_cache_detach (void)
+{
+  SMTPAPI_CHECK_ARGS (shared_cache != NULL, 0);
+
+  munmap (shared_cache, shared_cache_size);
+  shared_cache = NULL;
+  shared_cache_size = 0;
+  return 1;
+}
+
+int
+shmcache_enabled (void)
+{
+  return shared_cache != NULL;
+}
+
+static unsigned int
+shmcache_hash (enum shmcache_kind kind, const char *key)
+{
+  return hash_server_name (key) * 31u + kind;
+}
+
+/* Copy the entry in the slot if it is for the key.  Returns the length of
+   the data, -1 if the slot holds another or an expired entry or -2 if the
+   slot is being written.  */
+static int
+shmcache_read_slot (struct shmcache_slot *slot, enum shmcache_kind kind,
+		    unsigned int hash, const char *key, size_t keylen,
+		    void *data, size_t size)
+{
+  unsigned long long lock;
+  int len;
+
+  lock = atomic_load_explicit (&slot->lock, memory_order_acquire);
+  if (LOCK_SEQUENCE (lock) & 1)
+    return -2;
+  if (slot->kind != kind || slot->hash != hash || slot->keylen != keylen
+      || memcmp (slot->key, key, keylen) != 0
+      || slot->datalen > size || slot->datalen > SHMCACHE_DATA_MAX
+      || slot->expires <= (long long) time (NULL))
+    return -1;
+  len = slot->datalen;
+  memcpy (data, slot->data, len);
+
+  /* The copy is only good if no writer got in first. */
+  atomic_thread_fence (memory_order_acquire);
+  if (atomic_load_explicit (&slot->lock, memory_order_relaxed) != lock)
+    return -2;
+  return len;
+}
+
+/* Look up the key.  Returns the length of the data copied to the buffer
+   or -1 if not found.  A slot which stays busy is treated as a miss.  */
+int
+shmcache_get (enum shmcache_kind kind, const char *key, void *data, size_t size)
+{
+  struct shmcache_slot *slot;
+  unsigned int hash, i;
+  size_t keylen;
+  int len, try;
+
+  if (shared_cache == NULL || (keylen = strlen (key)) > SHMCACHE_KEY_MAX)
+    return -1;
+  hash = shmcache_hash (kind, key);
+  for (i = 0; i < SHMCACHE_WAYS; i++)
+    {
+      slot = &shared_cache->slot[(hash + i) % shared_cache->nslots];
+      for (try = 1;
+	   (len = shmcache_read_slot (slot, kind, hash, key, keylen,
+				      data, size)) == -2
+	   && try < SHMCACHE_READ_TRIES;
+	   try++)
+	sched_yield ();
+      if (len >= 0)
+	return len;
+    }
+  return -1;
+}
+
+/* Store the data under the key for ttl seconds.  The entry is silently
+   dropped if it is too big or its slot is being written.  A slot left
+   locked for longer than SHMCACHE_STALE seconds is reclaimed.  */
+void
+shmcache_put (enum shmcache_kind kind, const char *key,
+	      const void *data, size_t len, long ttl)
+{
+  struct shmcache_slot *slot, *victim = NULL;
+  unsigned long long lock, claim;
+  unsigned int hash, i;
+  size_t keylen;
+  long long now;
+
+  if (shared_cache == NULL || (keylen = strlen (key)) > SHMCACHE_KEY_MAX
+      || len > SHMCACHE_DATA_MAX)
+    return;
+  hash = shmcache_hash (kind, key);
+  now = time (NULL);
+
+  /* Replace the existing entry for the key, otherwise an empty or
+     expired slot, otherwise the slot closest to expiry.  */
+  for (i = 0; i < SHMCACHE_WAYS; i++)
+    {
+      slot = &shared_cache->slot[(hash + i) % shared_cache->nslots];
+      if (slot->kind == kind && slot->hash == hash && slot->keylen == keylen
+	  && memcmp (slot->key, key, keylen) == 0)
+	{
+	  victim = slot;
+	  break;
+	}
+      if (victim == NULL || slot->expires < victim->expires)
+	victim = slot;
+    }
+  slot = victim;
+
+  /* Claiming a slot makes the sequence odd; reclaiming a stale slot
+     advances it by two so that it stays odd.  */
+  lock = atomic_load_explicit (&slot->lock, memory_order_relaxed);
+  if (!(LOCK_SEQUENCE (lock) & 1))
+    claim = LOCK_WORD (LOCK_SEQUENCE (lock) + 1, now);
+  else if ((unsigned int) now - LOCK_CLAIMED (lock) > SHMCACHE_STALE)
+    claim = LOCK_WORD (LOCK_SEQUENCE (lock) + 2, now);
+  else
+    return;
+  if (!atomic_compare_exchange_strong_explicit (&slot->lock, &lock, claim,
+						memory_order_acquire,
+						memory_order_relaxed))
+    return;
+  slot->kind = kind;
+  slot->hash = hash;
+  slot->keylen = keylen;
+  memcpy (slot->key, key, keylen);
+  slot->datalen = len;
+  memcpy (slot->data, data, len);
+  slot->expires = now + ttl;
+
+  /* This fails only if the slot was reclaimed while this process was
+     stopped, in which case the new owner's lock must be left alone.  */
+  atomic_compare_exchange_strong_explicit (&slot->lock, &claim,
+					   LOCK_WORD (LOCK_SEQUENCE (claim) + 1,
+						      0),
+					   memory_order_release,
+					   memory_order_relaxed);
+}
+
+/* Resolver results are stored as a fixed size array of addresses.  */
+#define CACHED_ADDRESSES	8
+
+struct cached_address
+  {
+    int family;
+    int socktype;
+    int protocol;
+    unsigned int addrlen;
+    struct sockaddr_storage addr;
+  };
+
+struct cached_addresses
+  {
+    unsigned int naddrs;
+    char canon[256];
+    struct cached_address addr[CACHED_ADDRESSES];
+  };
+
+/* Return a copy of the cached resolver results for the key.  The list is
+   a single allocation which the caller releases using free().  */
+struct addrinfo *
+shmcache_getaddrinfo (const char *key)
+{
+  struct cached_addresses cached;
+  struct addrinfo *res;
+  struct sockaddr_storage *addr;
+  char *canon;
+  unsigned int i, n;
+
+  if (shmcache_get (SHMCACHE_ADDRESSES, key, &cached, sizeof cached)
+      != (int) sizeof cached)
+    return NULL;
+  if ((n = cached.naddrs) == 0 || n > CACHED_ADDRESSES)
+    return NULL;
+  cached.canon[sizeof cached.canon - 1] = '\0';
+
+  res = malloc (n * (sizeof (struct addrinfo) + sizeof (struct sockaddr_storage))
+		+ strlen (cached.canon) + 1);
+  if (res == NULL)
+    return NULL;
+  addr = (struct sockaddr_storage *) &res[n];
+  canon = (char *) &addr[n];
+  strcpy (canon, cached.canon);
+  memset (res, 0, n * sizeof (struct addrinfo));
+  for (i = 0; i < n; i++)
+    {
+      res[i].ai_family = cached.addr[i].family;
+      res[i].ai_socktype = cached.addr[i].socktype;
+      res[i].ai_protocol = cached.addr[i].protocol;
+      res[i].ai_addrlen = cached.addr[i].addrlen;
+      memcpy (&addr[i], &cached.addr[i].addr, sizeof addr[i]);
+      res[i].ai_addr = (struct sockaddr *) &addr[i];
+      res[i].ai_next = i + 1 < n ? &res[i + 1] : NULL;
+    }
+  if (*canon != '\0')
+    res[0].ai_canonname = canon;
+  return res;
+}
+
+/* Save the resolver results for the key.  */
+void
+shmcache_putaddrinfo (const char *key, const struct addrinfo *res)
+{
+  struct cached_addresses cached;
+  unsigned int n;
+
+  if (shared_cache == NULL)
+    return;
+  memset (&cached, 0, sizeof cached);
+  if (res->ai_canonname != NULL)
+    strlcpy (cached.canon, res->ai_canonname, sizeof cached.canon);
+  for (n = 0; res != NULL && n < CACHED_ADDRESSES; res = res->ai_next)
+    if (res->ai_addrlen <= sizeof (struct sockaddr_storage))
+      {
+	cached.addr[n].family = res->ai_family;
+	cached.addr[n].socktype = res->ai_socktype;
+	cached.addr[n].protocol = res->ai_protocol;
+	cached.addr[n].addrlen = res->ai_addrlen;
+	memcpy (&cached.addr[n].addr, res->ai_addr, res->ai_addrlen);
+	n++;
+      }
+  cached.naddrs = n;
+  if (n > 0)
+    shmcache_put (SHMCACHE_ADDRESSES, key, &cached, sizeof cached,
+		  RESOLVER_TTL);
+}
@@ -0,0 +1,52 @@
+#ifndef _shmcache_h
+#define _shmcache_h
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stddef.h>
+
+/* Entries in the cache shared between processes.  The get and put
+   functions do nothing unless the application has attached a shared
+   cache, so call sites need not check.  */
+
+enum shmcache_kind
+  {
+    SHMCACHE_TLS_SESSION = 1,		/* DER encoded SSL_SESSION */
+    SHMCACHE_CAPABILITIES,		/* Extensions offered before TLS */
+    SHMCACHE_ADDRESSES			/* Resolver results */
+  };
+
+#define SHMCACHE_KEY_MAX	128
+#define SHMCACHE_DATA_MAX	8192	/* Sessions include the peer certificate */
+
+int shmcache_enabled (void);
+int shmcache_get (enum shmcache_kind kind, const char *key,
+		  void *data, size_t size);
+void shmcache_put (enum shmcache_kind kind, const char *key,
+		   const void *data, size_t len, long ttl);
+
+struct addrinfo;
+
+struct addrinfo *shmcache_getaddrinfo (const char *key);
+void shmcache_putaddrinfo (const char *key, const struct addrinfo *res);
+
+#endif
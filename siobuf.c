@@ -44,6 +44,7 @@
 #endif
 
 #include "siobuf.h"
+#include "probes.h"
 
 #ifdef USE_TLS
 static int sio_sslpoll (struct siobuf *sio, int ret);
@@ -67,15 +68,22 @@ struct siobuf
     char *flush_mark;		/* don't flush beyond this point */
     int write_available;	/* number of bytes available in buffer */
 
+    unsigned long octets_written; /* total bytes flushed */
+    unsigned long octets_read;	/* total bytes read */
+
     monitorcb_t monitor_cb;
     void *cbarg;
 
+    monitorcb_t record_cb;	/* unlike monitor_cb, never disabled */
+    void *record_arg;
+
     recodecb_t encode_cb;	/* encoder for outbound data */
     recodecb_t decode_cb;	/* decoder for inbound data */
     void *secarg;
 
 #ifdef USE_TLS
     SSL *ssl;			/* The SSL connection */
+    int async_waited;		/* ms backed off for the async engine */
 #endif
 
     void *user_data;
@@ -139,6 +147,7 @@ sio_detach (struct siobuf *sio)
 
       /* Send a close notify to the peer for a graceful shutdown.
        */
+      sio->async_waited = 0;
       while ((ret = SSL_shutdown (sio->ssl)) == 0)
         if (sio_sslpoll (sio, ret) <= 0)
 	  break;
@@ -159,24 +168,26 @@ sio_set_monitorcb (struct siobuf *sio, monitorcb_t cb, void *arg)
   sio->cbarg = arg;
 }
 
+/* Set a callback which sees all data written and read, like the monitor
+   callback.  This is kept separate since the protocol engine disables
+   the monitor while sending message content.  */
+void
+sio_set_recordcb (struct siobuf *sio, monitorcb_t cb, void *arg)
+{
+  assert (sio != NULL);
+
+  sio->record_cb = cb;
+  sio->record_arg = arg;
+}
+
 void
 sio_set_timeout (struct siobuf *sio, int milliseconds)
 {
   assert (sio != NULL);
 
+  /* This is the socket I/O timeout only.  The SSL_SESSION timeout is
+     left alone since it governs how long the session may be resumed.  */
   sio->milliseconds = milliseconds;
-#ifdef USE_TLS
-  if (sio->ssl != NULL)
-    {
-      long ssl_timeout;
-
-      if (milliseconds < 0)
-        ssl_timeout = 86400L;
-      else
-        ssl_timeout = ((long) milliseconds + 999L) / 1000L;
-      SSL_SESSION_set_timeout (SSL_get_session (sio->ssl), ssl_timeout);
-    }
-#endif
 }
 
 #ifdef USE_TLS
@@ -192,6 +203,7 @@ sio_set_tlsclient_ssl (struct siobuf *sio, SSL *ssl)
       sio->ssl = ssl;
       SSL_set_rfd (sio->ssl, sio->sdr);
       SSL_set_wfd (sio->ssl, sio->sdw);
+      sio->async_waited = 0;
       while ((ret = SSL_connect (sio->ssl)) <= 0)
         if (sio_sslpoll (sio, ret) <= 0)
 	  {
@@ -199,11 +211,58 @@ sio_set_tlsclient_ssl (struct siobuf *sio, SSL *ssl)
 	    sio->ssl = NULL;
 	    break;
 	  }
-      sio_set_timeout (sio, sio->milliseconds);
     }
   return sio->ssl != NULL;
 }
 
+/* Perform the TLS handshake, sending the data as TLS 1.3 early data.  The
+   SSL's session must permit at least len octets of early data.  Returns
+   the number of octets the server accepted as early data, which is zero
+   if it rejected them, or -1 if the handshake fails.  Rejected data is
+   not resent.  */
+int
+sio_set_tlsclient_early (struct siobuf *sio, SSL *ssl,
+			 const void *bufp, int buflen)
+{
+  size_t written = 0;
+  int ret;
+
+  assert (sio != NULL && ssl != NULL && bufp != NULL && buflen > 0);
+
+  sio->ssl = ssl;
+  SSL_set_rfd (sio->ssl, sio->sdr);
+  SSL_set_wfd (sio->ssl, sio->sdw);
+  sio->async_waited = 0;
+  while ((ret = SSL_write_early_data (sio->ssl, bufp, buflen, &written)) <= 0)
+    if (sio_sslpoll (sio, ret) <= 0)
+      {
+	SSL_free (sio->ssl);
+	sio->ssl = NULL;
+	return -1;
+      }
+  if (!sio_set_tlsclient_ssl (sio, ssl))
+    return -1;
+  if (SSL_get_early_data_status (sio->ssl) != SSL_EARLY_DATA_ACCEPTED)
+    return 0;
+
+  PROBE2 (sio__flush, sio, (int) written);
+  sio->octets_written += written;
+  if (sio->monitor_cb != NULL)
+    (*sio->monitor_cb) (bufp, written, 1, sio->cbarg);
+  if (sio->record_cb != NULL)
+    (*sio->record_cb) (bufp, written, 1, sio->record_arg);
+  return written;
+}
+
+/* Return the SSL object for the connection or NULL if not using TLS.  */
+SSL *
+sio_get_ssl (struct siobuf *sio)
+{
+  assert (sio != NULL);
+
+  return sio->ssl;
+}
+
 int
 sio_set_tlsserver_ssl (struct siobuf *sio, SSL *ssl)
 {
@@ -216,6 +275,7 @@ sio_set_tlsserver_ssl (struct siobuf *sio, SSL *ssl)
       sio->ssl = ssl;
       SSL_set_rfd (sio->ssl, sio->sdr);
       SSL_set_wfd (sio->ssl, sio->sdw);
+      sio->async_waited = 0;
       while ((ret = SSL_accept (sio->ssl)) <= 0)
         if (sio_sslpoll (sio, ret) <= 0)
 	  {
@@ -223,7 +283,6 @@ sio_set_tlsserver_ssl (struct siobuf *sio, SSL *ssl)
 	    sio->ssl = NULL;
 	    break;
 	  }
-      sio_set_timeout (sio, sio->milliseconds);
     }
   return sio->ssl != NULL;
 }
@@ -302,6 +361,59 @@ sio_poll (struct siobuf *sio, int want_read, int want_write, int fast)
 }
 
 #ifdef USE_TLS
+#define SIO_ASYNC_FDS		8
+#define SIO_ASYNC_BACKOFF_MAX	32	/* ms */
+
+/* Wait a little before an operation is retried when there is nothing to
+   poll.  The wait doubles each time up to SIO_ASYNC_BACKOFF_MAX.  The
+   operation fails once the total exceeds the timeout.  */
+static int
+sio_asyncbackoff (struct siobuf *sio)
+{
+  int backoff;
+
+  if (sio->milliseconds >= 0 && sio->async_waited >= sio->milliseconds)
+    return -1;
+  backoff = sio->async_waited;
+  if (backoff < 1)
+    backoff = 1;
+  else if (backoff > SIO_ASYNC_BACKOFF_MAX)
+    backoff = SIO_ASYNC_BACKOFF_MAX;
+  poll (NULL, 0, backoff);
+  sio->async_waited += backoff;
+  return SIO_READ;
+}
+
+/* With SSL_MODE_ASYNC, an operation paused while an asynchronous crypto
+   engine is working on it.  Wait for the engine to signal completion on
+   its file descriptors rather than retrying the operation in a loop.  If
+   the engine provides no descriptors, or no async job was available
+   (wait_job), back off before the retry.  */
+static int
+sio_asyncpoll (struct siobuf *sio, int wait_job)
+{
+  OSSL_ASYNC_FD fds[SIO_ASYNC_FDS];
+  struct pollfd pollfd[SIO_ASYNC_FDS];
+  size_t i, nfds;
+  int status;
+
+  if (wait_job
+      || !SSL_get_all_async_fds (sio->ssl, NULL, &nfds)
+      || nfds == 0 || nfds > SIO_ASYNC_FDS
+      || !SSL_get_all_async_fds (sio->ssl, fds, &nfds))
+    return sio_asyncbackoff (sio);
+  for (i = 0; i < nfds; i++)
+    {
+      pollfd[i].fd = fds[i];
+      pollfd[i].events = POLLIN;
+      pollfd[i].revents = 0;
+    }
+  while ((status = poll (pollfd, nfds, sio->milliseconds)) < 0)
+    if (errno != EINTR)
+      return -1;
+  return status > 0 ? SIO_READ : -1;
+}
+
 static int
 sio_sslpoll (struct siobuf *sio, int ret)
 {
@@ -315,6 +427,10 @@ sio_sslpoll (struct siobuf *sio, int ret)
     want_read = 1;
   else if (err == SSL_ERROR_WANT_WRITE)
     want_write = 1;
+  else if (err == SSL_ERROR_WANT_ASYNC)
+    return sio_asyncpoll (sio, 0);
+  else if (err == SSL_ERROR_WANT_ASYNC_JOB)
+    return sio_asyncpoll (sio, 1);
   else
     return -1;
   return sio_poll (sio, want_read, want_write, 0);
@@ -372,6 +488,7 @@ raw_write (struct siobuf *sio, const char *buf, int len)
 	   it repeatedly until all the write buffer contents have
 	   been written.  The inner loop handles EAGAIN (EWOULDBLOCK)
 	   propagating up through OpenSSL. */
+	sio->async_waited = 0;
 	while ((n = SSL_write (sio->ssl, buf, len)) <= 0)
 	  if (sio_sslpoll (sio, n) <= 0)
 	    return;
@@ -423,8 +540,12 @@ sio_flush (struct siobuf *sio)
   if (length <= 0)
     return;
 
+  PROBE2 (sio__flush, sio, length);
+  sio->octets_written += length;
   if (sio->monitor_cb != NULL)
     (*sio->monitor_cb) (sio->write_buffer, length, 1, sio->cbarg);
+  if (sio->record_cb != NULL)
+    (*sio->record_cb) (sio->write_buffer, length, 1, sio->record_arg);
 
   if (sio->encode_cb != NULL)
     {
@@ -487,6 +608,7 @@ raw_read (struct siobuf *sio, char *buf, int len)
 	 return the next record.  SSL_pending() is used to avoid this
 	 problem. The loop handles EAGAIN (EWOULDBLOCK) propagating up
 	 through OpenSSL. */
+      sio->async_waited = 0;
       while ((n = SSL_read (sio->ssl, buf, len)) < 0)
         if (sio_sslpoll (sio, n) <= 0)
 	  break;
@@ -527,8 +649,10 @@ sio_fill (struct siobuf *sio)
   assert (sio != NULL);
 
   sio->read_unread = raw_read (sio, sio->read_buffer, sio->buffer_size);
+  PROBE2 (sio__fill, sio, sio->read_unread);
   if (sio->read_unread <= 0)
     return 0;
+  sio->octets_read += sio->read_unread;
 
   if (sio->decode_cb != NULL)
     /* Rules for the decode callback.
@@ -547,6 +671,9 @@ sio_fill (struct siobuf *sio)
   if (sio->monitor_cb != NULL && sio->read_unread > 0)
     (*sio->monitor_cb) (sio->read_position, sio->read_unread,
 			0, sio->cbarg);
+  if (sio->record_cb != NULL && sio->read_unread > 0)
+    (*sio->record_cb) (sio->read_position, sio->read_unread,
+		       0, sio->record_arg);
   return sio->read_unread > 0;
 }
 
@@ -625,6 +752,28 @@ sio_get_userdata (struct siobuf *sio)
   return sio->user_data;
 }
 
+/* Total octets written to the connection, including octets still in the
+   write buffer.  */
+unsigned long
+sio_get_position (struct siobuf *sio)
+{
+  assert (sio != NULL);
+
+  return sio->octets_written + (sio->write_position - sio->write_buffer);
+}
+
+/* Total octets written and read on the connection, excluding any TLS
+   record overhead.  */
+void
+sio_get_octets (struct siobuf *sio, unsigned long *written,
+		unsigned long *read)
+{
+  assert (sio != NULL);
+
+  *written = sio->octets_written;
+  *read = sio->octets_read;
+}
+
 int
 sio_printf (struct siobuf *sio, const char *format, ...)
 {
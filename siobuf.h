@@ -36,6 +36,7 @@ typedef void (*monitorcb_t) (const char *buffer, int length, int direction,
 struct siobuf *sio_attach(int sdr, int sdw, int buffer_size);
 void sio_detach(struct siobuf *sio);
 void sio_set_monitorcb(struct siobuf *sio, monitorcb_t cb, void *arg);
+void sio_set_recordcb(struct siobuf *sio, monitorcb_t cb, void *arg);
 void sio_set_timeout(struct siobuf *sio, int milliseconds);
 void sio_set_securitycb(struct siobuf *sio, recodecb_t encode_cb,
 		        recodecb_t decode_cb, void *arg);
@@ -50,10 +51,16 @@ int sio_printf(struct siobuf *sio, const char *format, ...)
 	       __attribute__ ((format (printf, 2, 3))) ;
 void *sio_set_userdata (struct siobuf *sio, void *user_data);
 void *sio_get_userdata (struct siobuf *io);
+unsigned long sio_get_position (struct siobuf *sio);
+void sio_get_octets (struct siobuf *sio, unsigned long *written,
+		     unsigned long *read);
 
 
 #ifdef USE_TLS
 int sio_set_tlsclient_ssl (struct siobuf *sio, SSL *ssl);
+int sio_set_tlsclient_early (struct siobuf *sio, SSL *ssl,
+			     const void *bufp, int buflen);
 int sio_set_tlsserver_ssl (struct siobuf *sio, SSL *ssl);
+SSL *sio_get_ssl (struct siobuf *sio);
 #endif
 #endif
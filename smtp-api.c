@@ -30,6 +30,13 @@
 #include <missing.h> /* declarations for missing library functions */
 
 #include <errno.h>
+#include <sys/socket.h>
+#if HAVE_LWRES_NETDB_H
+# include <lwres/netdb.h>
+#else
+# include <netdb.h>
+#endif
+
 #include "api.h"
 #include "libesmtp-private.h"
 #include "headers.h"
@@ -77,6 +84,8 @@ smtp_create_session (void)
   session->data_timeout = DATA_DEFAULT;
   session->transfer_timeout = TRANSFER_DEFAULT;
   session->data2_timeout = DATA2_DEFAULT;
+  session->quit_linger = -1;
+  session->transcript_fd = -1;
 
   return session;
 }
@@ -108,8 +117,10 @@ smtp_set_server (smtp_session_t session, const char *hostport)
 
   if (session->host != NULL)
     {
-      free (session->host);
+      if (!session->borrowed_host)
+	free (session->host);
       session->port = session->host = NULL;
+      session->borrowed_host = 0;
     }
 
   if ((host = strdup (hostport)) == NULL)
@@ -168,8 +179,9 @@ smtp_set_hostname (smtp_session_t session, const char *hostname)
   SMTPAPI_CHECK_ARGS (session != NULL && hostname != NULL, 0);
 #endif
 
-  if (session->localhost != NULL)
+  if (session->localhost != NULL && !session->borrowed_localhost)
     free (session->localhost);
+  session->borrowed_localhost = 0;
 #if HAVE_GETHOSTNAME
   if (hostname == NULL)
     {
@@ -186,6 +198,88 @@ smtp_set_hostname (smtp_session_t session, const char *hostname)
   return 1;
 }
 
+/**
+ * smtp_set_local_addresses() - Set local addresses for connections.
+ * @session: The session.
+ * @addresses: Array of numeric IPv4 or IPv6 addresses.
+ * @naddresses: Number of addresses in the array.
+ * @how: Constant from &enum local_address_selection.
+ *
+ * Bind connections to the MTA to one of a pool of local addresses.  The
+ * local address is chosen from those with the same address family as the
+ * MTA's address.  If @how is %Local_ROUND_ROBIN, each connection made by
+ * the process uses the next address in turn, spreading connections evenly
+ * over the pool.  If @how is %Local_HASH, the address is chosen using a
+ * hash of the MTA's host name so that connections to a given MTA always
+ * originate from the same address.
+ *
+ * If binding to the selected address fails, the %SMTP_EV_BINDFAILED event
+ * is reported with the address and the system error number and the
+ * remaining addresses in the pool are tried in turn.  An MTA address for
+ * which no local address of the same family is available is skipped.
+ *
+ * Specify @naddresses as zero to use the system's choice of local
+ * address, which is the default.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_set_local_addresses (smtp_session_t session,
+			  const char *const addresses[], int naddresses,
+			  enum local_address_selection how)
+{
+  struct local_address *local;
+  struct addrinfo hints, *res;
+  int i;
+
+  SMTPAPI_CHECK_ARGS (session != NULL && naddresses >= 0, 0);
+  SMTPAPI_CHECK_ARGS (naddresses == 0 || addresses != NULL, 0);
+  SMTPAPI_CHECK_ARGS (how == Local_ROUND_ROBIN || how == Local_HASH, 0);
+
+  local = NULL;
+  if (naddresses > 0)
+    {
+      if ((local = calloc (naddresses, sizeof *local)) == NULL)
+	{
+	  set_errno (ENOMEM);
+	  return 0;
+	}
+      memset (&hints, 0, sizeof hints);
+      hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+      hints.ai_family = PF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      for (i = 0; i < naddresses; i++)
+	{
+	  if (addresses[i] == NULL
+	      || getaddrinfo (addresses[i], NULL, &hints, &res) != 0)
+	    {
+	      while (--i >= 0)
+		free (local[i].name);
+	      free (local);
+	      set_error (SMTP_ERR_INVAL);
+	      return 0;
+	    }
+	  memcpy (&local[i].addr, res->ai_addr, res->ai_addrlen);
+	  local[i].addrlen = res->ai_addrlen;
+	  freeaddrinfo (res);
+	  if ((local[i].name = strdup (addresses[i])) == NULL)
+	    {
+	      while (--i >= 0)
+		free (local[i].name);
+	      free (local);
+	      set_errno (ENOMEM);
+	      return 0;
+	    }
+	}
+    }
+
+  destroy_local_addresses (session);
+  session->local_addresses = local;
+  session->n_local_addresses = naddresses;
+  session->local_address_selection = how;
+  return 1;
+}
+
 /**
  * smtp_add_message() - Add a message to the session.
  * @session: The session.
@@ -301,6 +395,53 @@ smtp_set_reverse_path (smtp_message_t message, const char *mailbox)
   return 1;
 }
 
+/**
+ * smtp_message_set_verp() - Use a variable envelope return path.
+ * @message: The message.
+ * @delimiters: Two VERP delimiter characters or %NULL.
+ *
+ * Request that the message is sent using a variable envelope return path
+ * (VERP).  The message is sent in a separate transaction for each recipient
+ * and the reverse path for each transaction is made from the reverse path
+ * mailbox by inserting the recipient's local part and domain before the
+ * ``@``, separated by the first and second characters of @delimiters
+ * respectively.  For example, with the delimiters ``"+="``, the reverse
+ * path ``owner-list@example.org`` and the recipient ``user@example.com``,
+ * the reverse path is ``owner-list+user=example.com@example.org``.  This
+ * allows bounces to be attributed to a recipient without the application
+ * having to create a copy of the message for each one.
+ *
+ * The message is read from the application once for each recipient,
+ * however its headers are only processed for the first recipient and are
+ * reused for the remainder.  When the MTA supports ``PIPELINING``, each
+ * transaction is started without waiting for the previous one to
+ * complete.  The %SMTP_EV_MESSAGESENT event is reported and the message
+ * transfer status is set for each recipient's transaction.
+ *
+ * Specify @delimiters as %NULL to send the message to all recipients in a
+ * single transaction, which is the default.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_message_set_verp (smtp_message_t message, const char *delimiters)
+{
+  SMTPAPI_CHECK_ARGS (message != NULL, 0);
+  SMTPAPI_CHECK_ARGS (delimiters == NULL || (delimiters[0] != '\0'
+					     && delimiters[1] != '\0'
+					     && delimiters[2] == '\0'), 0);
+
+  if (delimiters == NULL)
+    message->verp = 0;
+  else
+    {
+      message->verp_delimiters[0] = delimiters[0];
+      message->verp_delimiters[1] = delimiters[1];
+      message->verp = 1;
+    }
+  return 1;
+}
+
 /**
  * smtp_reverse_path_status() - Get the reverse path status.
  * @message: The message.
@@ -707,6 +848,81 @@ smtp_deliverby_set_mode (smtp_message_t message,
   return 1;
 }
 
+/**
+ * DOC: Scheduling
+ *
+ * Message Scheduling
+ * ------------------
+ *
+ * By default, messages are sent in the order they are added to the session.
+ * The application may instead assign priorities and deadlines to messages.
+ * Once it does so, smtp_start_session() sends messages in order of
+ * priority, highest first, and messages with equal priority in order of
+ * deadline, earliest first.  A message with a Deliver By time (RFC 2852)
+ * but no deadline is ordered using its Deliver By time.  Otherwise messages
+ * with equal priority are sent in the order they were added.
+ *
+ * If a session is interrupted, for example by a dropped connection, the
+ * priority of each unsent message is raised by one when the session is
+ * restarted.  Low priority messages therefore cannot be postponed
+ * indefinitely by a continuing supply of higher priority messages.
+ *
+ * This orders messages within a session.  Sessions submitted to a runtime
+ * are also ordered, by their most urgent unsent message, as described
+ * under Runtime.  Sessions which the application starts itself run when
+ * it starts them and are not ordered with respect to one another.
+ *
+ * When the MTA supports the ``MT-PRIORITY`` extension (RFC 6710), the
+ * priority is also sent with the message so that the MTA and subsequent
+ * relays may schedule it accordingly.  MTAs may lower the priority
+ * requested by clients that are not authorised to use it.
+ */
+
+/**
+ * smtp_message_set_priority() - Set the message priority.
+ * @message: The message.
+ * @priority: Priority from -9 (lowest) to +9 (highest).
+ *
+ * Set the priority used to decide the order in which messages are sent.
+ * The default priority is zero.  A priority other than zero is sent to the
+ * MTA in the ``MT-PRIORITY`` parameter of the MAIL command if the MTA
+ * supports it.  The range of priorities is that of RFC 6710.
+ *
+ * Return: Non zero on success, zero on failure.
+ */
+int
+smtp_message_set_priority (smtp_message_t message, int priority)
+{
+  SMTPAPI_CHECK_ARGS (message != NULL, 0);
+  SMTPAPI_CHECK_ARGS (PRIORITY_MIN <= priority && priority <= PRIORITY_MAX, 0);
+
+  message->priority = priority;
+  message->session->prioritised = 1;
+  return 1;
+}
+
+/**
+ * smtp_message_set_deadline() - Set the message deadline.
+ * @message: The message.
+ * @seconds: Time from now by which the message should be sent.
+ *
+ * Among messages of equal priority, those with the earliest deadlines are
+ * sent first.  The deadline is only used to order messages, it does not
+ * prevent a message being sent after the deadline has passed.  If @seconds
+ * is zero, the deadline is cleared.
+ *
+ * Return: Non zero on success, zero on failure.
+ */
+int
+smtp_message_set_deadline (smtp_message_t message, long seconds)
+{
+  SMTPAPI_CHECK_ARGS (message != NULL && seconds >= 0, 0);
+
+  message->deadline = (seconds > 0) ? time (NULL) + seconds : 0;
+  message->session->prioritised = 1;
+  return 1;
+}
+
 /**
  * DOC: Callbacks
  *
@@ -874,13 +1090,21 @@ smtp_destroy_session (smtp_session_t session)
 #ifdef USE_TLS
   destroy_starttls_context (session);
 #endif
+#ifdef USE_CHUNKING
+  cat_free (&session->bdat_pending);
+#endif
 
   if (session->canon != NULL)
     free (session->canon);
-  if (session->host != NULL)
+  if (session->host != NULL && !session->borrowed_host)
     free (session->host);
-  if (session->localhost != NULL)
+  if (session->localhost != NULL && !session->borrowed_localhost)
     free (session->localhost);
+  destroy_local_addresses (session);
+  if (session->owned_auth_context != NULL)
+    auth_destroy_context (session->owned_auth_context);
+  if (session->config != NULL)
+    smtp_destroy_config (session->config);
 
   if (session->msg_source != NULL)
     msg_source_destroy (session->msg_source);
@@ -917,6 +1141,11 @@ smtp_destroy_session (smtp_session_t session)
         }
 
       destroy_header_table (message);
+      cat_free (&message->hdr_cache);
+#ifdef USE_CHUNKING
+      destroy_burl_parts (message);
+#endif
+      digest_destroy (message);
 
       if (message->dsn_envid != NULL)
 	free (message->dsn_envid);
@@ -1209,6 +1438,61 @@ smtp_option_require_all_recipients (smtp_session_t session, int state)
   return 1;
 }
 
+/**
+ * smtp_set_pipeline_window() - Limit commands awaiting a response.
+ * @session: The session.
+ * @commands: Maximum number of commands awaiting a response, or zero.
+ * @octets: Maximum octets of commands awaiting a response, or zero.
+ *
+ * When the server supports PIPELINING, libESMTP normally writes commands
+ * until it must wait for a response, for example, all the RCPT commands
+ * of a transaction.  With very large envelopes the server's responses may
+ * accumulate unread while the client waits to write, which some servers
+ * handle badly.  Setting a window limits the commands in flight.  Once the
+ * window is full, libESMTP reads responses until there is room for the
+ * next command, so that reading and writing are interleaved.  A value of
+ * zero means no limit.  When either limit is set, no more than 256 commands
+ * are in flight.
+ *
+ * Return: Non zero on success, zero on failure.
+ */
+int
+smtp_set_pipeline_window (smtp_session_t session, int commands,
+			  unsigned long octets)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL && commands >= 0, 0);
+
+  session->pipeline_commands = commands;
+  session->pipeline_octets = octets;
+  return 1;
+}
+
+/**
+ * smtp_set_quit_linger() - Pipeline QUIT with the last message.
+ * @session: The session.
+ * @milliseconds: Time to wait for the reply to QUIT, or -1.
+ *
+ * Normally libESMTP waits for the response to the last message before
+ * sending QUIT and then waits for the server to reply to QUIT before
+ * closing the connection.  When @milliseconds is zero or more and the
+ * server supports PIPELINING, QUIT is sent in the same write as the end
+ * of the last message and, once the response to the message has been
+ * read, libESMTP waits no more than @milliseconds for the reply to QUIT.
+ * This saves a round trip at the end of each session.  The message and
+ * recipient status are unaffected since the server has already reported
+ * them.  The default of -1 restores the normal behaviour.
+ *
+ * Return: Non zero on success, zero on failure.
+ */
+int
+smtp_set_quit_linger (smtp_session_t session, long milliseconds)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL && milliseconds >= -1, 0);
+
+  session->quit_linger = milliseconds;
+  return 1;
+}
+
 /**
  * smtp_set_timeout() - Set session timeouts.
  * @session: The session.
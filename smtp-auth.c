@@ -46,6 +46,10 @@
 #include "base64.h"
 #include "protocol.h"
 
+/* RFC 4954 raises the maximum length of lines in the AUTH exchange to
+   12288 octets, enough for the bearer tokens used by OAuth.  */
+#define AUTH_LINE_MAX	12288
+
 /**
  * DOC: RFC 4954
  *
@@ -145,6 +149,13 @@ select_auth_mechanism (smtp_session_t session)
 {
   if (session->authenticated)
     return 0;
+  /* Sessions created from a shared configuration get their own copy of
+     its auth context the first time it is needed.  */
+  if (session->auth_context == NULL && session->owned_auth_context == NULL
+      && session->config != NULL
+      && config_auth_context (session->config) != NULL)
+    session->auth_context = session->owned_auth_context
+      = auth_copy_context (config_auth_context (session->config));
   if (session->auth_context == NULL)
     return 0;
   if (!auth_client_enabled (session->auth_context))
@@ -173,7 +184,7 @@ next_auth_mechanism (smtp_session_t session)
 void
 cmd_auth (siobuf_t conn, smtp_session_t session)
 {
-  char buf[2048];
+  char buf[AUTH_LINE_MAX];
   const char *response;
   int len;
 
@@ -219,6 +230,10 @@ rsp_auth (siobuf_t conn, smtp_session_t session)
 	session->rsp_state = S_quit;
       else
         {
+	  /* Make sure a rejected bearer token is not used again. */
+	  if (session->mta_status.code == 535)
+	    auth_invalidate_token (session->auth_context);
+
 	  /* If another mechanism cannot be selected, move on to the
 	     mail command since the MTA is required to accept mail for
 	     its own domain. */
@@ -267,7 +282,7 @@ rsp_auth (siobuf_t conn, smtp_session_t session)
 void
 cmd_auth2 (siobuf_t conn, smtp_session_t session)
 {
-  char buf[2048];
+  char buf[AUTH_LINE_MAX];
   const char *response;
   int len;
 
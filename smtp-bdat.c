@@ -43,6 +43,114 @@
 #include "concatenate.h"
 #include "headers.h"
 #include "protocol.h"
+#include "probes.h"
+
+/* Send a chunk of the message in a BDAT command and account for it.  */
+static void
+bdat_write (siobuf_t conn, smtp_message_t message,
+	    const char *chunk, int len, int last)
+{
+  message->wire_octets += sio_printf (conn, "BDAT %d%s\r\n",
+				      len, last ? " LAST" : "") + len;
+  if (len > 0)
+    {
+      sio_write (conn, chunk, len);
+      digest_update (message, chunk, len);
+    }
+}
+
+/* Chunks from the application are merged until they would exceed this
+   size.  A message whose headers and body fit is sent in a single BDAT
+   LAST command.  */
+#define BDAT_CHUNK_MAX		(32 * 1024)
+
+/* The final command for the message has been issued.  */
+static void
+bdat_last (siobuf_t conn, smtp_session_t session)
+{
+  digest_finish (session->current_message);
+  sio_set_timeout (conn, session->data2_timeout);
+  session->bdat_last_issued = 1;
+  session->cmd_state = pipeline_quit (session) ? S_quit : -1;
+}
+
+/* Issue the next BDAT command.  The session holds back one chunk of the
+   message so that the last chunk can be sent with LAST when the
+   application signals the end of the message, saving a separate BDAT 0
+   LAST command and its response.  Small chunks are merged, so this
+   always reads at least one chunk from the application.  */
+static void
+bdat_next (siobuf_t conn, smtp_session_t session)
+{
+  const char *chunk, *pending;
+  int len, plen;
+  smtp_message_t message;
+
+  message = session->current_message;
+  session->bdat_pipelined += 1;
+
+  /* Once the content is sent, send the parts added for BURL.  */
+  if (session->cmd_burl_part != NULL)
+    {
+      if (burl_write (conn, session))
+	bdat_last (conn, session);
+      else
+	session->cmd_state = session->bdat_abort_pipeline ? -1 : S_bdat2;
+      return;
+    }
+
+  /* N.B. the BDAT chunk size is set by the amount of buffering
+          provided by the application callback, subject to merging.
+          An application is not advised to read a message line by
+          line in the callback.  Instead it should buffer the message
+          by a "reasonable" amount, say, 2Kb.  */
+  errno = 0;
+  while ((chunk = msg_getb (session->msg_source, &len)) != NULL)
+    {
+      /* Notify byte count to the application. */
+      if (session->event_cb != NULL)
+	(*session->event_cb) (session, SMTP_EV_MESSAGEDATA,
+	                      session->event_cb_arg, message, len);
+
+      pending = cat_buffer (&session->bdat_pending, &plen);
+      if (plen > 0 && plen + len > BDAT_CHUNK_MAX)
+	{
+	  bdat_write (conn, message, pending, plen, 0);
+	  cat_reset (&session->bdat_pending, 0);
+	  if (concatenate (&session->bdat_pending, chunk, len) == NULL)
+	    break;
+
+	  /* BDAT commands may be pipelined.  Check if a a previous BDAT
+	     has failed and stop pipelining if necessary.  */
+	  session->cmd_state = session->bdat_abort_pipeline ? -1 : S_bdat2;
+	  return;
+	}
+      if (concatenate (&session->bdat_pending, chunk, len) == NULL)
+	break;
+      errno = 0;
+    }
+  if (errno != 0)
+    {
+      set_errno (errno);
+      session->cmd_state = session->rsp_state = -1;
+      return;
+    }
+
+  /* End of the content.  The pending chunk always holds at least the
+     CRLF terminating the headers, so there is no need for the workaround
+     for servers that mishandle BDAT 0 LAST.  If parts were added for
+     BURL, the last of those carries LAST instead.  */
+  pending = cat_buffer (&session->bdat_pending, &plen);
+  bdat_write (conn, message, pending, plen, message->burl_parts == NULL);
+  cat_reset (&session->bdat_pending, 0);
+  if (message->burl_parts != NULL)
+    {
+      session->cmd_burl_part = message->burl_parts;
+      session->cmd_state = session->bdat_abort_pipeline ? -1 : S_bdat2;
+    }
+  else
+    bdat_last (conn, session);
+}
 
 /* Read the message from the application using the callback.
    Break into chunks and copy to the server. */
@@ -52,13 +160,15 @@ cmd_bdat (siobuf_t conn, smtp_session_t session)
   const char *line, *header, *chunk;
   int c, len;
   struct catbuf headers;
+  smtp_message_t message;
+
+  message = session->current_message;
 
   sio_set_timeout (conn, session->transfer_timeout);
+  session->cmd_burl_part = NULL;
 
   /* Arrange to read the current message from the application. */
-  msg_source_set_cb (session->msg_source,
-		     session->current_message->cb,
-		     session->current_message->cb_arg);
+  msg_source_set_cb (session->msg_source, message->cb, message->cb_arg);
 
   /* Arrange *not* to have the message contents monitored.  This is
      purely to avoid overwhelming the application with data. */
@@ -67,7 +177,40 @@ cmd_bdat (siobuf_t conn, smtp_session_t session)
   /* Make sure we read the message from the beginning and get
      the header processing right.  */
   msg_rewind (session->msg_source);
-  reset_header_table (session->current_message);
+  digest_start (message);
+
+  /* Reuse the headers processed for the message's first transaction. */
+  if (message->hdr_cached)
+    {
+      errno = 0;
+      msg_skip_headers (session->msg_source);
+      if (errno != 0)
+	{
+	  set_errno (errno);
+	  session->cmd_state = session->rsp_state = -1;
+	  return;
+	}
+      chunk = cat_buffer (&message->hdr_cache, &len);
+      if (session->event_cb != NULL)
+	(*session->event_cb) (session, SMTP_EV_MESSAGEDATA,
+			      session->event_cb_arg, message, len);
+      if (session->monitor_cb && session->monitor_cb_headers)
+	(*session->monitor_cb) (chunk, len, SMTP_CB_HEADERS,
+				session->monitor_cb_arg);
+      session->bdat_abort_pipeline = 0;
+      session->bdat_last_issued = 0;
+      session->bdat_pipelined = 0;
+      cat_reset (&session->bdat_pending, 0);
+      if (concatenate (&session->bdat_pending, chunk, len) == NULL)
+	{
+	  set_errno (ENOMEM);
+	  session->cmd_state = session->rsp_state = -1;
+	  return;
+	}
+      bdat_next (conn, session);
+      return;
+    }
+  reset_header_table (message);
 
   /* Initialise a buffer for the message headers. */
   cat_init (&headers, 1024);
@@ -108,7 +251,7 @@ cmd_bdat (siobuf_t conn, smtp_session_t session)
          to the remote MTA.   If header is NULL this header has been
          deleted by the library.  If header == line it is passed
          unchanged otherwise, header must be freed after use. */
-      header = process_header (session->current_message, line, &len);
+      header = process_header (message, line, &len);
       if (header != NULL)
 	{
 	  /* Notify byte count to the application. */
@@ -149,7 +292,7 @@ break_2:
      Message-Id: or To:/Cc:/Bcc: headers.  In the most extreme case the
      application might just send a CRLF followed by the message body.
      Libesmtp will then provide all the necessary headers. */
-  while ((header = missing_header (session->current_message, &len)) != NULL)
+  while ((header = missing_header (message, &len)) != NULL)
     {
       /* Notify byte count to the application. */
       if (session->event_cb != NULL)
@@ -167,16 +310,32 @@ break_2:
   /* Terminate headers */
   concatenate (&headers, "\r\n", 2);
 
-  /* ``headers'' now contains the message headers.  Transfer them in a
-     BDAT command and move to the next state. */
+  /* ``headers'' now contains the message headers.  They become the first
+     pending chunk, to be merged with the body if it is small enough.  */
   session->bdat_abort_pipeline = 0;
   session->bdat_last_issued = 0;
-  session->bdat_pipelined = 1;
-  chunk = cat_buffer (&headers, &len);
-  sio_printf (conn, "BDAT %d\r\n", len);
-  sio_write (conn, chunk, len);
-  cat_free (&headers);
-  session->cmd_state = S_bdat2;
+  session->bdat_pipelined = 0;
+  if (message->verp || session->xact_end != NULL)
+    {
+      /* Keep the processed headers for the remaining transactions. */
+      cat_free (&message->hdr_cache);
+      message->hdr_cache = headers;
+      message->hdr_cached = 1;
+      chunk = cat_buffer (&headers, &len);
+      cat_reset (&session->bdat_pending, 0);
+      if (concatenate (&session->bdat_pending, chunk, len) == NULL)
+	{
+	  set_errno (ENOMEM);
+	  session->cmd_state = session->rsp_state = -1;
+	  return;
+	}
+    }
+  else
+    {
+      cat_free (&session->bdat_pending);
+      session->bdat_pending = headers;
+    }
+  bdat_next (conn, session);
 }
 
 void
@@ -188,47 +347,7 @@ rsp_bdat (siobuf_t conn, smtp_session_t session)
 void
 cmd_bdat2 (siobuf_t conn, smtp_session_t session)
 {
-  const char *chunk;
-  int len;
-
-  /* N.B. the BDAT chunk size is set by the amount of buffering
-          provided by the application callback.  An application is not
-          advised to read a message line by line in the callback.
-          Instead it should buffer the message by a "reasonable" amount,
-          say, 2Kb.  */
-  errno = 0;
-  chunk = msg_getb (session->msg_source, &len);
-  if (chunk != NULL)
-    {
-      /* Notify byte count to the application. */
-      if (session->event_cb != NULL)
-	(*session->event_cb) (session, SMTP_EV_MESSAGEDATA,
-	                      session->event_cb_arg,
-	                      session->current_message, len);
-      sio_printf (conn, "BDAT %d\r\n", len);
-      sio_write (conn, chunk, len);
-
-      /* BDAT commands may be pipelined.  Check if a a previous BDAT has
-         failed and stop pipelining if necessary.  */
-      session->cmd_state = session->bdat_abort_pipeline ? -1 : S_bdat2;
-    }
-  else
-    {
-      /* Workaround - M$ Exchange is broken wrt RFC 3030 */
-      if (session->extensions & EXT_XEXCH50)
-	sio_write (conn, "BDAT 2 LAST\r\n\r\n", -1);
-      else
-	sio_write (conn, "BDAT 0 LAST\r\n", -1);
-      sio_set_timeout (conn, session->data2_timeout);
-      session->bdat_last_issued = 1;
-      session->cmd_state = -1;
-    }
-  session->bdat_pipelined += 1;
-  if (errno != 0)
-    {
-      set_errno (errno);
-      session->cmd_state = session->rsp_state = -1;
-    }
+  bdat_next (conn, session);
 }
 
 void
@@ -236,7 +355,6 @@ rsp_bdat2 (siobuf_t conn, smtp_session_t session)
 {
   int code;
   smtp_message_t message;
-  smtp_recipient_t recipient;
 
   message = session->current_message;
   code = read_smtp_response (conn, session, &message->message_status, NULL);
@@ -250,21 +368,18 @@ rsp_bdat2 (siobuf_t conn, smtp_session_t session)
         {
 	  /* Mark all the recipients complete for which the MTA has accepted
 	     responsibility for delivery.  */
-	  for (recipient = session->current_message->recipients;
-	       recipient != NULL;
-	       recipient = recipient->next)
-	    if (!recipient->complete
-		&& recipient->status.code >= 200
-		&& recipient->status.code <= 299)
-	      recipient->complete = 1;
+	  mark_recipients_complete (session, code);
 
 	  /* Notify `message sent' */
+	  PROBE3 (message__done, session, message, message->message_status.code);
+	  metrics_count (session->metrics, METRICS_MESSAGES_ACCEPTED, 1);
+	  status_batch_add (session, message, NULL);
 	  if (session->event_cb != NULL)
 	    (*session->event_cb) (session, SMTP_EV_MESSAGESENT,
 				  session->event_cb_arg,
 				  session->current_message);
 
-	  if (next_message (session))
+	  if (next_transaction (session))
 	    session->rsp_state = initial_transaction_state (session);
 	  else
 	    session->rsp_state = S_quit;
@@ -281,13 +396,12 @@ rsp_bdat2 (siobuf_t conn, smtp_session_t session)
 	{
 	  /* Mark all the recipients complete.  This message cannot be
 	     accepted for any recipients.  */
-	  if (code == 5)
-	    for (recipient = session->current_message->recipients;
-		 recipient != NULL;
-		 recipient = recipient->next)
-	      recipient->complete = 1;
+	  mark_recipients_complete (session, code);
 
 	  /* Notify `message sent' */
+	  PROBE3 (message__done, session, message, message->message_status.code);
+	  metrics_count (session->metrics, METRICS_MESSAGES_FAILED, 1);
+	  status_batch_add (session, message, NULL);
 	  if (session->event_cb != NULL)
 	    (*session->event_cb) (session, SMTP_EV_MESSAGESENT,
 				  session->event_cb_arg,
@@ -302,7 +416,7 @@ rsp_bdat2 (siobuf_t conn, smtp_session_t session)
 	      set_error (SMTP_ERR_INVALID_RESPONSE_STATUS);
 	      session->rsp_state = S_quit;
 	    }
-	  else if (next_message (session))
+	  else if (next_transaction (session))
 	    session->rsp_state = S_rset;
 	  else
 	    session->rsp_state = S_quit;
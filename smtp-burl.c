@@ -0,0 +1,216 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#ifdef USE_CHUNKING
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+#include "siobuf.h"
+#include "protocol.h"
+
+/**
+ * DOC: RFC 4468
+ *
+ * Message Submission BURL Extension
+ * ---------------------------------
+ *
+ * The BURL extension allows part of a message to be submitted by
+ * reference.  Instead of reading the content from the application and
+ * copying it to the server, libESMTP sends a URL, usually an IMAP URLAUTH
+ * URL (RFC 4467), and the MTA fetches the content itself.  This avoids
+ * uploading content which the user's message store already holds, for
+ * example when forwarding a message with large attachments.
+ *
+ * A message using BURL starts with the content supplied by the message
+ * callback, whose headers are processed as usual.  This is followed by the
+ * parts added with smtp_burl_add_url() and smtp_burl_add_literal() in the
+ * order they were added.  The callback's content and each literal part are
+ * sent in BDAT commands and each URL in a BURL command.  The final command
+ * carries LAST.  Since this requires CHUNKING as well as BURL, libESMTP
+ * uses the event callback to notify the application and ends the session
+ * if the MTA does not list both extensions.
+ */
+
+struct smtp_burl_part
+  {
+    struct smtp_burl_part *next;
+    char *url;				/* URL or NULL for a literal */
+    char *data;				/* Literal content */
+    int len;
+  };
+
+static int
+add_part (smtp_message_t message, const char *url, const char *data, int len)
+{
+  struct smtp_burl_part *part;
+
+  if ((part = calloc (1, sizeof (struct smtp_burl_part))) == NULL)
+    {
+      set_errno (ENOMEM);
+      return 0;
+    }
+  if (url != NULL)
+    part->url = strdup (url);
+  else if ((part->data = malloc (len)) != NULL)
+    {
+      memcpy (part->data, data, len);
+      part->len = len;
+    }
+  if (part->url == NULL && part->data == NULL)
+    {
+      free (part);
+      set_errno (ENOMEM);
+      return 0;
+    }
+
+  if (message->burl_parts == NULL)
+    message->burl_parts = part;
+  else
+    message->end_burl_parts->next = part;
+  message->end_burl_parts = part;
+  message->session->required_extensions |= (EXT_BURL | EXT_CHUNKING);
+  return 1;
+}
+
+/**
+ * smtp_burl_add_url() - Add content by reference.
+ * @message: The message.
+ * @url: URL of the content.
+ *
+ * Append the content at @url to the message.  The URL is sent to the MTA
+ * which fetches the content, so it must be one the MTA can resolve and is
+ * authorised to access.  libESMTP does not interpret the URL.
+ *
+ * Return: Non zero on success, zero on failure.
+ */
+int
+smtp_burl_add_url (smtp_message_t message, const char *url)
+{
+  SMTPAPI_CHECK_ARGS (message != NULL && url != NULL && *url != '\0'
+		      && strpbrk (url, " \r\n") == NULL, 0);
+
+  return add_part (message, url, NULL, 0);
+}
+
+/**
+ * smtp_burl_add_literal() - Add content by value.
+ * @message: The message.
+ * @data: The content.
+ * @len: Length of @data or -1 if it is terminated by a \0 character.
+ *
+ * Append a copy of @data to the message, for example to place MIME
+ * boundaries between parts added by smtp_burl_add_url().  The content is
+ * sent as is, without any processing.
+ *
+ * Return: Non zero on success, zero on failure.
+ */
+int
+smtp_burl_add_literal (smtp_message_t message, const char *data, int len)
+{
+  SMTPAPI_CHECK_ARGS (message != NULL && data != NULL, 0);
+
+  if (len < 0)
+    len = strlen (data);
+  SMTPAPI_CHECK_ARGS (len > 0, 0);
+
+  return add_part (message, NULL, data, len);
+}
+
+/* Send the next part of the current message in a BURL or BDAT command.
+   Return non-zero if this is the final part, in which case the command
+   carries LAST.  */
+int
+burl_write (siobuf_t conn, smtp_session_t session)
+{
+  struct smtp_burl_part *part;
+  smtp_message_t message;
+  const char *last;
+
+  message = session->current_message;
+  part = session->cmd_burl_part;
+  session->cmd_burl_part = part->next;
+  last = (part->next == NULL) ? " LAST" : "";
+  if (part->url != NULL)
+    message->wire_octets += sio_printf (conn, "BURL %s%s\r\n",
+					part->url, last);
+  else
+    {
+      if (session->event_cb != NULL)
+	(*session->event_cb) (session, SMTP_EV_MESSAGEDATA,
+			      session->event_cb_arg, message, part->len);
+      message->wire_octets += sio_printf (conn, "BDAT %d%s\r\n",
+					  part->len, last) + part->len;
+      sio_write (conn, part->data, part->len);
+      digest_update (message, part->data, part->len);
+    }
+  return part->next == NULL;
+}
+
+void
+destroy_burl_parts (smtp_message_t message)
+{
+  struct smtp_burl_part *part, *next;
+
+  for (part = message->burl_parts; part != NULL; part = next)
+    {
+      next = part->next;
+      free (part->url);
+      free (part->data);
+      free (part);
+    }
+  message->burl_parts = message->end_burl_parts = NULL;
+}
+
+#else
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "libesmtp-private.h"
+
+int
+smtp_burl_add_url (smtp_message_t message, const char *url)
+{
+  SMTPAPI_CHECK_ARGS (message != NULL && url != NULL, 0);
+
+  set_errno (ENOSYS);
+  return 0;
+}
+
+int
+smtp_burl_add_literal (smtp_message_t message, const char *data,
+		       int len __attribute__ ((unused)))
+{
+  SMTPAPI_CHECK_ARGS (message != NULL && data != NULL, 0);
+
+  set_errno (ENOSYS);
+  return 0;
+}
+
+#endif
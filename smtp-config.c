@@ -0,0 +1,211 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+
+/**
+ * DOC: Shared Configuration
+ *
+ * Shared Configuration
+ * --------------------
+ *
+ * Applications which send mail from many sessions to the same server can
+ * configure a session once and use it as the prototype for all the others.
+ * smtp_create_config() validates the prototype and converts it into an
+ * immutable &smtp_config_t.  smtp_create_session_from_config() then
+ * creates sessions which share the server, local host name, local
+ * addresses, timeouts, callbacks, STARTTLS settings and SSL_CTX of the
+ * prototype without copying them.
+ *
+ * If an auth context was set on the prototype using smtp_auth_set_context()
+ * it serves as a template.  Each session receives its own copy of the
+ * template when it first needs to authenticate.  The application must not
+ * destroy the template while the configuration is in use.
+ *
+ * A configuration may be used from any number of threads at once, in
+ * which case the callbacks must be thread safe.  Each session holds a
+ * reference to the configuration so smtp_destroy_config() may be called
+ * as soon as the application has created its last session.  Sessions
+ * created from a configuration may still be modified using the ordinary
+ * session APIs without affecting the configuration or other sessions.
+ */
+
+struct smtp_config
+  {
+    atomic_int refcount;
+    smtp_session_t prototype;
+  };
+
+/**
+ * smtp_create_config() - Create a shared configuration.
+ * @prototype: A session configured as a prototype.
+ *
+ * Validate @prototype and create a shared configuration from it.  The
+ * prototype must have a server set and must not have any messages.  If no
+ * local host name was set it is determined now, and if STARTTLS is enabled
+ * the SSL_CTX is created now, so that problems with certificates are
+ * reported through the prototype's event callback before any session is
+ * started.
+ *
+ * On success the configuration takes ownership of @prototype, which must
+ * not be used or destroyed by the application.  On failure the
+ * application still owns @prototype.
+ *
+ * Return: The configuration or %NULL on failure.
+ */
+smtp_config_t
+smtp_create_config (smtp_session_t prototype)
+{
+  smtp_config_t config;
+
+  SMTPAPI_CHECK_ARGS (prototype != NULL && prototype->host != NULL, NULL);
+  SMTPAPI_CHECK_ARGS (prototype->messages == NULL, NULL);
+  SMTPAPI_CHECK_ARGS (prototype->config == NULL, NULL);
+#ifdef USE_ETRN
+  SMTPAPI_CHECK_ARGS (prototype->etrn_nodes == NULL, NULL);
+#endif
+
+  if (!default_localhost (prototype))
+    return NULL;
+#ifdef USE_TLS
+  if (prototype->starttls_enabled != Starttls_DISABLED
+      && !prepare_starttls_context (prototype))
+    {
+      set_error (SMTP_ERR_CLIENT_ERROR);
+      return NULL;
+    }
+#endif
+
+  if ((config = malloc (sizeof (struct smtp_config))) == NULL)
+    {
+      set_errno (ENOMEM);
+      return NULL;
+    }
+  atomic_init (&config->refcount, 1);
+  config->prototype = prototype;
+  return config;
+}
+
+/**
+ * smtp_create_session_from_config() - Create a session from a configuration.
+ * @config: The shared configuration.
+ *
+ * Create a session with the settings of the prototype used to create
+ * @config.  Strings and the local address pool are shared with the
+ * configuration rather than copied.
+ *
+ * Return: A new SMTP session or %NULL on failure.
+ */
+smtp_session_t
+smtp_create_session_from_config (smtp_config_t config)
+{
+  smtp_session_t session, prototype;
+
+  SMTPAPI_CHECK_ARGS (config != NULL, NULL);
+
+  if ((session = smtp_create_session ()) == NULL)
+    return NULL;
+  prototype = config->prototype;
+
+  session->localhost = prototype->localhost;
+  session->borrowed_localhost = 1;
+  session->local_addresses = prototype->local_addresses;
+  session->n_local_addresses = prototype->n_local_addresses;
+  session->local_address_selection = prototype->local_address_selection;
+  session->borrowed_local_addresses = 1;
+  session->host = prototype->host;
+  session->port = prototype->port;
+  session->borrowed_host = 1;
+
+  session->event_cb = prototype->event_cb;
+  session->event_cb_arg = prototype->event_cb_arg;
+  session->monitor_cb = prototype->monitor_cb;
+  session->monitor_cb_arg = prototype->monitor_cb_arg;
+  session->monitor_cb_headers = prototype->monitor_cb_headers;
+
+  session->greeting_timeout = prototype->greeting_timeout;
+  session->envelope_timeout = prototype->envelope_timeout;
+  session->data_timeout = prototype->data_timeout;
+  session->transfer_timeout = prototype->transfer_timeout;
+  session->data2_timeout = prototype->data2_timeout;
+  session->quit_linger = prototype->quit_linger;
+
+  session->required_extensions = prototype->required_extensions;
+  session->require_all_recipients = prototype->require_all_recipients;
+  session->pipeline_commands = prototype->pipeline_commands;
+  session->pipeline_octets = prototype->pipeline_octets;
+
+#ifdef USE_TLS
+  session->starttls_enabled = prototype->starttls_enabled;
+  if (prototype->starttls_ctx != NULL)
+    {
+      SSL_CTX_up_ref (prototype->starttls_ctx);
+      session->starttls_ctx = prototype->starttls_ctx;
+    }
+  session->tls_resumption = prototype->tls_resumption;
+  session->tls_early_data = prototype->tls_early_data;
+  session->tls_async = prototype->tls_async;
+#endif
+
+  atomic_fetch_add_explicit (&config->refcount, 1, memory_order_relaxed);
+  session->config = config;
+  return session;
+}
+
+/**
+ * smtp_destroy_config() - Release a shared configuration.
+ * @config: The shared configuration.
+ *
+ * Release the application's reference to @config.  The configuration and
+ * its prototype session are destroyed when the last session created from
+ * it is destroyed.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_destroy_config (smtp_config_t config)
+{
+  SMTPAPI_CHECK_ARGS (config != NULL, 0);
+
+  if (atomic_fetch_sub_explicit (&config->refcount, 1,
+				 memory_order_acq_rel) == 1)
+    {
+      smtp_destroy_session (config->prototype);
+      free (config);
+    }
+  return 1;
+}
+
+/* The prototype's auth context, copied by each session that needs it.  */
+auth_context_t
+config_auth_context (smtp_config_t config)
+{
+  return config->prototype->auth_context;
+}
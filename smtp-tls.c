@@ -41,6 +41,7 @@
  * * smtp_starttls_set_password_cb()
  * * smtp_starttls_set_ctx()
  * * smtp_starttls_enable()
+ * * smtp_starttls_set_resumption()
  *
  * See also: `OpenSSL <https://www.openssl.org/>`_.
  */
@@ -51,7 +52,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <openssl/x509v3.h>
 #include <openssl/err.h>
 #include <missing.h> /* declarations for missing library functions */
@@ -61,8 +64,8 @@
 #include "siobuf.h"
 #include "protocol.h"
 #include "attribute.h"
-
-#include "tlsutils.h"
+#include "probes.h"
+#include "shmcache.h"
 
 static smtp_starttls_passwordcb_t ctx_password_cb;
 static void *ctx_password_cb_arg;
@@ -73,6 +76,25 @@ static void *ctx_password_cb_arg;
 static pthread_mutex_t starttls_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
+/* TLS sessions saved for resumption.  The cache is direct mapped on a
+   hash of the server name and port; a collision simply replaces the older
+   entry.  Entries also record the SSL_CTX so that a session is never
+   resumed under a different verification policy.  Protected by
+   starttls_mutex.  */
+#define TLS_SESSION_CACHE	64
+
+/* How long to remember that a server offered STARTTLS.  The shared cache
+   stores the server's extension mask but only the STARTTLS bit is used.  */
+#define CAPABILITIES_TTL	(7L * 24L * 60L * 60L)
+
+struct tls_session_entry
+  {
+    char *key;				/* "host:port" */
+    SSL_CTX *ctx;
+    SSL_SESSION *ssl_session;
+  };
+static struct tls_session_entry tls_session_cache[TLS_SESSION_CACHE];
+
 /* This stuff is crude and doesn't belong here */
 /* vvvvvvvvvvv */
 
@@ -363,6 +385,10 @@ starttls_create_ctx (smtp_session_t session)
 	}
       starttls_ctx = ctx;
     }
+  /* The session holds its own reference, released by
+     destroy_starttls_context().  */
+  if (ctx != NULL)
+    SSL_CTX_up_ref (ctx);
 #ifdef USE_PTHREADS
   pthread_mutex_unlock (&starttls_mutex);
 #endif
@@ -375,15 +401,147 @@ destroy_starttls_context (smtp_session_t session)
   SSL_CTX_free (session->starttls_ctx);
 }
 
+/* Find the cache entry for the server and put its key in buf.  Returns
+   NULL if the session has no server.  */
+static struct tls_session_entry *
+tls_session_entry (smtp_session_t session, char buf[], size_t buflen)
+{
+  if (session->host == NULL)
+    return NULL;
+  snprintf (buf, buflen, "%s:%s", session->host, session->port);
+  return &tls_session_cache[hash_server_name (buf) % TLS_SESSION_CACHE];
+}
+
+/* Find a saved session for the server.  The caller owns a reference to
+   the returned session.  */
+static SSL_SESSION *
+tls_session_lookup (smtp_session_t session)
+{
+  struct tls_session_entry *entry;
+  SSL_SESSION *ssl_session = NULL;
+  char key[1024];
+
+  if ((entry = tls_session_entry (session, key, sizeof key)) == NULL)
+    return NULL;
+#ifdef USE_PTHREADS
+  pthread_mutex_lock (&starttls_mutex);
+#endif
+  if (entry->key != NULL && entry->ctx == session->starttls_ctx
+      && strcmp (entry->key, key) == 0)
+    {
+      ssl_session = entry->ssl_session;
+      SSL_SESSION_up_ref (ssl_session);
+    }
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock (&starttls_mutex);
+#endif
+
+  /* Try a session saved by another process.  */
+  if (ssl_session == NULL && shmcache_enabled ())
+    {
+      unsigned char der[SHMCACHE_DATA_MAX];
+      const unsigned char *p = der;
+      int len;
+
+      len = shmcache_get (SHMCACHE_TLS_SESSION, key, der, sizeof der);
+      if (len > 0)
+	ssl_session = d2i_SSL_SESSION (NULL, &p, len);
+    }
+  return ssl_session;
+}
+
+/* How long a session may be resumed.  This is the lifetime of the
+   server's ticket if it stated one.  Otherwise it is the SSL_CTX's session
+   timeout, which is set by the application or defaults to OpenSSL's.
+   RFC 8446 limits ticket lifetimes to seven days.  */
+#define TLS_SESSION_LIFETIME_MAX	(7L * 24L * 60L * 60L)
+
+static long
+tls_session_lifetime (const SSL_SESSION *ssl_session)
+{
+  unsigned long lifetime;
+
+  lifetime = SSL_SESSION_get_ticket_lifetime_hint (ssl_session);
+  if (lifetime == 0)
+    lifetime = SSL_SESSION_get_timeout (ssl_session);
+  if (lifetime > TLS_SESSION_LIFETIME_MAX)
+    lifetime = TLS_SESSION_LIFETIME_MAX;
+  return lifetime;
+}
+
+/* Save the TLS session before the connection is closed.  */
+void
+tls_session_done (smtp_session_t session, SSL *ssl)
+{
+  struct tls_session_entry *entry;
+  SSL_SESSION *ssl_session, *old_session;
+  char key[1024], *old_key, *new_key;
+
+  if (!session->tls_resumption || ssl == NULL)
+    return;
+  if ((ssl_session = SSL_get1_session (ssl)) == NULL)
+    return;
+
+  entry = tls_session_entry (session, key, sizeof key);
+  if (entry == NULL || !SSL_SESSION_is_resumable (ssl_session)
+      || (new_key = strdup (key)) == NULL)
+    {
+      SSL_SESSION_free (ssl_session);
+      return;
+    }
+#ifdef USE_PTHREADS
+  pthread_mutex_lock (&starttls_mutex);
+#endif
+  old_key = entry->key;
+  old_session = entry->ssl_session;
+  entry->key = new_key;
+  entry->ctx = session->starttls_ctx;
+  entry->ssl_session = ssl_session;
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock (&starttls_mutex);
+#endif
+  free (old_key);
+  if (old_session != NULL)
+    SSL_SESSION_free (old_session);
+
+  /* Share the session with other processes.  The peer certificate is
+     kept in the encoding since a process resuming the session needs it
+     to check the server's identity.  */
+  if (!shmcache_enabled ())
+    return;
+  if (i2d_SSL_SESSION (ssl_session, NULL) > SHMCACHE_DATA_MAX)
+    metrics_count (session->metrics, METRICS_TLS_SESSIONS_UNCACHED, 1);
+  else
+    {
+      unsigned char der[SHMCACHE_DATA_MAX], *p = der;
+      long ttl;
+      int len;
+
+      ttl = SSL_SESSION_get_time (ssl_session)
+	    + tls_session_lifetime (ssl_session) - time (NULL);
+      if ((len = i2d_SSL_SESSION (ssl_session, &p)) > 0 && ttl > 0)
+	shmcache_put (SHMCACHE_TLS_SESSION, key, der, len, ttl);
+    }
+}
+
 static SSL *
 starttls_create_ssl (smtp_session_t session)
 {
   char buf[2048];
   char *keyfile;
   SSL *ssl;
+  SSL_SESSION *ssl_session;
   ckf_t status;
 
   ssl = SSL_new (session->starttls_ctx);
+  if (ssl != NULL && session->tls_async)
+    SSL_set_mode (ssl, SSL_MODE_ASYNC);
+  if (ssl != NULL && session->tls_resumption
+      && (ssl_session = tls_session_lookup (session)) != NULL)
+    {
+      SSL_set_session (ssl, ssl_session);
+      SSL_SESSION_free (ssl_session);
+    }
 
   /* Client certificate policy: if a host specific client certificate
      is found it is presented to the server if requested. */
@@ -446,7 +604,11 @@ smtp_starttls_set_ctx (smtp_session_t session, SSL_CTX *ctx)
 {
   SMTPAPI_CHECK_ARGS (session != NULL, 0);
 
-  SSL_CTX_up_ref (ctx);
+  /* Take a reference to the new SSL_CTX before releasing the one the
+     session held in case they are the same.  */
+  if (ctx != NULL)
+    SSL_CTX_up_ref (ctx);
+  SSL_CTX_free (session->starttls_ctx);
   session->starttls_ctx = ctx;
   return 1;
 }
@@ -460,9 +622,17 @@ smtp_starttls_set_ctx (smtp_session_t session, SSL_CTX *ctx)
  * %Starttls_REQUIRED the protocol will quit rather than transferring any
  * messages if the STARTTLS extension is not available.
  *
+ * If set to %Starttls_IMPLICIT, TLS is negotiated as soon as the connection
+ * is established and the server's greeting is read over TLS, as on the
+ * submissions port (RFC 8314).  This saves the round trips for STARTTLS
+ * and the second EHLO.  The application must select the appropriate port,
+ * normally 465, using smtp_set_server().  The server certificate is
+ * checked and %SMTP_EV_STARTTLS_OK is reported exactly as for STARTTLS and
+ * TLS sessions are resumed if enabled with smtp_starttls_set_resumption().
+ *
  * Returns: Zero on failure, non-zero on success.
  */
-/* how == 0: disabled, 1: if possible, 2: required */
+/* how == 0: disabled, 1: if possible, 2: required, 3: implicit */
 int
 smtp_starttls_enable (smtp_session_t session, enum starttls_option how)
 {
@@ -476,35 +646,155 @@ smtp_starttls_enable (smtp_session_t session, enum starttls_option how)
   return 1;
 }
 
+/**
+ * smtp_starttls_set_resumption() - Resume TLS sessions.
+ * @session: The session.
+ * @enable: Non-zero to resume TLS sessions.
+ *
+ * When enabled, the TLS session negotiated with the server is saved in a
+ * process wide cache when the connection is closed and offered to the
+ * server on the next connection to the same host and port.  If the
+ * server accepts it the abbreviated handshake avoids the public key
+ * operations of a full handshake, which is significant when an
+ * application makes many short connections to the same server.
+ *
+ * Sessions are only resumed with the same SSL_CTX that negotiated them.
+ * The server certificate is checked as usual after a resumed handshake.
+ *
+ * Returns: Zero on failure, non-zero on success.
+ */
+int
+smtp_starttls_set_resumption (smtp_session_t session, int enable)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL, 0);
+
+  session->tls_resumption = !!enable;
+  return 1;
+}
+
+/**
+ * smtp_starttls_set_early_data() - Send EHLO as TLS 1.3 early data.
+ * @session: The session.
+ * @enable: Non-zero to send EHLO as early data.
+ *
+ * When using %Starttls_IMPLICIT and resuming a TLS 1.3 session for which the
+ * server permits early data, send the EHLO command with the handshake instead
+ * of waiting for the server's greeting.  This overlaps the EHLO round trip
+ * with the handshake.  Only EHLO is sent as early data since it is safe for
+ * an attacker to replay it.  If the server rejects the early data, EHLO is
+ * sent as usual after the greeting.
+ *
+ * This is an optimisation for servers known to accept it.  RFC 5321 requires
+ * the client to wait for the greeting and some servers treat commands sent
+ * before it as a sign of abuse.  TLS session resumption must be enabled
+ * using smtp_starttls_set_resumption().
+ *
+ * Returns: Zero on failure, non-zero on success.
+ */
+int
+smtp_starttls_set_early_data (smtp_session_t session, int enable)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL, 0);
+
+  session->tls_early_data = !!enable;
+  return 1;
+}
+
+/**
+ * smtp_starttls_set_async() - Use OpenSSL asynchronous jobs.
+ * @session: The session.
+ * @enable: Non-zero to enable asynchronous mode.
+ *
+ * Set %SSL_MODE_ASYNC on the session's TLS connections so that an
+ * asynchronous crypto engine or provider, such as a hardware accelerator,
+ * can perform the public key operations of the handshake.  While the
+ * engine is working libESMTP waits in poll() on the descriptors supplied by
+ * the engine, subject to the session's timeouts, instead of occupying the
+ * CPU.  Without an asynchronous engine this has no effect other than a
+ * small overhead.
+ *
+ * Returns: Zero on failure, non-zero on success.
+ */
+int
+smtp_starttls_set_async (smtp_session_t session, int enable)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL, 0);
+
+  session->tls_async = !!enable;
+  return 1;
+}
+
 int
 select_starttls (smtp_session_t session)
 {
+  char key[1024];
+  unsigned long extensions;
+
   if (session->using_tls || session->authenticated)
     return 0;
-  /* FIXME: if the server has reported the TLS extension in a previous
-	    session promote Starttls_ENABLED to Starttls_REQUIRED.
-	    If this session does not offer STARTTLS, this will force
-	    protocol.c to report the extension as not available and QUIT
-	    as recommended in RFC 3207.  This requires some form of db
-	    storage to record this for future sessions. */
-  /* if (...)
-      session->starttls_enabled = Starttls_REQUIRED; */
+  /* If the server has reported the TLS extension in a previous session
+     promote Starttls_ENABLED to Starttls_REQUIRED.  If this session does
+     not offer STARTTLS, this will force protocol.c to report the
+     extension as not available and QUIT as recommended in RFC 3207.
+     Previous sessions are recorded in the shared cache.  */
+  if (session->starttls_enabled != Starttls_DISABLED && session->host != NULL
+      && shmcache_enabled ())
+    {
+      snprintf (key, sizeof key, "%s:%s", session->host, session->port);
+      if (session->extensions & EXT_STARTTLS)
+	shmcache_put (SHMCACHE_CAPABILITIES, key, &session->extensions,
+		      sizeof session->extensions, CAPABILITIES_TTL);
+      else if (session->starttls_enabled == Starttls_ENABLED
+	       && shmcache_get (SHMCACHE_CAPABILITIES, key, &extensions,
+				sizeof extensions) == (int) sizeof extensions
+	       && (extensions & EXT_STARTTLS))
+	session->starttls_enabled = Starttls_REQUIRED;
+    }
   if (!(session->extensions & EXT_STARTTLS))
     return 0;
   if (session->starttls_enabled == Starttls_DISABLED)
     return 0;
-  /* Create a CTX if the application has not already done so. */
+  return prepare_starttls_context (session);
+}
+
+/* Create a CTX if the application has not already done so. */
+int
+prepare_starttls_context (smtp_session_t session)
+{
   if (session->starttls_ctx == NULL)
     session->starttls_ctx = starttls_create_ctx (session);
   return session->starttls_ctx != NULL;
 }
 
+/* Index of the SSL_SESSION ex_data marking sessions whose certificate was
+   verified and matched the server name.  The value points to tls_verified
+   and is never dereferenced, so sessions copied by OpenSSL when a TLS 1.3
+   session ticket arrives keep the mark.  */
+static char tls_verified;
+
+static int
+tls_verified_index (void)
+{
+  static int index = -1;
+
+#ifdef USE_PTHREADS
+  pthread_mutex_lock (&starttls_mutex);
+#endif
+  if (index < 0)
+    index = SSL_SESSION_get_ex_new_index (0, NULL, NULL, NULL, NULL);
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock (&starttls_mutex);
+#endif
+  return index;
+}
+
 static int
 check_acceptable_security (smtp_session_t session, SSL *ssl)
 {
   X509 *cert;
+  SSL_SESSION *ssl_session;
   const char *host;
-  int bits;
+  int bits, index;
   long vfy_result;
   int ok;
 
@@ -543,9 +833,15 @@ check_acceptable_security (smtp_session_t session, SSL *ssl)
 	return 0;
     }
 
-  /* Check server credentials stored in the certificate.
-   */
+  /* Check server credentials stored in the certificate.  A resumed
+     session proves that the server holds the secret negotiated with a
+     server whose name was checked previously, so the check is skipped.  */
   ok = 0;
+  ssl_session = SSL_get_session (ssl);
+  index = tls_verified_index ();
+  if (SSL_session_reused (ssl) && index >= 0
+      && SSL_SESSION_get_ex_data (ssl_session, index) != NULL)
+    return 1;
   cert = SSL_get_peer_certificate (ssl);
   if (cert == NULL)
     {
@@ -556,81 +852,135 @@ check_acceptable_security (smtp_session_t session, SSL *ssl)
   else
     {
       char buf[256] = { 0 };
-      STACK_OF(GENERAL_NAME) *altnames;
-      int hasaltname = 0;
 
-      altnames = X509_get_ext_d2i (cert, NID_subject_alt_name, NULL, NULL);
-      if (altnames != NULL)
+      /* X509_check_host() checks the DNS subjectAltNames or, if there
+	 are none, the subject common name.  */
+      if (X509_check_host (cert, host, 0, 0, NULL) == 1)
 	{
-	  int i;
-
-	  for (i = 0; i < sk_GENERAL_NAME_num (altnames); ++i)
-	    {
-	      GENERAL_NAME *name = sk_GENERAL_NAME_value (altnames, i);
-
-	      if (name->type == GEN_DNS)
-		{
-		  const char *ia5str = (const char *) name->d.ia5->data;
-		  size_t ia5len = name->d.ia5->length;
-
-		  hasaltname = 1;
-		  if (strlen (ia5str) == ia5len && match_domain (host, ia5str))
-		    ok = 1;
-		  else
-		    strlcpy (buf, ia5str, sizeof buf);
-		}
-	      // TODO: handle GEN_IPADD
-	    }
-	  sk_GENERAL_NAME_pop_free (altnames, GENERAL_NAME_free);
+	  ok = 1;
+	  if (vfy_result == X509_V_OK && index >= 0)
+	    SSL_SESSION_set_ex_data (ssl_session, index, &tls_verified);
 	}
-
-      if (!hasaltname)
+      else
 	{
-	  X509_NAME *subj = X509_get_subject_name (cert);
-
-	  if (subj != NULL)
-	    {
-	      ASN1_STRING *cn;
-	      int idx, i = -1;
-
-	      do
-		{
-		  idx = i;
-		  i = X509_NAME_get_index_by_NID (subj, NID_commonName, i);
-		}
-	      while (i >= 0);
-
-	      if (idx >= 0
-		  && (cn = X509_NAME_ENTRY_get_data (
-						X509_NAME_get_entry (subj, idx)
-						     )) != NULL)
-		{
-		  unsigned char *ustr = NULL;
-		  const char *str;
-		  size_t len;
-
-		  len = ASN1_STRING_to_UTF8 (&ustr, cn);
-		  if ((str = (const char *) ustr) != NULL)
-		    {
-		      if (strlen (str) == len && match_domain (host, str))
-			ok = 1;
-		      else
-			strlcpy (buf, str, sizeof buf);
-		      OPENSSL_free (ustr);
-		    }
-		}
-	    }
+	  X509_NAME_get_text_by_NID (X509_get_subject_name (cert),
+				     NID_commonName, buf, sizeof buf);
+	  if (session->event_cb != NULL)
+	    (*session->event_cb) (session, SMTP_EV_WRONG_PEER_CERTIFICATE,
+				  session->event_cb_arg, &ok, buf, ssl);
 	}
-
-      if (!ok && session->event_cb != NULL)
-	(*session->event_cb) (session, SMTP_EV_WRONG_PEER_CERTIFICATE,
-			      session->event_cb_arg, &ok, buf, ssl);
-
       X509_free (cert);
     }
   return ok;
 }
 
+/* Perform the TLS handshake on the connection.  If early is not NULL,
+   its *early_len octets are sent as early data and *early_len is set to
+   the number of octets the server accepted.  */
+static SSL *
+tls_handshake (siobuf_t conn, smtp_session_t session, SSL *ssl,
+	       const char *early, int *early_len)
+{
+  struct timespec start;
+  int ok;
+
+  PROBE1 (tls__handshake__start, session);
+  metrics_now (&start);
+  if (ssl != NULL && early != NULL)
+    {
+      *early_len = sio_set_tlsclient_early (conn, ssl, early, *early_len);
+      ok = *early_len >= 0;
+    }
+  else
+    ok = sio_set_tlsclient_ssl (conn, ssl);
+  if (ok)
+    metrics_time (session->metrics, METRICS_TLS_TIME, &start);
+  else
+    metrics_count (session->metrics, METRICS_TLS_FAILURES, 1);
+  PROBE2 (tls__handshake__done, session, ok);
+  return ok ? ssl : NULL;
+}
+
+/* Check the security of a newly established TLS connection and report
+   it to the application.  Returns zero if it is not acceptable.  */
+static int
+tls_established (smtp_session_t session, SSL *ssl)
+{
+  X509 *cert;
+  char buf[256];
+
+  session->using_tls = 1;
+  if (!check_acceptable_security (session, ssl))
+    return 0;
+
+  if (session->event_cb != NULL)
+    (*session->event_cb) (session, SMTP_EV_STARTTLS_OK,
+			  session->event_cb_arg,
+			  ssl, SSL_get_cipher (ssl),
+			  SSL_get_cipher_bits (ssl, NULL));
+  cert = SSL_get_certificate (ssl);
+  if (cert != NULL)
+    {
+      /* Copy the common name [typically email address] from the
+	 client certificate and use it to prime the SASL EXTERNAL
+	 mechanism */
+      X509_NAME_get_text_by_NID (X509_get_subject_name (cert),
+				 NID_commonName, buf, sizeof buf);
+      if (session->auth_context != NULL)
+	auth_set_external_id (session->auth_context, buf);
+    }
+  return 1;
+}
+
+/* Negotiate TLS immediately after connecting, before the greeting, as
+   on the submissions port (RFC 8314).  Returns zero if the handshake
+   fails or the connection is not acceptable.  */
+int
+implicit_tls (siobuf_t conn, smtp_session_t session)
+{
+  char ehlo[1024], *early = NULL;
+  SSL *ssl = NULL;
+  SSL_SESSION *ssl_session;
+  int len = 0;
+
+  if (prepare_starttls_context (session))
+    ssl = starttls_create_ssl (session);
+
+  /* When resuming a session for which the server permits early data, EHLO
+     may be sent with the handshake.  EHLO is idempotent, so a replay of
+     the early data by an attacker is harmless.  Nothing else is sent as
+     early data.  */
+  session->early_ehlo = 0;
+  if (ssl != NULL && session->tls_early_data
+      && (ssl_session = SSL_get_session (ssl)) != NULL)
+    {
+      len = snprintf (ehlo, sizeof ehlo, "EHLO %s\r\n", session->localhost);
+      if (len > 0 && len < (int) sizeof ehlo
+	  && (uint32_t) len <= SSL_SESSION_get_max_early_data (ssl_session))
+	early = ehlo;
+    }
+
+  if ((ssl = tls_handshake (conn, session, ssl, early, &len)) == NULL)
+    {
+      set_error (SMTP_ERR_CLIENT_ERROR);
+      return 0;
+    }
+  if (early != NULL)
+    {
+      /* If the server rejected the early data, EHLO is sent as usual
+	 after the greeting.  */
+      session->early_ehlo = len > 0;
+      metrics_count (session->metrics, len > 0 ? METRICS_TLS_EARLY_DATA
+					       : METRICS_TLS_EARLY_REJECTED, 1);
+    }
+  if (!tls_established (session, ssl))
+    {
+      set_error (SMTP_ERR_CLIENT_ERROR);
+      return 0;
+    }
+  return 1;
+}
+
 void
 cmd_starttls (siobuf_t conn, smtp_session_t session)
 {
@@ -643,8 +993,6 @@ rsp_starttls (siobuf_t conn, smtp_session_t session)
 {
   int code;
   SSL *ssl;
-  X509 *cert;
-  char buf[256];
 
   code = read_smtp_response (conn, session, &session->mta_status, NULL);
   if (code < 0)
@@ -659,40 +1007,19 @@ rsp_starttls (siobuf_t conn, smtp_session_t session)
 	set_error (SMTP_ERR_INVALID_RESPONSE_STATUS);
       session->rsp_state = S_quit;
     }
-  else if (sio_set_tlsclient_ssl (conn, (ssl = starttls_create_ssl (session))))
+  else if ((ssl = tls_handshake (conn, session, starttls_create_ssl (session),
+				 NULL, NULL)) != NULL)
     {
-      session->using_tls = 1;
-
       /* Forget what we know about the server and reset protocol state.
        */
       session->extensions = 0;
       destroy_auth_mechanisms (session);
 
-      if (!check_acceptable_security (session, ssl))
+      if (!tls_established (session, ssl))
 	session->rsp_state = S_quit;
       else
-	{
-	  if (session->event_cb != NULL)
-	    (*session->event_cb) (session, SMTP_EV_STARTTLS_OK,
-				  session->event_cb_arg,
-				  ssl, SSL_get_cipher (ssl),
-				  SSL_get_cipher_bits (ssl, NULL));
-	  cert = SSL_get_certificate (ssl);
-	  if (cert != NULL)
-	    {
-	      /* Copy the common name [typically email address] from the
-		 client certificate and use it to prime the SASL EXTERNAL
-		 mechanism */
-	      X509_NAME_get_text_by_NID (X509_get_subject_name (cert),
-					 NID_commonName, buf, sizeof buf);
-	      X509_free (cert);
-	      if (session->auth_context != NULL)
-		auth_set_external_id (session->auth_context, buf);
-	    }
-
-	  /* Next state is EHLO */
-	  session->rsp_state = S_ehlo;
-	}
+	/* Next state is EHLO */
+	session->rsp_state = S_ehlo;
     }
   else
     {
@@ -730,6 +1057,33 @@ smtp_starttls_enable (smtp_session_t session,
   return 0;
 }
 
+int
+smtp_starttls_set_resumption (smtp_session_t session,
+			      int enable __attribute__ ((unused)))
+{
+  SMTPAPI_CHECK_ARGS (session != (smtp_session_t) 0, 0);
+
+  return 0;
+}
+
+int
+smtp_starttls_set_early_data (smtp_session_t session,
+			      int enable __attribute__ ((unused)))
+{
+  SMTPAPI_CHECK_ARGS (session != (smtp_session_t) 0, 0);
+
+  return 0;
+}
+
+int
+smtp_starttls_set_async (smtp_session_t session,
+			 int enable __attribute__ ((unused)))
+{
+  SMTPAPI_CHECK_ARGS (session != (smtp_session_t) 0, 0);
+
+  return 0;
+}
+
 int
 smtp_starttls_set_password_cb (smtp_starttls_passwordcb_t cb
 							__attribute__ ((unused)),
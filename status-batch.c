@@ -0,0 +1,142 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2002-2004  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <time.h>
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+
+/**
+ * DOC: Status Batches
+ *
+ * Batched Status Reports
+ * ----------------------
+ *
+ * The %SMTP_EV_RCPTSTATUS and %SMTP_EV_MESSAGESENT events report the
+ * status of each recipient and message as soon as it is known.  An
+ * application which records each status in a database may find that
+ * a transaction per event limits throughput.  Instead the application may
+ * supply a buffer in which libESMTP accumulates status reports, which are
+ * then passed to a callback in batches.
+ *
+ * A batch is passed to the callback when the buffer is full, when all
+ * the responses to a batch of pipelined commands have been read, when the
+ * oldest report in the buffer reaches a configurable age and when the
+ * connection to the server is closed.  Since libESMTP only checks the age
+ * of the reports while processing responses from the server, a batch may
+ * be delayed while waiting for a slow server.
+ *
+ * The status pointers in the records remain valid until the status is
+ * reset, which happens only when another attempt is made to send the
+ * message.  Events continue to be reported as usual.
+ */
+
+/**
+ * smtp_set_status_batch() - Batch status reports.
+ * @session: The session.
+ * @records: Buffer for status records, or NULL to disable batching.
+ * @nrecords: Number of records in the buffer.
+ * @timeout: Maximum age of a report in milliseconds, or zero.
+ * @cb: Callback to receive batches of status reports.
+ * @arg: Application data (closure) passed to the callback.
+ *
+ * Accumulate recipient and message status reports in @records and pass
+ * them to @cb in batches.  The buffer belongs to the application and must
+ * remain valid until the session is destroyed or batching is disabled.
+ * Each session needs its own buffer, so the setting is not copied to
+ * sessions created from a shared configuration.
+ *
+ * Return: Non zero on success, zero on failure.
+ */
+int
+smtp_set_status_batch (smtp_session_t session,
+		       struct smtp_status_record *records, int nrecords,
+		       long timeout, smtp_status_batchcb_t cb, void *arg)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL && timeout >= 0, 0);
+  SMTPAPI_CHECK_ARGS (records == NULL || (nrecords > 0 && cb != NULL), 0);
+
+  status_batch_flush (session);
+  session->status_records = records;
+  session->status_max = records != NULL ? nrecords : 0;
+  session->status_count = 0;
+  session->status_timeout = timeout;
+  session->status_cb = cb;
+  session->status_cb_arg = arg;
+  return 1;
+}
+
+/* Pass the buffered status reports to the application.  */
+void
+status_batch_flush (smtp_session_t session)
+{
+  int count;
+
+  if (session->status_count == 0)
+    return;
+  count = session->status_count;
+  session->status_count = 0;
+  (*session->status_cb) (session, session->status_records, count,
+			 session->status_cb_arg);
+}
+
+/* Flush the buffer if the oldest report has reached the maximum age.  */
+void
+status_batch_check (smtp_session_t session)
+{
+  struct timespec now;
+  long msec;
+
+  if (session->status_count == 0 || session->status_timeout == 0)
+    return;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  msec = (now.tv_sec - session->status_first.tv_sec) * 1000L
+	 + (now.tv_nsec - session->status_first.tv_nsec) / 1000000L;
+  if (msec >= session->status_timeout)
+    status_batch_flush (session);
+}
+
+/* Record the status of a recipient or, if recipient is NULL, of the
+   message.  */
+void
+status_batch_add (smtp_session_t session, smtp_message_t message,
+		  smtp_recipient_t recipient)
+{
+  struct smtp_status_record *record;
+
+  if (session->status_max == 0)
+    return;
+  if (session->status_count == 0)
+    clock_gettime (CLOCK_MONOTONIC, &session->status_first);
+  record = &session->status_records[session->status_count++];
+  record->message = message;
+  record->recipient = recipient;
+  record->status = recipient != NULL ? &recipient->status
+				     : &message->message_status;
+  if (session->status_count == session->status_max)
+    status_batch_flush (session);
+  else
+    status_batch_check (session);
+}
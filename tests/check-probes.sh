@@ -0,0 +1,35 @@
+#!/bin/sh
+# Check that libesmtp was built with its USDT probes.
+#
+# usage: check-probes.sh library enabled
+#
+# If the probes are enabled, each probe listed in probes.h must have a
+# stapsdt ELF note in the "libesmtp" provider.  Otherwise the test is
+# skipped.
+
+lib=$1
+enabled=$2
+
+if [ "$enabled" != true ]; then
+  echo "USDT probes not enabled"
+  exit 77
+fi
+if ! command -v readelf >/dev/null 2>&1; then
+  echo "readelf not found"
+  exit 77
+fi
+
+notes=$(readelf -n "$lib" | awk '
+  /Provider:/	{ provider = $2 }
+  /Name:/	{ if (provider == "libesmtp") print $2 }')
+
+status=0
+for probe in cmd rsp sio__flush sio__fill \
+	     tls__handshake__start tls__handshake__done \
+	     dns__start dns__done message__start message__done; do
+  if ! echo "$notes" | grep -qx "$probe"; then
+    echo "missing probe: $probe"
+    status=1
+  fi
+done
+exit $status
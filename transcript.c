@@ -0,0 +1,149 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2002-2004  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+
+/**
+ * DOC: Transcripts
+ *
+ * Transcripts
+ * -----------
+ *
+ * libESMTP can record a transcript of each connection to the server for
+ * later analysis or to reproduce the server's behaviour.  The transcript
+ * captures the replies from the server in full together with their
+ * timing, and the amount, but not the content, of the data sent by the
+ * client.  Data is recorded above the TLS layer and includes the message
+ * content.
+ *
+ * A transcript is a text file starting with the line
+ * ``%libesmtp-transcript 1``.  Each connection starts with a line
+ * containing ``A``.  Data sent by the client is recorded as a line
+ * ``C <usec> <octets> <lines>`` and data received from the server as a
+ * line ``S <usec> <octets>`` immediately followed by the octets received.
+ * Since the lines sent by the client are counted, a replay can follow the
+ * recording even though headers such as ``Message-Id`` vary in length.
+ * ``<usec>`` is the time in microseconds since the previous record in
+ * the same connection.  Client records correspond to each write to the
+ * network and server records to each read, so the timing of pipelined
+ * replies is preserved.
+ *
+ * The ``smtp-replay`` example program replays the server side of a
+ * transcript so that slow or unusual server behaviour may be reproduced
+ * on the loopback interface.
+ */
+
+#define TRANSCRIPT_MAGIC	"%libesmtp-transcript 1\n"
+
+/* Write the buffer completely, giving up if there is an error.  */
+static void
+write_all (int fd, const char *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0)
+    {
+      if ((n = write (fd, buf, len)) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return;
+	}
+      buf += n;
+      len -= n;
+    }
+}
+
+/* Record the start of a connection.  */
+void
+transcript_connect (smtp_session_t session)
+{
+  write_all (session->transcript_fd, "A\n", 2);
+  clock_gettime (CLOCK_MONOTONIC, &session->transcript_time);
+}
+
+/* Siobuf record callback.  */
+void
+transcript_record (const char *buf, int len, int writing, void *arg)
+{
+  smtp_session_t session = arg;
+  struct timespec now;
+  const char *p, *end;
+  char line[64];
+  long usec;
+  int lines;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  usec = (now.tv_sec - session->transcript_time.tv_sec) * 1000000L
+	 + (now.tv_nsec - session->transcript_time.tv_nsec) / 1000L;
+  session->transcript_time = now;
+
+  if (writing)
+    {
+      lines = 0;
+      end = buf + len;
+      for (p = buf; (p = memchr (p, '\n', end - p)) != NULL; p++)
+	lines++;
+      write_all (session->transcript_fd, line,
+		 snprintf (line, sizeof line, "C %ld %d %d\n",
+			   usec, len, lines));
+    }
+  else
+    {
+      write_all (session->transcript_fd, line,
+		 snprintf (line, sizeof line, "S %ld %d\n", usec, len));
+      write_all (session->transcript_fd, buf, len);
+    }
+}
+
+/**
+ * smtp_set_transcript_fd() - Record a transcript.
+ * @session: The session.
+ * @fd: File descriptor open for writing or -1.
+ *
+ * Record a transcript of each connection made by the session to @fd.  The
+ * file header is written immediately.  The descriptor remains owned by
+ * the application, which must keep it open while the session is in
+ * progress.  Errors writing the transcript are ignored.  Specify @fd as
+ * -1 to stop recording.
+ *
+ * Return: Non zero on success, zero on failure.
+ */
+int
+smtp_set_transcript_fd (smtp_session_t session, int fd)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL && fd >= -1, 0);
+
+  session->transcript_fd = fd;
+  if (fd >= 0)
+    write_all (fd, TRANSCRIPT_MAGIC, sizeof TRANSCRIPT_MAGIC - 1);
+  return 1;
+}